@@ -1,37 +1,430 @@
 #pragma once
-#include <Windows.h>
 #include <cstddef>
 #include <iostream>
+#include <string>
+#include <cassert>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include "profile.h"
+#include "color.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
 #include <tchar.h>
 #include <conio.h>
 #include <strsafe.h>
-#include <cassert>
+#else
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Output cost of a single ConsoleWindow::draw() call
+struct ConsoleFrameStats
+{
+	size_t cellsChanged = 0;		// cells that differed from the previous frame
+	size_t bytesWritten = 0;		// bytes handed to the terminal
+	size_t syscalls = 0;			// write calls needed to hand them over
+	double waitMs = 0;				// time draw() waited for the previous frame to be written
+};
+
+// Encodes a frame of characters as ANSI escape sequences, keeping a copy of the last frame
+// so that only cells that changed are sent.  Changed cells are grouped into runs; the
+// cursor is moved between runs with CUP/CUF escapes, and short gaps of unchanged cells are
+// simply written again since that is cheaper than a cursor jump.
+//
+// With colour, the foreground colour is only set when a cell's colour is noticeably different
+// from the one in effect, so a run of cells of (nearly) the same colour costs one escape.
+// Blanks show no colour, so they never set it and never count as changed because of it.
+class AnsiFrameEncoder
+{
+private:
+	int frameWidth;
+	int frameHeight;
+
+	std::string previousFrame;		// characters currently on the terminal
+	bool fullRedraw;
+
+	// Longest run of unchanged cells that is rewritten instead of jumped over
+	static const int maxRewriteGap = 4;
+
+	ColorMode colorMode = ColorMode::Mono;
+	bool coalesce = true;
+	std::vector<uint32_t> previousColors;	// colour each cell is shown in, as sent (see terminalColor)
+	uint32_t pen = 0;						// colour in effect on the terminal
+	bool penKnown = false;
+
+	// Largest difference in any channel between 24-bit colours that are taken to be the same
+	static const int colorTolerance = 8;
+
+	// What is sent for a colour: itself, or its palette entry
+	uint32_t terminalColor(uint32_t color) const
+	{
+		return colorMode == ColorMode::Palette256 ? AnsiPalette::instance().index(color) : color;
+	}
+
+	bool sameColor(uint32_t a, uint32_t b) const
+	{
+		if (colorMode == ColorMode::Palette256) return a == b;
+		return std::abs(colorRed(a) - colorRed(b)) <= colorTolerance && std::abs(colorGreen(a) - colorGreen(b)) <= colorTolerance
+			&& std::abs(colorBlue(a) - colorBlue(b)) <= colorTolerance;
+	}
+
+	// SGR 38;5;n or 38;2;r;g;b
+	void setPen(std::string &out, uint32_t color)
+	{
+		if (colorMode == ColorMode::Palette256)
+		{
+			out += "\x1b[38;5;";
+			appendNumber(out, (int)color);
+		}
+		else
+		{
+			out += "\x1b[38;2;";
+			appendNumber(out, colorRed(color));
+			out += ';';
+			appendNumber(out, colorGreen(color));
+			out += ';';
+			appendNumber(out, colorBlue(color));
+		}
+		out += 'm';
+		pen = color;
+		penKnown = true;
+	}
+
+	// Would writing the cells [first, first + count) again in the current colour leave them
+	// looking the same?
+	bool penMatches(int first, int count) const
+	{
+		for (int i = first; i < first + count; i++)
+		{
+			if (previousFrame[i] != ' ' && (!penKnown || !sameColor(previousColors[i], pen))) return false;
+		}
+		return true;
+	}
+
+	static char toTerminalChar(wchar_t c)
+	{
+		// the frame may contain string terminators (from swprintf) or characters the
+		// terminal would need multibyte encoding for; both are shown as blanks/placeholders
+		if (c == L'\0') return ' ';
+		if (c < 0x20 || c > 0x7e) return '?';
+		return (char)c;
+	}
+
+	static void appendNumber(std::string &out, int n)
+	{
+		char digits[12];
+		int count = 0;
+		do { digits[count++] = (char)('0' + n % 10); n /= 10; } while (n > 0);
+		while (count--) out += digits[count];
+	}
+
+	static int numberLength(int n)
+	{
+		int length = 1;
+		while (n >= 10) { n /= 10; length++; }
+		return length;
+	}
+
+	// Emit the shortest escape that moves the cursor from column cursorX (-1 if unknown) to (x, y)
+	static void moveCursor(std::string &out, int cursorX, int x, int y)
+	{
+		if (cursorX >= 0 && x > cursorX && numberLength(x - cursorX) < numberLength(y + 1) + numberLength(x + 1) + 1)
+		{
+			// cursor forward: ESC [ n C
+			out += "\x1b[";
+			appendNumber(out, x - cursorX);
+			out += 'C';
+			return;
+		}
+
+		// cursor position (1-based): ESC [ row ; col H
+		out += "\x1b[";
+		appendNumber(out, y + 1);
+		out += ';';
+		appendNumber(out, x + 1);
+		out += 'H';
+	}
+
+public:
+	AnsiFrameEncoder(int width, int height) : frameWidth(width), frameHeight(height), previousFrame(width * height, ' '), fullRedraw(true) {}
+
+	// Forget what is on the terminal; the next encode() sends every cell
+	void invalidate()
+	{
+		fullRedraw = true;
+		penKnown = false;
+	}
+
+	// Colours passed to encode() are sent as mode says; Mono ignores them
+	void setColorMode(ColorMode mode)
+	{
+		colorMode = mode;
+		previousColors.assign(frameWidth * frameHeight, 0);
+		invalidate();
+	}
+
+	// Don't rely on the colour the last frame left in effect: the next frame sets its own
+	void forgetColor() { penKnown = false; }
+
+	// With coalescing off, every cell written sets its colour first, for comparison
+	void setCoalescing(bool enabled) { coalesce = enabled; }
+
+	// Append the escapes that bring the terminal from the previous frame to 'frame' to 'out'.
+	// Returns the number of cells that changed.
+	size_t encode(const wchar_t *frame, std::string &out)
+	{
+		return encode(frame, nullptr, out);
+	}
+
+	// The same, with the 0xRRGGBB colour of each cell in colors (or nullptr)
+	size_t encode(const wchar_t *frame, const uint32_t *colors, std::string &out)
+	{
+		size_t cellsChanged = 0;
+		bool color = colors && colorMode != ColorMode::Mono;
+
+		if (fullRedraw)
+		{
+			out += "\x1b[H\x1b[2J";
+		}
+
+		for (int y = 0; y < frameHeight; y++)
+		{
+			// cursor column on this row, -1 when unknown (e.g. pending wrap after the last column)
+			int cursorX = -1;
+
+			for (int x = 0; x < frameWidth; x++)
+			{
+				int i = y * frameWidth + x;
+				char c = toTerminalChar(frame[i]);
+				uint32_t want = color ? terminalColor(colors[i]) : 0;
+				if (!fullRedraw && c == previousFrame[i] && (!color || c == ' ' || sameColor(want, previousColors[i]))) continue;
+
+				if (cursorX != x)
+				{
+					if (cursorX >= 0 && x > cursorX && x - cursorX <= maxRewriteGap && (!color || penMatches(y * frameWidth + cursorX, x - cursorX)))
+					{
+						// the skipped cells are unchanged, so rewriting them is invisible
+						out.append(previousFrame, y * frameWidth + cursorX, x - cursorX);
+						if (color)
+						{
+							for (int k = y * frameWidth + cursorX; k < i; k++)
+								if (previousFrame[k] != ' ') previousColors[k] = pen;
+						}
+					}
+					else
+					{
+						moveCursor(out, cursorX, x, y);
+					}
+				}
+
+				if (color)
+				{
+					if (c != ' ' && (!coalesce || !penKnown || !sameColor(want, pen))) setPen(out, want);
+					previousColors[i] = c != ' ' ? pen : want;
+				}
+
+				out += c;
+				previousFrame[i] = c;
+				cellsChanged++;
+
+				cursorX = x + 1 < frameWidth ? x + 1 : -1;
+			}
+		}
 
+		fullRedraw = false;
+		return cellsChanged;
+	}
+};
+
+// Double buffered console.  Frames are drawn into the back buffer; draw() copies it to the
+// front buffer and returns, and a presenter thread writes the front buffer to the console while
+// the next frame is being drawn.  The back buffer keeps its contents across draw() calls.
 class ConsoleWindow
 {
 private:
 	int screenWidth = 120;			// Console Screen Size X (columns)
 	int screenHeight = 40;			// Console Screen Size Y (rows)
 
-	wchar_t *screenBuffer;
+	wchar_t *screenBuffer;			// back buffer
+	wchar_t *presentBuffer;			// front buffer, owned by the presenter while a frame is pending
+
+	// colour of each cell of the two buffers (see color.h); null without colour
+	uint32_t *colorBuffer = nullptr;
+	uint32_t *presentColors = nullptr;
+
+	ConsoleFrameStats frameStats;	// cost of the last frame written
+	ConsoleFrameStats totalStats;	// accumulated over every frame
+	size_t framesDrawn = 0;
+
+	// presenter thread; without it draw() writes the frame itself
+	std::thread presenter;
+	std::mutex presentMutex;
+	std::condition_variable presentCondition;
+	bool framePending = false;
+	bool stopPresenting = false;
+	double pendingWaitMs = 0;
+
+	AnsiFrameEncoder encoder;
+	std::string output;
+
+#ifdef _WIN32
 	HANDLE hConsole;
 	DWORD dwBytesWritten;
+#else
+	bool closed = false;
 
-public:
-	ConsoleWindow(int width, int height) : screenWidth(width), screenHeight(height)
+	// Write the whole string to the terminal, returns the number of write() calls it took
+	size_t writeAll(const std::string &data)
+	{
+		size_t calls = 0;
+		size_t offset = 0;
+		while (offset < data.size())
+		{
+			ssize_t written = write(STDOUT_FILENO, data.data() + offset, data.size() - offset);
+			calls++;
+			if (written < 0)
+			{
+				if (errno == EINTR) continue;
+				break;
+			}
+			offset += (size_t)written;
+		}
+		return calls;
+	}
+#endif
+
+	void recordFrame(const ConsoleFrameStats &stats)
+	{
+		frameStats = stats;
+		totalStats.cellsChanged += stats.cellsChanged;
+		totalStats.bytesWritten += stats.bytesWritten;
+		totalStats.syscalls += stats.syscalls;
+		totalStats.waitMs += stats.waitMs;
+		framesDrawn++;
+	}
+
+	// Write the front buffer to the console
+	ConsoleFrameStats present()
+	{
+		WT_PROFILE_SCOPE(Draw);
+		ConsoleFrameStats stats;
+#ifdef _WIN32
+		if (presentColors)
+		{
+			// colours go through the console's virtual terminal sequences, like a terminal's
+			output.clear();
+			stats.cellsChanged = encoder.encode(presentBuffer, presentColors, output);
+			WriteConsoleA(hConsole, output.data(), (DWORD)output.size(), &dwBytesWritten, NULL);
+			stats.bytesWritten = output.size();
+			stats.syscalls = 1;
+			return stats;
+		}
+
+		WriteConsoleOutputCharacter(hConsole, presentBuffer, screenWidth * screenHeight, { 0,0 }, &dwBytesWritten);
+
+		// the Win32 console always receives the whole buffer in one call
+		stats.cellsChanged = screenWidth * screenHeight;
+		stats.bytesWritten = screenWidth * screenHeight * sizeof(wchar_t);
+		stats.syscalls = 1;
+#else
+		// only send what changed since the last frame, in a single write
+		output.clear();
+		stats.cellsChanged = encoder.encode(presentBuffer, presentColors, output);
+		stats.bytesWritten = output.size();
+		stats.syscalls = writeAll(output);
+#endif
+		return stats;
+	}
+
+	void presentLoop()
+	{
+		std::unique_lock<std::mutex> lock(presentMutex);
+		for (;;)
+		{
+			presentCondition.wait(lock, [&] { return framePending || stopPresenting; });
+			if (!framePending) return;
+
+			// draw() leaves the front buffer alone until framePending is cleared
+			lock.unlock();
+			ConsoleFrameStats stats = present();
+			lock.lock();
+
+			stats.waitMs = pendingWaitMs;
+			recordFrame(stats);
+			framePending = false;
+			presentCondition.notify_all();
+		}
+	}
+
+	void allocateBuffers(bool presenterThread, ColorMode colorMode)
 	{
 		screenBuffer = new wchar_t[screenWidth * screenHeight];
+		presentBuffer = new wchar_t[screenWidth * screenHeight];
+		for (int i = 0; i < screenWidth * screenHeight; i++) screenBuffer[i] = presentBuffer[i] = ' ';
+
+		if (colorMode != ColorMode::Mono)
+		{
+			encoder.setColorMode(colorMode);
+			colorBuffer = new uint32_t[screenWidth * screenHeight];
+			presentColors = new uint32_t[screenWidth * screenHeight];
+			for (int i = 0; i < screenWidth * screenHeight; i++) colorBuffer[i] = presentColors[i] = textColor;
+		}
+
+		if (presenterThread) presenter = std::thread(&ConsoleWindow::presentLoop, this);
+	}
+
+	// Let the presenter write out the last frame, then stop it
+	void stopPresenter()
+	{
+		if (!presenter.joinable()) return;
+		{
+			std::lock_guard<std::mutex> lock(presentMutex);
+			stopPresenting = true;
+		}
+		presentCondition.notify_all();
+		presenter.join();
+	}
+
+public:
+#ifdef _WIN32
+	ConsoleWindow(int width, int height, bool presenterThread = true, ColorMode colorMode = ColorMode::Mono) : screenWidth(width), screenHeight(height), encoder(width, height)
+	{
 		hConsole = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
 		SetConsoleActiveScreenBuffer(hConsole);
 		dwBytesWritten = 0;
 
 		SetConsoleMode(hConsole, ENABLE_VIRTUAL_TERMINAL_PROCESSING);
 		SetConsoleTextAttribute(hConsole, FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_INTENSITY);
+
+		allocateBuffers(presenterThread, colorMode);
 	}
 
 	~ConsoleWindow()
 	{
-		delete screenBuffer;
+		close();
+		delete[] screenBuffer;
+		delete[] presentBuffer;
+		delete[] colorBuffer;
+		delete[] presentColors;
+	}
+
+	// Hand the console back to the standard output buffer
+	void close()
+	{
+		stopPresenter();
+		if (hConsole == INVALID_HANDLE_VALUE) return;
+
+		SetConsoleActiveScreenBuffer(GetStdHandle(STD_OUTPUT_HANDLE));
+		CloseHandle(hConsole);
+		hConsole = INVALID_HANDLE_VALUE;
 	}
 
 	void setTitle()
@@ -59,6 +452,39 @@ public:
 			}
 		}
 	}
+#else
+	ConsoleWindow(int width, int height, bool presenterThread = true, ColorMode colorMode = ColorMode::Mono) : screenWidth(width), screenHeight(height), encoder(width, height)
+	{
+		// switch to the alternate screen, hide the cursor and use the same cyan as the Windows console
+		writeAll("\x1b[?1049h\x1b[?25l\x1b[96m");
+
+		allocateBuffers(presenterThread, colorMode);
+	}
+
+	~ConsoleWindow()
+	{
+		close();
+		delete[] screenBuffer;
+		delete[] presentBuffer;
+		delete[] colorBuffer;
+		delete[] presentColors;
+	}
+
+	// Leave the alternate screen and restore the terminal state
+	void close()
+	{
+		stopPresenter();
+		if (closed) return;
+
+		writeAll("\x1b[0m\x1b[?25h\x1b[?1049l");
+		closed = true;
+	}
+
+	void setTitle()
+	{
+		writeAll("\x1b]0;Raytracer\x07");
+	}
+#endif
 
 	void setPixel(int x, int y, char c)
 	{
@@ -67,27 +493,61 @@ public:
 		//	//std::cerr << "NO!";
 		//	return;
 		//}
-		assert(x >= 0 || x < screenWidth || y >= 0 || y < screenHeight);
+		assert(x >= 0 && x < screenWidth && y >= 0 && y < screenHeight);
 
 		screenBuffer[y * screenWidth + x] = c;
 	}
 
+	// Colour of a cell, when the window was opened with colour
+	void setColor(int x, int y, uint32_t color)
+	{
+		assert(colorBuffer && x >= 0 && x < screenWidth && y >= 0 && y < screenHeight);
+		colorBuffer[y * screenWidth + x] = color;
+	}
+
 	wchar_t* getBuffer() { return screenBuffer; }
 
+	// Cell colours, or null without colour
+	uint32_t* getColors() { return colorBuffer; }
+
+	// Output statistics; call after close() when a presenter thread is running
+	const ConsoleFrameStats& getFrameStats() const { return frameStats; }
+	const ConsoleFrameStats& getTotalStats() const { return totalStats; }
+	size_t getFramesDrawn() const { return framesDrawn; }
+
 	void clear()
 	{
 		for (int i = 0; i < screenWidth * screenHeight; i++)
 		{
-			screenBuffer[screenWidth * screenHeight - 1] = NULL;
+			screenBuffer[i] = ' ';
 		}
 	}
 
+	// Hand the back buffer over to be written to the console.  Returns as soon as the previous
+	// frame has been written, so the next frame can be drawn while this one is sent.
 	void draw()
 	{
 		//swprintf_s(screenBuffer, 40, L"Console Raytracer by Nathan MacAdam ");
 
 		// Display Frame
 		screenBuffer[screenWidth * screenHeight - 1] = '\0';
-		WriteConsoleOutputCharacter(hConsole, screenBuffer, screenWidth * screenHeight, { 0,0 }, &dwBytesWritten);
+
+		if (!presenter.joinable())
+		{
+			std::copy(screenBuffer, screenBuffer + screenWidth * screenHeight, presentBuffer);
+			if (colorBuffer) std::copy(colorBuffer, colorBuffer + screenWidth * screenHeight, presentColors);
+			recordFrame(present());
+			return;
+		}
+
+		std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lock(presentMutex);
+		presentCondition.wait(lock, [&] { return !framePending; });
+
+		std::copy(screenBuffer, screenBuffer + screenWidth * screenHeight, presentBuffer);
+		if (colorBuffer) std::copy(colorBuffer, colorBuffer + screenWidth * screenHeight, presentColors);
+		pendingWaitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+		framePending = true;
+		presentCondition.notify_all();
 	}
 };
@@ -1,124 +1,44 @@
 #include "ConsoleWindow.h"
 #include "geometry.h"
 #include "raytracing.h"
+#include "renderer.h"
+#include "gbuffer.h"
+#include "wavefront.h"
+#include "checkerboard.h"
+#include "binning.h"
+#include "packet.h"
+#include "subcell.h"
+#include "input.h"
+#include "options.h"
+#include "benchmark.h"
+#include "server.h"
+#include "recording.h"
 #include <chrono>
 #include <cfloat>
+#include <algorithm>
+#include <cwchar>
 
-const float PI = 3.14f;
-
-// console window size (in characters)
-const int width = 120;
-const int height = 40;
+#ifndef _WIN32
+#define swprintf_s swprintf
+#endif
 
 // user input
 const float mouseSensitivity = .01f;
 const float moveSpeed = 5.f;
 
-// corrective scalar (monospace characters are not square, they are rectangular)
-const float consoleViewportCorrection = .5f;
-
-// Character shading
-char shadingTable[] = 
-{ ' ', '.', ':', '-', '=', '+', '*', '#', '%', '@' };
-
-// Doesn't work well for the standard console window size but might work better if you make the
-// window huge
-char extendedShadingTable[] =
-{ 
-	' ', '\'', '`', '^', '\"', ',', ':', ';', 'I', 'l', '!', 'i', '>', 
-	'<', '~', '+', '_', '-', '?', ']', '[', '}', '{', '1', ')', '(', '|',
-	'\\', '/', 't', 'f', 'j', 'r', 'x', 'n', 'u', 'v', 'c', 'z', 
-	'X', 'Y', 'U', 'J', 'C', 'L', 'Q', '0', 'O', 'Z', 'm', 'w',
-	'q', 'p', 'd', 'b', 'k', 'h', 'a', 'o', '*', '#', 'M', 'W', '&', '8',
-	'%', 'B', '@', '$'
-};
-
-// Lookup shading character by 0-1 float value
-char getShadingChar(float value)
-{
-	size_t n = sizeof(shadingTable) / sizeof(shadingTable[0]);
-
-	// value remap to index
-	int i = value * n;
-	// correct for outside of 0-1 range
-	if (i < 0) i = 0;
-	if (i > n) i = n - 1;
-
-	return shadingTable[i];
-}
-
-// check all scene objects for intersections
-bool scene_intersect(const vec3 &orig, const vec3 &dir, const std::vector<Sphere> &spheres, vec3 &hit, vec3 &N, Material &material) {
-	float spheres_dist = FLT_MAX;
-	for (size_t i = 0; i < spheres.size(); i++) {
-		float dist_i;
-		if (spheres[i].ray_intersect(Ray(orig, dir), dist_i) && dist_i < spheres_dist) {
-			spheres_dist = dist_i;
-			hit = orig + dir * dist_i;
-			N = (hit - spheres[i].center).normalize();
-			material = spheres[i].material;
-		}
-	}
-	return spheres_dist < 1000;
-}
-
-// do ray tracing
-float cast_ray(const vec3 &orig, const vec3 &dir, std::vector<Sphere> &spheres, const std::vector<Light> &lights) {
-	vec3 point, N;
-	Material material;
-
-	// if the ray doesn't intersect any scene objects, return 0 for no light
-	if (!scene_intersect(orig, dir, spheres, point, N, material)) {
-		return 0;
-	}
-
-	// calculate lighting
-	float diffuse_light_intensity = 0, specular_light_intensity = 0;
-	for (size_t i = 0; i < lights.size(); i++) 
-	{
-		vec3 light_dir = (lights[i].position - point).normalize();
-		float light_distance = (lights[i].position - point).norm();
-
-		// apply shadows
-		vec3 shadow_orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3; // checking if the point lies in the shadow of the lights[i]
-		vec3 shadow_pt, shadow_N;
-		Material tmpmaterial;
-		if (scene_intersect(shadow_orig, light_dir, spheres, shadow_pt, shadow_N, tmpmaterial) && (shadow_pt - shadow_orig).norm() < light_distance)
-			continue;
-
-		// add values for different lighting types
-		diffuse_light_intensity += lights[i].intensity * max(0.f, (light_dir * N));
-		specular_light_intensity += powf(max(0.f, -reflect(-light_dir, N)*dir), material.specular_exponent)*lights[i].intensity;
-	}
-
-	// calculate final output color value
-	float out = (material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3(1., 1., 1.)*specular_light_intensity * material.albedo[1]).x;
-
-	// todo: change
-	return max(out, .01f);
-}
-
-int main()
+int runInteractive(const Options &options)
 {
-	// Initialize console window as a buffer
-	ConsoleWindow window(width, height);
-
-	// Create some materials
-	Material shiny(vec2(0.6, 0.3), vec3(0.4, 0.4, 0.3), 50.);
-	Material dull(vec2(0.9, 0.1), vec3(0.3, 0.1, 0.1), 10.);
+	const int width = options.width;
+	const int height = options.height;
 
-	// Create some spheres to render
-	std::vector<Sphere> spheres;
-	spheres.push_back(Sphere(vec3(1.5, 0.5, -18), 3, dull));
-	spheres.push_back(Sphere(vec3(-6, 0, -16), 2, shiny));
-	spheres.push_back(Sphere(vec3(-2.5, 2.5, -12), 2, dull));
-	spheres.push_back(Sphere(vec3(7, 5, -18), 4, shiny));
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
 
-	// Add a light
-	std::vector<Light> lights;
-	lights.push_back(Light(vec3(-20, 20, 20), 1.5));
-
-	const double fov = PI / 4.;
+	// Initialize console window as a buffer; frames are written out by a presenter thread
+	// while the next one is traced
+	ConsoleWindow window(width, height, !options.syncDraw, options.color);
+	Camera camera;
 
 	// Initialize variables for tracking application runtime duration
 	auto start = std::chrono::system_clock::now();
@@ -128,121 +48,275 @@ int main()
 	auto tp1 = std::chrono::system_clock::now();
 	auto tp2 = std::chrono::system_clock::now();
 
-	vec3 cameraPosition;
-	vec3 cameraRotation;
+	vec3 &cameraPosition = camera.position;
+	vec3 &cameraRotation = camera.rotation;
+
+	// Mouse offsets are measured from the cursor position at startup
+	Input input;
 
-	// Get initial mouse position to calculate offset
-	POINT initialPos;
-	GetCursorPos(&initialPos);
+	RayStats stats;
+	ThreadPool pool(options.threads);
+	Renderers renderers;
+
+	// with --target-ms the internal resolution follows the measured frame time
+	FrameGovernor governor(options.targetMs);
+	FrameBuffer internal(1, 1);
+	int cellsRendered = 0;
 
 	bool isRunning = true;
 
 	// render loop
 	while(isRunning)
 	{
+		profiler().beginFrame();
+
 		// get delta time
 		tp2 = std::chrono::system_clock::now();
 		std::chrono::duration<float> elapsedTime = tp2 - tp1;
 		tp1 = tp2;
 		float fElapsedTime = elapsedTime.count();
 
+		// the whole loop counts against the budget, waiting for a slow terminal included
+		if (options.targetMs > 0 && cellsRendered > 0)
+			governor.record(fElapsedTime * 1000., cellsRendered, width, height);
+
 		// get application runtime/duration
 		current = std::chrono::system_clock::now();
 		std::chrono::duration<float> timeSinceStart = current - start;
 		float time = timeSinceStart.count();
 
-		// Get mouse offset amount
-		POINT currentPos;
-		GetCursorPos(&currentPos);
-		vec2 mouseOffset(currentPos.x - initialPos.x, currentPos.y - initialPos.y);
-
-		// Capture keyboard input
-		vec3 movement;
-		vec3 lightMovement;
-
-		// Handle camera movement
-		if (GetAsyncKeyState((unsigned short)'A') & 0x8000)
-			movement.x -= 1;
-		if (GetAsyncKeyState((unsigned short)'D') & 0x8000)
-			movement.x += 1;
-		if (GetAsyncKeyState((unsigned short)'W') & 0x8000)
-			movement.z -= 1;
-		if (GetAsyncKeyState((unsigned short)'S') & 0x8000)
-			movement.z += 1;
-
-		// Handle light movement
-		if (GetAsyncKeyState(VK_LEFT) & 0x8000)
-			lightMovement.x -= 1;
-		if (GetAsyncKeyState(VK_RIGHT) & 0x8000)
-			lightMovement.x += 1;
-		if (GetAsyncKeyState(VK_UP) & 0x8000)
-			lightMovement.y -= 1;
-		if (GetAsyncKeyState(VK_DOWN) & 0x8000)
-			lightMovement.y += 1;
+		// Capture mouse and keyboard input; the last frame has only just been handed to the
+		// presenter, so the camera pose is as fresh as it can be when tracing starts
+		InputState state = input.poll();
 
 		// Handle application exit
-		if (GetAsyncKeyState(VK_ESCAPE) & 0x8000)
+		if (state.quit)
 			isRunning = false;
 
 		// Set the camera rotation using the 
-		cameraRotation = vec3(mouseOffset.y, -mouseOffset.x, 0) * mouseSensitivity;
+		cameraRotation = vec3(state.mouseOffset.y, -state.mouseOffset.x, 0) * mouseSensitivity;
 
 		// clamp rotation; note that the mouse position makes this map such that 1 : 90 degrees
 		// in an real application you'd want to remap these values so the rotation holds degrees directly
-		// frankly you'd want to use a transformation matrix but hey, im trying to showcase ray tracing not linear algebra
+		// (the camera turns yaw and pitch into a rotation matrix once per frame)
 		if (cameraRotation.x > .95) cameraRotation.x = .95;
 		if (cameraRotation.x < -.95) cameraRotation.x = -.95;
 
 		// update camera position using user input
-		cameraPosition = cameraPosition + movement * moveSpeed * fElapsedTime;
+		cameraPosition = cameraPosition + state.movement * moveSpeed * fElapsedTime;
 
 		// update light position (ignoring the unsafe access here)
-		lights[0].position = lights[0].position + lightMovement * moveSpeed * fElapsedTime;
+		scene.lights[0].position = scene.lights[0].position + state.lightMovement * moveSpeed * fElapsedTime;
+		scene.commitLights();
 
 		// Move the spheres around a bit
-		/*for (int i = 0; i < spheres.size(); i++)
+		if (options.animate > 0) animateSpheres(scene, time, options.animate);
+
+		// Cast rays; with a G-buffer only what changed since the last frame is redone
+		if (options.targetMs > 0)
+			renderGoverned(options, governor, internal, window, width, height, scene, camera, stats, pool, renderers, cellsRendered);
+		else
+			renderSelected(options, window, width, height, scene, camera, stats, pool, renderers);
+
+		// Write debug info
+		int header = swprintf_s(window.getBuffer(), width, L"Console Raytracer by Nathan MacAdam  FPS:%3.2f   Camera Pos:%3.2f, %3.2f, %3.2f  Camera Rot:%3.2f, %3.2f, %3.2f"
+			, 1.0f / fElapsedTime, cameraPosition.x, cameraPosition.y, cameraPosition.z, cameraRotation.x, cameraRotation.y, cameraRotation.z);
+		if (options.targetMs > 0 && header > 0 && header < width)
+			swprintf_s(window.getBuffer() + header, width - header, L"  Scale:%.2f", governor.getScale());
+
+		// the text rows stay in the text colour
+		if (window.getColors())
 		{
-			spheres[i].center.y += sin(time + i) / 100.f;
-		}*/
+			for (int row = 0; row < std::min(profiling ? 2 : 1, height); row++)
+			{
+				for (int i = 0; i < width; i++) window.setColor(i, row, textColor);
+			}
+		}
 
-		// Cast rays
-		for (int i = 0; i < width; i++)
+		// Stage timings of the last frame, written while the presenter was busy with it
+		if (profiling && height > 1)
 		{
-			for (int j = 0; j < height; j++)
+			if (const ProfileFrame *last = profiler().lastFrame())
 			{
-				float x = (2 * (i + 0.5) / (float)width - 1) * tan(fov / 2.) * width * consoleViewportCorrection / (float)height;
-				float y = -(2 * (j + 0.5) / (float)height - 1) * tan(fov / 2.);
-				vec3 dir = vec3(x, y, -1).normalize();
-
-				// apply y-axis rotation to the ray direction
-				vec3 yRot(
-					dir.x * cos(cameraRotation.y) + dir.z * sin(cameraRotation.y),
-					dir.y,
-					-dir.x * sin(cameraRotation.y) + dir.z * cos(cameraRotation.y)
-				);
-
-				// apply x-axis rotation to the ray direction
-				vec3 xRot(
-					yRot.x,
-					yRot.y * cos(cameraRotation.x) - yRot.z * sin(cameraRotation.x),
-					yRot.y * sin(cameraRotation.x) + yRot.z * cos(cameraRotation.x)
-				);
-
-				// get monochrome color result of cast
-				float val = cast_ray(cameraPosition, xRot, spheres, lights);
-
-				// set console window character by color value
-				window.setPixel(i, j, getShadingChar(val));
+				swprintf_s(window.getBuffer() + width, width, L"gen %.2f  isect %.2f  shade %.2f  shadow %.2f  draw %.2f ms  rays %llu  tests %llu  hits %llu"
+					, last->stageMs[(int)ProfileStage::RayGeneration], last->stageMs[(int)ProfileStage::Intersect], last->stageMs[(int)ProfileStage::Shade]
+					, last->stageMs[(int)ProfileStage::Shadow], last->stageMs[(int)ProfileStage::Draw], (unsigned long long)last->counts[(int)ProfileCounter::Rays]
+					, (unsigned long long)(last->counts[(int)ProfileCounter::SphereTests] + last->counts[(int)ProfileCounter::TriangleTests])
+					, (unsigned long long)last->counts[(int)ProfileCounter::Hits]);
 			}
 		}
 
-		// Write debug info
-		swprintf_s(window.getBuffer(), 120, L"Console Raytracer by Nathan MacAdam  FPS:%3.2f   Camera Pos:%3.2f, %3.2f, %3.2f  Camera Rot:%3.2f, %3.2f, %3.2f"
-			, 1.0f / fElapsedTime, cameraPosition.x, cameraPosition.y, cameraPosition.z, cameraRotation.x, cameraRotation.y, cameraRotation.z);
+		// draw output; returns once the previous frame is out, while this one is being written
+		window.draw();
+		profiler().endFrame();
+	}
+
+	// Report what drawing cost on average so terminal output can be tracked between builds
+	window.close();
+	size_t frames = window.getFramesDrawn() > 0 ? window.getFramesDrawn() : 1;
+	const ConsoleFrameStats &drawTotals = window.getTotalStats();
+	std::cout << "frames drawn:       " << window.getFramesDrawn() << "\n"
+		<< "cells/frame:        " << drawTotals.cellsChanged / frames << "\n"
+		<< "bytes/frame:        " << drawTotals.bytesWritten / frames << "\n"
+		<< "syscalls/frame:     " << (float)drawTotals.syscalls / frames << "\n"
+		<< "draw wait ms/frame: " << drawTotals.waitMs / frames << std::endl;
+
+	return reportProfile(options) ? 0 : 1;
+}
+
+// Show the frames of a --serve server until it stops or escape is pressed
+int runViewer(const Options &options)
+{
+#if WT_SERVER
+	Input input;
+	stopOnInterrupt();
 
-		// draw output
+	std::string error;
+	if (!viewFrames(options.view, [&]() { return !stopRequested && !input.poll().quit; }, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	return 0;
+#else
+	(void)options;
+	std::fprintf(stderr, "--view needs UNIX domain sockets, which this build doesn't have\n");
+	return 1;
+#endif
+}
+
+// Play a recording in the console from --seek; left and right arrows jump a keyframe back or
+// forward, and it stops at the end or when escape is pressed
+int runPlayer(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	RecordingReader recording;
+	std::string error;
+	if (!recording.open(options.play, error) || (options.seek >= 0 && !recording.seek((uint32_t)options.seek, error)))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	const int width = recording.getWidth();
+	const int height = recording.getHeight();
+	ConsoleWindow window(width, height, !options.syncDraw);
+	Input input;
+	stopOnInterrupt();
+
+	clock::duration interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1. / options.playFps));
+	clock::time_point next = clock::now();
+	int lastJump = 0;
+	for (;;)
+	{
+		InputState state = input.poll();
+		if (state.quit || stopRequested)
+			break;
+
+		// one jump per press, however long the key is held
+		int jump = state.lightMovement.x < 0 ? -1 : state.lightMovement.x > 0 ? 1 : 0;
+		if (jump != 0 && jump != lastJump && !recording.seekKeyframe(jump, error))
+			break;
+		lastJump = jump;
+
+		const uint8_t *cells = recording.getCells();
+		std::copy(cells, cells + width * height, window.getBuffer());
+		swprintf_s(window.getBuffer(), width, L"frame %u of %u-%u  left/right: keyframe  esc: quit", recording.getFrameNumber(), recording.firstFrame(), recording.lastFrame());
 		window.draw();
+
+		next += interval;
+		if (next < clock::now()) next = clock::now();
+		std::this_thread::sleep_until(next);
+
+		if (!recording.next(error))
+			break;
 	}
+	window.close();
 
+	if (!error.empty())
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+
+	profiling = !options.profileOutput.empty();
+	sphereKernels = selectSphereKernels(options.simd);
+	triangleKernels = selectTriangleKernels(options.simd);
+
+	if (!options.compileOutput.empty())
+		return runCompileScene(options);
+
+	if (options.benchSceneLoad)
+		return runSceneLoadBenchmark(options);
+
+	if (options.benchBvh)
+		return runBvhBenchmark(options);
+
+	if (options.benchGBuffer)
+		return runGBufferBenchmark(options);
+
+	if (options.benchBounces)
+		return runBounceBenchmark(options);
+
+	if (options.benchMesh)
+		return runMeshBenchmark(options);
+
+	if (options.benchMath)
+		return runMathBenchmark(options);
+
+	if (options.benchPrecision)
+		return runPrecisionBenchmark(options);
+
+	if (options.benchGrid)
+		return runGridBenchmark(options);
+
+	if (options.benchLights)
+		return runLightBenchmark(options);
+
+	if (options.benchColor)
+		return runColorBenchmark(options);
+
+	if (options.benchPackets)
+		return runPacketBenchmark(options);
+
+	if (options.benchSubcells)
+		return runSubcellBenchmark(options);
+
+	if (options.benchBinning)
+		return runBinningBenchmark(options);
+
+	if (options.benchCheckerboard)
+		return runCheckerboardBenchmark(options);
+
+	if (options.benchGovernor)
+		return runGovernorBenchmark(options);
+
+	if (options.benchServer)
+		return runServerBenchmark(options);
+
+	if (!options.serve.empty())
+		return runServer(options);
+
+	if (!options.view.empty())
+		return runViewer(options);
+
+	if (!options.record.empty())
+		return runRecord(options);
+
+	if (!options.play.empty())
+		return options.headless ? runPlaybackCheck(options) : runPlayer(options);
+
+	if (options.headless)
+		return runHeadless(options);
+
+	return runInteractive(options);
+}
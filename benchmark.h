@@ -0,0 +1,1769 @@
+#pragma once
+#include "renderer.h"
+#include "gbuffer.h"
+#include "wavefront.h"
+#include "checkerboard.h"
+#include "binning.h"
+#include "packet.h"
+#include "subcell.h"
+#include "scenefile.h"
+#include "options.h"
+#include "ConsoleWindow.h"
+#include "governor.h"
+#include "server.h"
+#include "recording.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Headless rendering: the same frames the console would show, rendered along a scripted
+// camera/light path into memory so that throughput can be measured without a terminal and
+// output equality can be checked through a checksum.
+
+// Scripted animation; depends only on the frame number so every run renders the same frames
+void applyScriptedPath(int frame, Camera &camera, Scene &scene)
+{
+	// as if running at a steady 30 frames per second
+	float time = frame / 30.f;
+
+	// strafe and dolly around the start position while looking around a little
+	camera.position = vec3(3.f * sinf(time * .5f), .5f * sinf(time * .9f), 2.f * sinf(time * .3f));
+	camera.rotation = vec3(.15f * sinf(time * .7f), .3f * sinf(time * .4f), 0);
+
+	// swing the light from side to side
+	if (!scene.lights.empty())
+	{
+		scene.lights[0].position = vec3(-20.f + 15.f * sinf(time), 20.f, 20.f);
+		scene.commitLights();
+	}
+}
+
+// Bob percent of the spheres up and down, spread evenly through the scene; time is in seconds
+void animateSpheres(Scene &scene, float time, float percent)
+{
+	if (scene.compiled) return;
+
+	float fraction = percent / 100.f;
+	for (size_t i = 0; i < scene.spheres.size(); i++)
+	{
+		if ((size_t)((i + 1) * fraction) == (size_t)(i * fraction)) continue;
+
+		vec3 center = scene.spheres[i].center;
+		center.y += sin(time + i) / 100.f;
+		scene.moveSphere(i, center);
+	}
+	scene.commitMoves();
+}
+
+// Where --mesh models are placed: in the middle of the default scene, scaled to 6 units
+const vec3 meshCenter(0, 0, -14);
+const float meshSize = 6;
+
+// The scene selected on the command line; returns false (after printing why) if it can't be loaded
+bool makeScene(const Options &options, Scene &scene)
+{
+	if (options.spheres > 0)
+	{
+		scene = makeRandomScene(options.spheres);
+	}
+	else if (isBuiltinScene(options.scene))
+	{
+		scene = makeBuiltinScene(options.scene);
+	}
+	else
+	{
+		std::string error;
+		if (!loadSceneFile(options.scene, scene, error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return false;
+		}
+	}
+
+	// compiled scenes keep the acceleration structure they were compiled with
+	if (!scene.compiled) scene.accel = options.accel;
+
+	if (!options.mesh.empty())
+	{
+		Mesh mesh;
+		std::string error;
+		if (!loadObj(options.mesh, mesh, error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return false;
+		}
+		fitMesh(mesh, meshCenter, meshSize);
+		mesh.material = Material(vec2(0.6, 0.3), vec3(0.4, 0.4, 0.3), 50.);
+		scene.meshes.push_back(mesh);
+	}
+
+	if (options.lights > 0) makeRandomLights(scene, options.lights);
+	scene.lightSamples = options.lightSamples;
+
+	scene.commit();
+	return true;
+}
+
+// The renderers that keep state from one frame to the next; one set per view
+struct Renderers
+{
+	GBuffer gbuffer;
+	WavefrontRenderer wavefront;
+	CheckerboardRenderer checkerboard;
+	BinnedRenderer binned;
+	PacketRenderer packets;
+	SubcellRenderer subcells;
+};
+
+// Render a frame with the renderer and precision the options ask for: the wavefront renderer for
+// more than one bounce, else the checkerboard, G-buffer, binned, packet or subcell renderer if
+// enabled, else renderFrame
+template <typename Math, typename Target>
+FrameWork renderSelectedWith(const Options &options, Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool, Renderers &renderers)
+{
+	if (options.bounces > 1)
+	{
+		renderers.wavefront.render<Math>(target, width, height, scene, camera, options.bounces, stats, pool);
+		return FrameWork::Traced;
+	}
+	if (options.checkerboard)
+		return renderers.checkerboard.render<Math>(target, width, height, scene, camera, stats, pool);
+	if (options.gbuffer)
+		return renderers.gbuffer.render<Math>(target, width, height, scene, camera, stats, pool);
+	if (options.binning)
+	{
+		renderers.binned.render<Math>(target, width, height, scene, camera, stats, pool);
+		return FrameWork::Traced;
+	}
+	if (options.packets > 0)
+	{
+		renderers.packets.setSize(options.packets);
+		renderers.packets.render<Math>(target, width, height, scene, camera, stats, pool);
+		return FrameWork::Traced;
+	}
+	if (options.subcells)
+	{
+		renderers.subcells.setTable(options.glyphs);
+		renderers.subcells.render<Math>(target, width, height, scene, camera, stats, pool);
+		return FrameWork::Traced;
+	}
+
+	renderFrame<Math>(target, width, height, scene, camera, stats, pool);
+	return FrameWork::Traced;
+}
+
+template <typename Target>
+FrameWork renderSelected(const Options &options, Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool, Renderers &renderers)
+{
+	if (options.precision == Precision::Fast)
+		return renderSelectedWith<FastMath>(options, target, width, height, scene, camera, stats, pool, renderers);
+	return renderSelectedWith<ExactMath>(options, target, width, height, scene, camera, stats, pool, renderers);
+}
+
+// Render at the size the governor asks for: straight into the target at full size, else into
+// internal and filled out to the target's size.  Returns the cells actually traced in cells.
+template <typename Target>
+FrameWork renderGoverned(const Options &options, const FrameGovernor &governor, FrameBuffer &internal, Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool, Renderers &renderers, int &cells)
+{
+	int internalWidth, internalHeight;
+	governor.internalSize(width, height, internalWidth, internalHeight);
+	cells = internalWidth * internalHeight;
+	if (internalWidth == width && internalHeight == height)
+		return renderSelected(options, target, width, height, scene, camera, stats, pool, renderers);
+
+	if (internal.getWidth() != internalWidth || internal.getHeight() != internalHeight)
+		internal.resize(internalWidth, internalHeight);
+	if (target.getColors() && !internal.getColors())
+		internal.enableColor();
+	FrameWork work = renderSelected(options, internal, internalWidth, internalHeight, scene, camera, stats, pool, renderers);
+	fillFrom(internal, target, width, height);
+	return work;
+}
+
+// Value below which the given fraction of the (sorted) samples fall
+double percentile(const std::vector<double> &sorted, double fraction)
+{
+	if (sorted.empty()) return 0;
+	size_t rank = (size_t)(fraction * (sorted.size() - 1) + .5);
+	return sorted[rank];
+}
+
+// Print the average stage times and counters and write every recorded frame to --profile's file
+bool reportProfile(const Options &options)
+{
+	if (!profiling) return true;
+
+	const Profiler &profile = profiler();
+	ProfileFrame mean = profile.average();
+	std::printf("profiled frames:    %llu (averages per frame)\n", (unsigned long long)mean.frame);
+	for (int i = 0; i < profileStageCount; i++)
+		std::printf("  %-16s  %.3f ms\n", profileStageName(i), mean.stageMs[i]);
+	for (int i = 0; i < profileCounterCount; i++)
+		std::printf("  %-16s  %llu\n", profileCounterName(i), (unsigned long long)mean.counts[i]);
+
+	if (!profile.save(options.profileOutput))
+	{
+		std::fprintf(stderr, "can't write %s\n", options.profileOutput.c_str());
+		return false;
+	}
+	return true;
+}
+
+int runHeadless(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	Camera camera;
+	FrameBuffer frame(options.width, options.height);
+	ThreadPool pool(options.threads);
+	Renderers renderers;
+	int framesTraced = 0;
+	int framesShaded = 0;
+
+	// with --target-ms, frames below full size are rendered into internal
+	FrameGovernor governor(options.targetMs);
+	FrameBuffer internal(1, 1);
+	double scaleTotal = 0;
+	int framesOverBudget = 0;
+
+	// what an ANSI terminal would have been sent, to track output cost alongside render cost
+	AnsiFrameEncoder encoder(options.width, options.height);
+	std::string encoded;
+	size_t encodedBytes = 0;
+	if (options.color != ColorMode::Mono)
+	{
+		frame.enableColor();
+		encoder.setColorMode(options.color);
+	}
+
+	RayStats stats;
+	std::vector<double> frameTimes;
+	frameTimes.reserve(options.frames);
+
+	// FNV-1a over the per-frame checksums
+	uint64_t checksum = 14695981039346656037ull;
+
+	for (int f = 0; f < options.frames; f++)
+	{
+		applyScriptedPath(f, camera, scene);
+		if (options.animate > 0) animateSpheres(scene, f / 30.f, options.animate);
+		profiler().beginFrame();
+
+		clock::time_point frameStart = clock::now();
+		FrameWork work;
+		int cells = options.width * options.height;
+		if (options.targetMs > 0)
+		{
+			scaleTotal += governor.getScale();
+			work = renderGoverned(options, governor, internal, frame, options.width, options.height, scene, camera, stats, pool, renderers, cells);
+		}
+		else
+		{
+			work = renderSelected(options, frame, options.width, options.height, scene, camera, stats, pool, renderers);
+		}
+		clock::time_point frameEnd = clock::now();
+
+		if (work == FrameWork::Traced) framesTraced++;
+		if (work == FrameWork::Shaded) framesShaded++;
+
+		double frameMs = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+		frameTimes.push_back(frameMs);
+		if (options.targetMs > 0)
+		{
+			if (frameMs > options.targetMs) framesOverBudget++;
+			governor.record(frameMs, cells, options.width, options.height);
+		}
+
+		checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+
+		{
+			WT_PROFILE_SCOPE(Draw);
+			encoded.clear();
+			encoder.encode(frame.getBuffer(), frame.getColors(), encoded);
+			encodedBytes += encoded.size();
+		}
+		profiler().endFrame();
+	}
+
+	double totalMs = 0;
+	for (size_t i = 0; i < frameTimes.size(); i++) totalMs += frameTimes[i];
+	double totalSeconds = totalMs / 1000.;
+
+	std::vector<double> sorted = frameTimes;
+	std::sort(sorted.begin(), sorted.end());
+
+	std::printf("frames:             %d (%dx%d, %d threads, %s)\n", options.frames, options.width, options.height, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("spheres:            %zu (%s)\n", scene.sphereData.count, accelName(scene.bvh.empty() ? (scene.grid.empty() ? Accel::Linear : Accel::Grid) : Accel::BVH));
+	if (options.precision != Precision::Exact)
+	{
+		std::printf("precision:          %s\n", precisionName(options.precision));
+	}
+	if (options.color != ColorMode::Mono)
+	{
+		std::printf("color:              %s\n", colorModeName(options.color));
+	}
+	if (options.bounces > 1)
+	{
+		std::printf("bounces:            %d (wavefront)\n", options.bounces);
+	}
+	if (options.checkerboard)
+	{
+		std::printf("checkerboard:       %.0f primary rays/frame\n", (double)stats.primaryRays / options.frames);
+	}
+	if (options.gbuffer)
+	{
+		std::printf("gbuffer:            %d traced, %d shaded, %d skipped\n", framesTraced, framesShaded, options.frames - framesTraced - framesShaded);
+	}
+	if (options.targetMs > 0)
+	{
+		std::printf("governor:           %.2f ms target, %.2f mean scale, %d frames over\n", options.targetMs, scaleTotal / options.frames, framesOverBudget);
+	}
+	std::printf("frames/sec:         %.2f\n", options.frames / totalSeconds);
+	std::printf("primary rays/sec:   %.0f\n", stats.primaryRays / totalSeconds);
+	std::printf("secondary rays/sec: %.0f\n", stats.secondaryRays / totalSeconds);
+	std::printf("shadow rays/sec:    %.0f\n", stats.shadowRays / totalSeconds);
+	std::printf("rays/sec:           %.0f\n", stats.total() / totalSeconds);
+	std::printf("frame ms p50:       %.3f\n", percentile(sorted, .5));
+	std::printf("frame ms p99:       %.3f\n", percentile(sorted, .99));
+	std::printf("ansi bytes/frame:   %zu\n", encodedBytes / options.frames);
+	std::printf("checksum:           %016llx\n", (unsigned long long)checksum);
+
+	return reportProfile(options) ? 0 : 1;
+}
+
+// Rays per second for rendering frames of the scripted path (primary and shadow rays)
+double measureRaysPerSecond(Scene &scene, int width, int height, int frames, ThreadPool &pool)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Camera camera;
+	FrameBuffer frame(width, height);
+	RayStats stats;
+
+	clock::time_point start = clock::now();
+	for (int f = 0; f < frames; f++)
+	{
+		applyScriptedPath(f, camera, scene);
+		renderFrame(frame, width, height, scene, camera, stats, pool);
+	}
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	return stats.total() / seconds;
+}
+
+int runBvhBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	ThreadPool pool(options.threads);
+	const int counts[] = { 1000, 10000, 100000 };
+
+	std::printf("%dx%d, %d threads, %s\n", options.width, options.height, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("%10s %10s %10s %14s %14s %9s\n", "spheres", "build ms", "nodes", "linear rays/s", "bvh rays/s", "speedup");
+
+	for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+	{
+		Scene scene = makeRandomScene(counts[i]);
+
+		scene.accel = Accel::BVH;
+		clock::time_point buildStart = clock::now();
+		scene.commit();
+		double buildMs = std::chrono::duration<double, std::milli>(clock::now() - buildStart).count();
+
+		double bvhRays = measureRaysPerSecond(scene, options.width, options.height, options.frames, pool);
+		size_t nodes = scene.bvh.nodes.size();
+
+		// the linear scan gets slow quickly, so it renders fewer frames
+		scene.accel = Accel::Linear;
+		scene.commit();
+		int linearFrames = std::max(1, (int)(options.frames * 1000LL / counts[i] / 10));
+		double linearRays = measureRaysPerSecond(scene, options.width, options.height, linearFrames, pool);
+
+		std::printf("%10d %10.2f %10zu %14.0f %14.0f %8.1fx\n", counts[i], buildMs, nodes, linearRays, bvhRays, bvhRays / linearRays);
+	}
+
+	return 0;
+}
+
+// The scripted path with the camera held still, as when only the light is being moved around
+void applyLightPath(int frame, Camera &camera, Scene &scene)
+{
+	applyScriptedPath(frame, camera, scene);
+	camera.position = vec3(0, 0, 0);
+	camera.rotation = vec3(0, 0, 0);
+}
+
+// Update and render times with a grid and with a BVH while 1%, 10% and 100% of the spheres
+// move every frame (10k random spheres unless --spheres says otherwise)
+int runGridBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	ThreadPool pool(options.threads);
+	int count = options.spheres > 0 ? options.spheres : 10000;
+	const float percents[] = { 1, 10, 100 };
+	const Accel accels[] = { Accel::BVH, Accel::Grid };
+
+	std::printf("%dx%d, %d frames, %d spheres, %d threads\n", options.width, options.height, options.frames, count, pool.size());
+	std::printf("%8s %6s %12s %12s %12s %18s\n", "moving", "accel", "update ms", "render ms", "frames/s", "checksum");
+
+	for (size_t p = 0; p < sizeof(percents) / sizeof(percents[0]); p++)
+	{
+		for (size_t a = 0; a < sizeof(accels) / sizeof(accels[0]); a++)
+		{
+			Scene scene = makeRandomScene(count);
+			scene.accel = accels[a];
+			scene.commit();
+
+			Camera camera;
+			FrameBuffer frame(options.width, options.height);
+			RayStats stats;
+			double updateSeconds = 0, renderSeconds = 0;
+			uint64_t checksum = 14695981039346656037ull;
+
+			for (int f = 0; f < options.frames; f++)
+			{
+				applyScriptedPath(f, camera, scene);
+
+				clock::time_point start = clock::now();
+				animateSpheres(scene, f / 30.f, percents[p]);
+				clock::time_point updated = clock::now();
+				renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+				clock::time_point rendered = clock::now();
+
+				updateSeconds += std::chrono::duration<double>(updated - start).count();
+				renderSeconds += std::chrono::duration<double>(rendered - updated).count();
+				checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+			}
+
+			std::printf("%7.0f%% %6s %12.3f %12.3f %12.2f  %016llx\n", percents[p], accelName(accels[a]), updateSeconds * 1000 / options.frames,
+				renderSeconds * 1000 / options.frames, options.frames / (updateSeconds + renderSeconds), (unsigned long long)checksum);
+		}
+	}
+
+	return 0;
+}
+
+int runGBufferBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads, %s\n", options.width, options.height, options.frames,
+		scene.sphereData.count, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("%10s %12s %14s %14s %18s\n", "", "frames/s", "primary rays", "shadow rays", "checksum");
+
+	for (int deferred = 0; deferred < 2; deferred++)
+	{
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		GBuffer gbuffer;
+		RayStats stats;
+		uint64_t checksum = 14695981039346656037ull;
+		double seconds = 0;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyLightPath(f, camera, scene);
+
+			clock::time_point start = clock::now();
+			if (deferred) gbuffer.render(frame, options.width, options.height, scene, camera, stats, pool);
+			else renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+			seconds += std::chrono::duration<double>(clock::now() - start).count();
+
+			checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+		}
+
+		std::printf("%10s %12.2f %14llu %14llu  %016llx\n", deferred ? "gbuffer" : "forward", options.frames / seconds,
+			(unsigned long long)stats.primaryRays, (unsigned long long)stats.shadowRays, (unsigned long long)checksum);
+	}
+
+	return 0;
+}
+
+// Wall time of a frame on a host where other work takes two thirds of the CPU: the frame's own
+// time plus twice that spent spinning
+void simulateContention(double frameMs)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point until = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(frameMs * 2));
+	while (clock::now() < until) {}
+}
+
+// Frame times over the scripted path with and without the governor, with the CPU contended for
+// the middle third of the frames.  The budget is --target-ms, else 1.25x the uncontended median.
+int runGovernorBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	double targetMs = options.targetMs;
+	if (targetMs <= 0)
+	{
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		RayStats stats;
+		std::vector<double> frameTimes;
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+			clock::time_point start = clock::now();
+			renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+			frameTimes.push_back(std::chrono::duration<double, std::milli>(clock::now() - start).count());
+		}
+		std::sort(frameTimes.begin(), frameTimes.end());
+		targetMs = percentile(frameTimes, .5) * 1.25;
+	}
+
+	int contendedFrom = options.frames / 3, contendedTo = options.frames * 2 / 3;
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads, %.3f ms budget, contended frames %d-%d\n", options.width, options.height,
+		options.frames, scene.sphereData.count, pool.size(), targetMs, contendedFrom, contendedTo - 1);
+	std::printf("%10s %10s %10s %10s %12s %12s %12s\n", "governor", "p50 ms", "p99 ms", "max ms", "over budget", "mean scale", "min scale");
+
+	for (int governed = 0; governed < 2; governed++)
+	{
+		Options settings = options;
+		settings.targetMs = targetMs;
+
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		FrameBuffer internal(1, 1);
+		FrameGovernor governor(targetMs);
+		Renderers renderers;
+		RayStats stats;
+		std::vector<double> frameTimes;
+		double scaleTotal = 0;
+		float minScale = 1;
+		int over = 0;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+			scaleTotal += governor.getScale();
+			minScale = std::min(minScale, governor.getScale());
+
+			clock::time_point start = clock::now();
+			int cells = options.width * options.height;
+			if (governed) renderGoverned(settings, governor, internal, frame, options.width, options.height, scene, camera, stats, pool, renderers, cells);
+			else renderSelected(settings, frame, options.width, options.height, scene, camera, stats, pool, renderers);
+			if (f >= contendedFrom && f < contendedTo)
+				simulateContention(std::chrono::duration<double, std::milli>(clock::now() - start).count());
+			double frameMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+			frameTimes.push_back(frameMs);
+			if (frameMs > targetMs) over++;
+			if (governed) governor.record(frameMs, cells, options.width, options.height);
+		}
+
+		std::sort(frameTimes.begin(), frameTimes.end());
+		std::printf("%10s %10.3f %10.3f %10.3f %12d %12.2f %12.2f\n", governed ? "on" : "off", percentile(frameTimes, .5),
+			percentile(frameTimes, .99), frameTimes.back(), over, scaleTotal / options.frames, minScale);
+	}
+
+	return 0;
+}
+
+int runBounceBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+	WavefrontRenderer wavefront;
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads, %s\n", options.width, options.height, options.frames,
+		scene.sphereData.count, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("%10s %12s %14s %14s %18s\n", "bounces", "frames/s", "rays/s", "rays/frame", "checksum");
+
+	// bounce 0 is the forward renderer, which one bounce of the wavefront renderer has to match
+	for (int bounces = 0; bounces <= 8; bounces++)
+	{
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		RayStats stats;
+		uint64_t checksum = 14695981039346656037ull;
+
+		clock::time_point start = clock::now();
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+			if (bounces == 0) renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+			else wavefront.render(frame, options.width, options.height, scene, camera, bounces, stats, pool);
+			checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+		}
+		double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+		char label[16];
+		if (bounces == 0) std::snprintf(label, sizeof(label), "forward");
+		else std::snprintf(label, sizeof(label), "%d", bounces);
+
+		std::printf("%10s %12.2f %14.0f %14llu  %016llx\n", label, options.frames / seconds, stats.total() / seconds,
+			(unsigned long long)(stats.total() / options.frames), (unsigned long long)checksum);
+	}
+
+	return 0;
+}
+
+int runMeshBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	ThreadPool pool(options.threads);
+	const int rings[] = { 32, 100, 317, 1000 };
+
+	std::printf("%dx%d, %d threads, %s\n", options.width, options.height, pool.size(), simdLevelName(triangleKernels.level));
+	std::printf("%10s %10s %10s %10s %12s %14s %18s\n", "triangles", "load ms", "build ms", "nodes", "frames/s", "rays/s", "checksum");
+
+	for (size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); i++)
+	{
+		// a torus with rings * rings triangles, written out as OBJ text and read back
+		Mesh torus = makeTorusMesh(rings[i], rings[i] / 2, 2.f, .8f, Material());
+		std::stringstream obj;
+		for (size_t v = 0; v < torus.positions.size(); v++) obj << "v " << torus.positions[v].x << ' ' << torus.positions[v].y << ' ' << torus.positions[v].z << '\n';
+		for (size_t v = 0; v < torus.normals.size(); v++) obj << "vn " << torus.normals[v].x << ' ' << torus.normals[v].y << ' ' << torus.normals[v].z << '\n';
+		for (size_t t = 0; t < torus.triangleCount(); t++)
+		{
+			obj << 'f';
+			for (int k = 0; k < 3; k++) obj << ' ' << torus.indices[3 * t + k] + 1 << "//" << torus.indices[3 * t + k] + 1;
+			obj << '\n';
+		}
+
+		Scene scene;
+		scene.lights.push_back(Light(vec3(-20, 20, 20), 1.5));
+
+		clock::time_point loadStart = clock::now();
+		Mesh mesh;
+		std::string error;
+		if (!loadObj(obj, mesh, error))
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+		double loadMs = std::chrono::duration<double, std::milli>(clock::now() - loadStart).count();
+
+		fitMesh(mesh, meshCenter, meshSize);
+		mesh.material = Material(vec2(0.6, 0.3), vec3(0.4, 0.4, 0.3), 50.);
+		scene.meshes.push_back(mesh);
+
+		clock::time_point buildStart = clock::now();
+		scene.commit();
+		double buildMs = std::chrono::duration<double, std::milli>(clock::now() - buildStart).count();
+
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		RayStats stats;
+		uint64_t checksum = 14695981039346656037ull;
+		clock::time_point renderStart = clock::now();
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+			renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+			checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+		}
+		double seconds = std::chrono::duration<double>(clock::now() - renderStart).count();
+
+		std::printf("%10zu %10.2f %10.2f %10zu %12.2f %14.0f  %016llx\n", mesh.triangleCount(), loadMs, buildMs,
+			scene.meshData[0].bvh.nodes.size(), options.frames / seconds, stats.total() / seconds, (unsigned long long)checksum);
+	}
+
+	return 0;
+}
+
+int runCompileScene(const Options &options)
+{
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+
+	std::string error;
+	if (!compileScene(scene, options.compileOutput, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	std::printf("%s: %zu spheres, %zu materials, %zu lights, %zu bvh nodes\n", options.compileOutput.c_str(),
+		scene.sphereData.count, scene.materials.size(), scene.lights.size(), scene.bvh.nodes.size());
+	return 0;
+}
+
+// Time from starting to load a scene until its first frame is rendered
+double timeToFirstFrame(const Options &options, const std::string &path, uint64_t &checksum, ThreadPool &pool)
+{
+	typedef std::chrono::steady_clock clock;
+
+	clock::time_point start = clock::now();
+
+	Scene scene;
+	std::string error;
+	if (!loadSceneFile(path, scene, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return -1;
+	}
+	scene.commit();
+
+	Camera camera;
+	FrameBuffer frame(options.width, options.height);
+	RayStats stats;
+	applyScriptedPath(0, camera, scene);
+	renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+	checksum = frame.checksum();
+
+	return std::chrono::duration<double, std::milli>(clock::now() - start).count();
+}
+
+int runSceneLoadBenchmark(const Options &options)
+{
+	const std::string textPath = "wintrace-bench.scene";
+	const std::string compiledPath = "wintrace-bench.wtscene";
+
+	int count = options.spheres > 0 ? options.spheres : 1000000;
+	ThreadPool pool(options.threads);
+
+	// write the random scene out as text, then compile that
+	{
+		Scene scene = makeRandomScene(count);
+		std::ofstream text(textPath.c_str());
+		writeSceneText(scene, text);
+	}
+	{
+		Scene scene;
+		std::string error;
+		bool ok = loadSceneFile(textPath, scene, error);
+		if (ok)
+		{
+			scene.commit();
+			ok = compileScene(scene, compiledPath, error);
+		}
+		if (!ok)
+		{
+			std::fprintf(stderr, "%s\n", error.c_str());
+			return 1;
+		}
+	}
+
+	uint64_t textChecksum = 0, compiledChecksum = 0;
+	double textMs = timeToFirstFrame(options, textPath, textChecksum, pool);
+	double compiledMs = timeToFirstFrame(options, compiledPath, compiledChecksum, pool);
+
+	std::remove(textPath.c_str());
+	std::remove(compiledPath.c_str());
+
+	if (textMs < 0 || compiledMs < 0)
+		return 1;
+
+	std::printf("%d spheres, %dx%d, %d threads\n", count, options.width, options.height, pool.size());
+	std::printf("%10s %18s %18s\n", "", "first frame ms", "checksum");
+	std::printf("%10s %18.2f  %016llx\n", "text", textMs, (unsigned long long)textChecksum);
+	std::printf("%10s %18.2f  %016llx\n", "compiled", compiledMs, (unsigned long long)compiledChecksum);
+
+	return 0;
+}
+
+// vec3 arithmetic through the generic loop templates, which is what every vec3 used before the
+// straight-line versions were added; the baseline for runMathBenchmark
+struct LoopVec3
+{
+	vec3 v;
+
+	LoopVec3 operator+(const LoopVec3 &rhs) const { return LoopVec3{ ::operator+<3, float>(v, rhs.v) }; }
+	LoopVec3 operator-(const LoopVec3 &rhs) const { return LoopVec3{ ::operator-<3, float>(v, rhs.v) }; }
+	LoopVec3 operator-() const { return LoopVec3{ ::operator-<3, float>(v) }; }
+	LoopVec3 operator*(float rhs) const { return LoopVec3{ ::operator*<3, float, float>(v, rhs) }; }
+	float operator*(const LoopVec3 &rhs) const { return ::operator*<3, float>(v, rhs.v); }
+	float norm() const { return std::sqrt(v.x*v.x + v.y * v.y + v.z * v.z); }
+	LoopVec3& normalize() { *this = *this * (1 / norm()); return *this; }
+};
+
+LoopVec3 reflect(const LoopVec3 &I, const LoopVec3 &N)
+{
+	return I - N * 2.f*(I*N);
+}
+
+// The per-light arithmetic of shade(), written once for every kind of vector
+template <typename V>
+float shadeArithmetic(const V &point, const V &N, const V &light, const V &dir)
+{
+	V light_dir = (light - point).normalize();
+	float light_distance = (light - point).norm();
+	float diffuse = std::max(0.f, light_dir * N);
+	float specular = std::max(0.f, -reflect(-light_dir, N) * dir);
+	return diffuse + specular / light_distance;
+}
+
+// Nanoseconds per shadeArithmetic call over count points (count is a power of two)
+template <typename V>
+double timeShadeArithmetic(const V *points, const V *normals, int count, int rounds, float &sum)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	sum = 0;
+	for (int r = 0; r < rounds; r++)
+	{
+		V light = points[r & (count - 1)] + normals[r & (count - 1)] * 20.f;
+		for (int i = 0; i < count; i++) sum += shadeArithmetic(points[i], normals[i], light, normals[(i + 1) & (count - 1)]);
+	}
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ((double)rounds * count);
+}
+
+template <typename V>
+bool sameBits(const V &a, const V &b)
+{
+	return std::memcmp(&a, &b, sizeof(V)) == 0;
+}
+
+// Checks the straight-line and aligned vector operations against the generic templates, bit
+// for bit, then times shade()'s arithmetic with each
+int runMathBenchmark(const Options &options)
+{
+	const int count = 4096;
+	Random random(7);
+	std::vector<vec3> a(count), b(count);
+	std::vector<vec4> c(count), d(count);
+	for (int i = 0; i < count; i++)
+	{
+		a[i] = vec3(random.range(-10, 10), random.range(-10, 10), random.range(-10, 10));
+		b[i] = vec3(random.range(-10, 10), random.range(-10, 10), random.range(-10, 10));
+		c[i] = vec4(random.range(-10, 10), random.range(-10, 10), random.range(-10, 10), random.range(-10, 10));
+		d[i] = vec4(random.range(-10, 10), random.range(-10, 10), random.range(-10, 10), random.range(-10, 10));
+	}
+	// signed zeros, which min/max and negation have to get right
+	a[0] = vec3(0.f, -0.f, 0.f);
+	b[0] = vec3(-0.f, 0.f, 0.f);
+
+	const char *names[] = { "add", "sub", "scale", "negate", "dot", "dot4", "cross", "min", "max", "norm", "normalize", "reflect", "mat3*vec3" };
+	const int opCount = sizeof(names) / sizeof(names[0]);
+	// -1 where there is no such version
+	int straightMismatches[opCount] = { 0, 0, 0, 0, 0, 0, -1, -1, -1, -1, 0, 0, 0 };
+	int alignedMismatches[opCount] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1 };
+	double fastError = 0;
+
+	mat3 m = rotationX(.3f) * rotationY(-1.1f);
+	for (int i = 0; i < count; i++)
+	{
+		vec3 u = a[i], v = b[i];
+		vec3a ua(u), va(v);
+		vec4a ca(c[i]), da(d[i]);
+		float s = v.y;
+		int op = 0;
+
+		vec3 expected = ::operator+<3, float>(u, v);
+		straightMismatches[op] += !sameBits(u + v, expected);
+		alignedMismatches[op++] += !sameBits((ua + va).xyz(), expected);
+
+		expected = ::operator-<3, float>(u, v);
+		straightMismatches[op] += !sameBits(u - v, expected);
+		alignedMismatches[op++] += !sameBits((ua - va).xyz(), expected);
+
+		expected = ::operator*<3, float, float>(u, s);
+		straightMismatches[op] += !sameBits(u * s, expected);
+		alignedMismatches[op++] += !sameBits((ua * s).xyz(), expected);
+
+		expected = ::operator-<3, float>(u);
+		straightMismatches[op] += !sameBits(-u, expected);
+		alignedMismatches[op++] += !sameBits((-ua).xyz(), expected);
+
+		float dotExpected = ::operator*<3, float>(u, v);
+		straightMismatches[op] += !sameBits(u * v, dotExpected);
+		alignedMismatches[op++] += !sameBits(ua * va, dotExpected);
+
+		dotExpected = ::operator*<4, float>(c[i], d[i]);
+		straightMismatches[op] += !sameBits(c[i] * d[i], dotExpected);
+		alignedMismatches[op++] += !sameBits(ca * da, dotExpected);
+
+		expected = cross(u, v);
+		alignedMismatches[op++] += !sameBits(cross(ua, va).xyz(), expected);
+
+		expected = minimum(u, v);
+		alignedMismatches[op++] += !sameBits(minimum(ua, va).xyz(), expected);
+
+		expected = maximum(u, v);
+		alignedMismatches[op++] += !sameBits(maximum(ua, va).xyz(), expected);
+
+		dotExpected = u.norm();
+		alignedMismatches[op++] += !sameBits(ua.norm(), dotExpected);
+
+		LoopVec3 loop = { u };
+		expected = LoopVec3(loop).normalize().v;
+		straightMismatches[op] += !sameBits(vec3(u).normalize(), expected);
+		alignedMismatches[op++] += !sameBits(vec3a(u).normalize().xyz(), expected);
+
+		LoopVec3 loopNormal = { v };
+		expected = reflect(loop, loopNormal).v;
+		straightMismatches[op] += !sameBits(reflect(u, v), expected);
+		alignedMismatches[op++] += !sameBits(reflect(ua, va).xyz(), expected);
+
+		expected = ::operator*<3, 3, float>(m, u);
+		straightMismatches[op++] += !sameBits(m * u, expected);
+
+		// a[0] has no direction
+		if (i > 0) fastError = std::max(fastError, (double)(vec3a(u).normalizeFast().xyz() - vec3(u).normalize()).norm());
+	}
+
+	bool exact = true;
+	std::printf("%d vectors, %s\n", count,
+#if WT_BASELINE_SSE2
+		"sse2"
+#elif WT_BASELINE_NEON
+		"neon"
+#else
+		"scalar"
+#endif
+	);
+	std::printf("%12s %18s %18s\n", "mismatches", "straight-line", "aligned");
+	for (int op = 0; op < opCount; op++)
+	{
+		std::printf("%12s", names[op]);
+		for (int k = 0; k < 2; k++)
+		{
+			int mismatches = k == 0 ? straightMismatches[op] : alignedMismatches[op];
+			if (mismatches < 0) std::printf(" %18s", "-");
+			else std::printf(" %18d", mismatches);
+			if (mismatches > 0) exact = false;
+		}
+		std::printf("\n");
+	}
+	std::printf("normalizeFast max error: %.3g\n", fastError);
+
+	// time shade()'s arithmetic for every point, with the next point's normal as the view direction
+	std::vector<LoopVec3> loopPoints(count), loopNormals(count);
+	std::vector<vec3a, AlignedAllocator<vec3a> > alignedPoints(count), alignedNormals(count);
+	b[0] = vec3(0, 1, 0);
+	for (int i = 0; i < count; i++)
+	{
+		b[i].normalize();
+		loopPoints[i].v = a[i];
+		loopNormals[i].v = b[i];
+		alignedPoints[i] = vec3a(a[i]);
+		alignedNormals[i] = vec3a(b[i]);
+	}
+
+	int rounds = options.frames;
+	float sums[3];
+	double nanoseconds[3];
+	nanoseconds[0] = timeShadeArithmetic(loopPoints.data(), loopNormals.data(), count, rounds, sums[0]);
+	nanoseconds[1] = timeShadeArithmetic(a.data(), b.data(), count, rounds, sums[1]);
+	nanoseconds[2] = timeShadeArithmetic(alignedPoints.data(), alignedNormals.data(), count, rounds, sums[2]);
+
+	std::printf("%12s %18s %18s\n", "", "ns/shade", "sum");
+	std::printf("%12s %18.2f %18.6g\n", "loops", nanoseconds[0], sums[0]);
+	std::printf("%12s %18.2f %18.6g\n", "straight", nanoseconds[1], sums[1]);
+	std::printf("%12s %18.2f %18.6g\n", "aligned", nanoseconds[2], sums[2]);
+
+	return exact ? 0 : 1;
+}
+
+// Position of a glyph in shadingTable, or -1
+int shadingLevel(wchar_t glyph)
+{
+	for (size_t i = 0; i < sizeof(shadingTable); i++)
+	{
+		if ((wchar_t)shadingTable[i] == glyph) return (int)i;
+	}
+	return -1;
+}
+
+// How far the glyphs of one set of frames are from another's
+struct GlyphDifference
+{
+	size_t cells = 0;
+	size_t changed = 0;
+	size_t changedByOne = 0;
+	size_t steps = 0;		// summed over the changed cells
+	int maxStep = 0;
+
+	void add(const wchar_t *reference, const wchar_t *other, size_t count)
+	{
+		cells += count;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (reference[i] == other[i]) continue;
+			changed++;
+			int step = std::abs(shadingLevel(reference[i]) - shadingLevel(other[i]));
+			if (step == 1) changedByOne++;
+			steps += step;
+			maxStep = std::max(maxStep, step);
+		}
+	}
+
+	void print() const
+	{
+		std::printf("cells changed:      %zu of %zu (%.4f%%)\n", changed, cells, 100. * changed / cells);
+		std::printf("by one glyph:       %zu\n", changedByOne);
+		std::printf("mean error:         %.4f glyphs per cell\n", (double)steps / cells);
+		std::printf("largest change:     %d glyphs\n", maxStep);
+	}
+};
+
+// Ray/sphere tests for the primary rays of one frame, as traversing the BVH and as searching
+// the tile bins of the last build()
+void countPrimaryTests(const Scene &scene, const Camera &camera, const BinnedRenderer &binned, int width, int height, uint64_t &bvhTests, uint64_t &binTests)
+{
+	for (int tile = 0; tile < tileCount(width, height); tile++)
+	{
+		TileRect rect = tileRect(tile, width, height);
+		binTests += (uint64_t)binned.bin(tile).spheres.paddedCount() * (rect.x1 - rect.x0) * (rect.y1 - rect.y0);
+
+		for (int j = rect.y0; j < rect.y1; j++)
+		{
+			for (int i = rect.x0; i < rect.x1; i++)
+			{
+				vec3 dir = camera.rayDirection(i, j);
+				float distance = 1000;
+				scene.bvh.traverse(camera.position, dir, distance, [&](int first, int count, float &tMax)
+				{
+					bvhTests += count;
+					sphereKernels.closest(scene.sphereData, first, first + count, camera.position, dir, tMax);
+					return false;
+				});
+			}
+		}
+	}
+}
+
+// Primary ray sphere tests and frames/sec with a linear search, the BVH and tile bins, for
+// scenes of 1k to 100k random spheres
+int runBinningBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	ThreadPool pool(options.threads);
+	const int counts[] = { 1000, 10000, 100000 };
+
+	std::printf("%dx%d, %d threads, %s; sphere tests per primary ray, frames/s\n", options.width, options.height, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("%10s %10s %10s %10s %10s %10s %10s\n", "spheres", "linear", "bvh", "binned", "bvh fps", "binned fps", "bin ms");
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		Scene scene = makeRandomScene(counts[c]);
+		scene.accel = Accel::BVH;
+		scene.commit();
+
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		BinnedRenderer binned;
+		RayStats stats;
+		double seconds[2] = {};
+		double binMs = 0;
+		uint64_t bvhTests = 0, binTests = 0;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+
+			clock::time_point start = clock::now();
+			renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+			seconds[0] += std::chrono::duration<double>(clock::now() - start).count();
+
+			start = clock::now();
+			binned.render(frame, options.width, options.height, scene, camera, stats, pool);
+			seconds[1] += std::chrono::duration<double>(clock::now() - start).count();
+
+			start = clock::now();
+			binned.build(scene, camera, options.width, options.height, pool);
+			binMs += std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+			countPrimaryTests(scene, camera, binned, options.width, options.height, bvhTests, binTests);
+		}
+
+		double rays = (double)options.width * options.height * options.frames;
+		std::printf("%10d %10zu %10.1f %10.1f %10.2f %10.2f %10.3f\n", counts[c], scene.sphereData.paddedCount(), bvhTests / rays,
+			binTests / rays, options.frames / seconds[0], options.frames / seconds[1], binMs / options.frames);
+	}
+
+	return 0;
+}
+
+// Frames/s with primary rays traced one by one and in 4x4 and 8x8 packets, with the sphere
+// tests per primary ray and the share of rays packets gave up on, for random scenes searched
+// linearly and through a BVH; the checksums show that the frames are the same
+int runPacketBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	ThreadPool pool(options.threads);
+	struct Case { int spheres; Accel accel; };
+	const Case cases[] = { { 1000, Accel::Linear }, { 1000, Accel::BVH }, { 10000, Accel::BVH }, { 100000, Accel::BVH }, { 100000, Accel::Grid } };
+	const int sizes[] = { 1, 4, 8 };
+
+	std::printf("%dx%d, %d frames, %d threads, %s\n", options.width, options.height, options.frames, pool.size(), simdLevelName(sphereKernels.level));
+	std::printf("%8s %7s %7s %10s %12s %10s %18s\n", "spheres", "accel", "packet", "frames/s", "tests/ray", "alone", "checksum");
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+	{
+		Scene scene = makeRandomScene(cases[c].spheres);
+		scene.accel = cases[c].accel;
+		scene.commit();
+
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			Camera camera;
+			FrameBuffer frame(options.width, options.height);
+			PacketRenderer packets(sizes[s]);
+			RayStats stats;
+			double seconds = 0;
+			uint64_t checksum = 14695981039346656037ull;
+
+			for (int f = 0; f < options.frames; f++)
+			{
+				applyScriptedPath(f, camera, scene);
+
+				clock::time_point start = clock::now();
+				if (sizes[s] == 1) renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+				else packets.render(frame, options.width, options.height, scene, camera, stats, pool);
+				seconds += std::chrono::duration<double>(clock::now() - start).count();
+
+				checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+			}
+
+			char size[16], tests[16] = "-", alone[16] = "-";
+			if (sizes[s] == 1) std::snprintf(size, sizeof(size), "single");
+			else
+			{
+				double rays = (double)stats.primaryRays;
+				std::snprintf(size, sizeof(size), "%dx%d", sizes[s], sizes[s]);
+				if (packets.singleRays() < stats.primaryRays)
+					std::snprintf(tests, sizeof(tests), "%.1f", packets.sphereTests() / (rays - packets.singleRays()));
+				std::snprintf(alone, sizeof(alone), "%.1f%%", 100. * packets.singleRays() / rays);
+			}
+			std::printf("%8d %7s %7s %10.2f %12s %10s  %016llx\n", cases[c].spheres, accelName(cases[c].accel), size, options.frames / seconds,
+				tests, alone, (unsigned long long)checksum);
+		}
+	}
+
+	return 0;
+}
+
+// Renders the scripted path from each glyph table with one ray per cell and with --subcells,
+// and reports frames/sec, primary rays per cell, edge cells and the cells whose glyph differs
+// from one ray per cell
+int runSubcellBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	// building the lookup tables is a one-off
+	clock::time_point built = clock::now();
+	SubcellGlyphs::instance();
+	std::printf("glyph tables built in %.2f ms\n", std::chrono::duration<double>(clock::now() - built).count() * 1000);
+
+	const GlyphTable tables[] = { GlyphTable::Basic, GlyphTable::Extended };
+	const size_t cells = (size_t)options.width * options.height;
+
+	std::printf("%dx%d, %d frames, %d threads\n", options.width, options.height, options.frames, pool.size());
+	std::printf("%10s %10s %10s %10s %10s %10s\n", "glyphs", "rays", "frames/s", "rays/cell", "edges", "changed");
+
+	std::vector<std::vector<wchar_t> > single(options.frames);
+	for (int m = 0; m < 4; m++)
+	{
+		// one ray per cell, then subcells, for each table
+		GlyphTable table = tables[m / 2];
+		bool subsampled = m % 2 == 1;
+
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		SubcellRenderer subcells;
+		subcells.setTable(table);
+		if (!subsampled) subcells.setEdgeThreshold(FLT_MAX);
+		RayStats stats;
+		double seconds = 0;
+		size_t changed = 0;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+
+			clock::time_point start = clock::now();
+			subcells.render(frame, options.width, options.height, scene, camera, stats, pool);
+			seconds += std::chrono::duration<double>(clock::now() - start).count();
+
+			const wchar_t *cellsOut = frame.getBuffer();
+			if (!subsampled)
+			{
+				single[f].assign(cellsOut, cellsOut + cells);
+				continue;
+			}
+			for (size_t c = 0; c < cells; c++)
+			{
+				if (cellsOut[c] != single[f][c]) changed++;
+			}
+		}
+
+		double total = (double)cells * options.frames;
+		std::printf("%10s %10s %10.2f %10.2f %9.1f%% %9.1f%%\n", glyphTableName(table), subsampled ? "subcells" : "single", options.frames / seconds,
+			stats.primaryRays / total, 100. * subcells.edgeCells() / total, 100. * changed / total);
+	}
+
+	return 0;
+}
+
+// Bytes an ANSI terminal is sent per frame of the scripted path, rendered in colour: without
+// colour, in 256 colours and in 24-bit colour, and in 24-bit colour with an escape for every
+// cell written, as a terminal would get without coalescing
+int runColorBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	struct Output { const char *name; ColorMode mode; bool coalesce; };
+	const Output outputs[] = { { "mono", ColorMode::Mono, true }, { "256", ColorMode::Palette256, true },
+		{ "truecolor", ColorMode::TrueColor, true }, { "per cell", ColorMode::TrueColor, false } };
+	const int outputCount = sizeof(outputs) / sizeof(outputs[0]);
+
+	std::vector<AnsiFrameEncoder> encoders(outputCount, AnsiFrameEncoder(options.width, options.height));
+	for (int o = 0; o < outputCount; o++)
+	{
+		encoders[o].setColorMode(outputs[o].mode);
+		encoders[o].setCoalescing(outputs[o].coalesce);
+	}
+	size_t firstBytes[outputCount] = {}, bytes[outputCount] = {};
+	double seconds[outputCount] = {};
+
+	Camera camera;
+	FrameBuffer frame(options.width, options.height);
+	frame.enableColor();
+	RayStats stats;
+	std::string encoded;
+
+	for (int f = 0; f < options.frames; f++)
+	{
+		applyScriptedPath(f, camera, scene);
+		renderFrame(frame, options.width, options.height, scene, camera, stats, pool);
+
+		for (int o = 0; o < outputCount; o++)
+		{
+			encoded.clear();
+			clock::time_point start = clock::now();
+			encoders[o].encode(frame.getBuffer(), frame.getColors(), encoded);
+			seconds[o] += std::chrono::duration<double>(clock::now() - start).count();
+
+			if (f == 0) firstBytes[o] = encoded.size();
+			else bytes[o] += encoded.size();
+		}
+	}
+
+	std::printf("%dx%d, %d frames, %zu spheres\n", options.width, options.height, options.frames, scene.sphereData.count);
+	std::printf("%10s %14s %14s %14s\n", "", "first frame", "bytes/frame", "encode us");
+	for (int o = 0; o < outputCount; o++)
+	{
+		std::printf("%10s %14zu %14.0f %14.1f\n", outputs[o].name, firstBytes[o], (double)bytes[o] / std::max(options.frames - 1, 1),
+			seconds[o] * 1e6 / options.frames);
+	}
+
+	return 0;
+}
+
+// Render frames --first-frame on of the scripted path into --record's file.  A frame only
+// depends on its number, so each thread renders whole frames with its own copy of the scene, and
+// finished frames wait in a small window until the ones before them are written.  Animated
+// spheres and the renderers that keep state between frames need every frame in turn: then the
+// frames are rendered in order, each split into tiles across the threads as usual.
+int runRecord(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+
+	RecordingWriter writer;
+	std::string error;
+	if (!writer.open(options.record, options.width, options.height, options.keyframeInterval, (uint64_t)options.recordMb << 20, error))
+	{
+		std::fprintf(stderr, "%s: %s\n", options.record.c_str(), error.c_str());
+		return 1;
+	}
+
+	bool inOrder = options.animate > 0 || options.gbuffer || options.checkerboard;
+	int threads = options.threads > 0 ? options.threads : (int)std::max(std::thread::hardware_concurrency(), 1u);
+	int workers = inOrder ? 1 : threads;
+
+	const int window = 2 * workers;
+	std::vector<FrameBuffer> finished(window, FrameBuffer(options.width, options.height));
+	std::vector<bool> ready(window, false);
+	int written = 0;
+	bool failed = false;
+	uint64_t checksum = 14695981039346656037ull;
+	RayStats stats;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::atomic<int> claimed(0);
+
+	clock::time_point start = clock::now();
+
+	auto render = [&](int poolThreads)
+	{
+		Scene own = scene;
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		ThreadPool pool(poolThreads);
+		Renderers renderers;
+		RayStats ownStats;
+
+		for (int f; (f = claimed++) < options.frames;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [&] { return failed || f < written + window; });
+				if (failed) break;
+			}
+
+			int number = options.firstFrame + f;
+			applyScriptedPath(number, camera, own);
+			if (options.animate > 0) animateSpheres(own, number / 30.f, options.animate);
+			renderSelected(options, frame, options.width, options.height, own, camera, ownStats, pool, renderers);
+
+			// hand the frame over and write out every frame that is next in line
+			std::lock_guard<std::mutex> lock(mutex);
+			std::swap(finished[f % window], frame);
+			ready[f % window] = true;
+			while (!failed && written < options.frames && ready[written % window])
+			{
+				const FrameBuffer &next = finished[written % window];
+				checksum = (checksum ^ next.checksum()) * 1099511628211ull;
+				if (!writer.append(next.getBuffer(), options.firstFrame + written, error)) failed = true;
+				ready[written % window] = false;
+				written++;
+			}
+			condition.notify_all();
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		stats += ownStats;
+	};
+
+	if (inOrder)
+	{
+		render(options.threads);
+	}
+	else
+	{
+		std::vector<std::thread> renderers;
+		for (int w = 0; w < workers; w++) renderers.push_back(std::thread(render, 1));
+		for (int w = 0; w < workers; w++) renderers[w].join();
+	}
+
+	if (failed || !writer.close(error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	uint64_t cells = (uint64_t)options.width * options.height;
+	std::printf("frames:             %d to %d, %.2f frames/s (%s on %d thread%s)\n", options.firstFrame, options.firstFrame + options.frames - 1,
+		options.frames / seconds, inOrder ? "tiles in order" : "whole frames", threads, threads == 1 ? "" : "s");
+	std::printf("primary rays/sec:   %.0f\n", stats.primaryRays / seconds);
+	std::printf("keyframes:          %llu\n", (unsigned long long)writer.getKeyframes());
+	std::printf("bytes/frame:        %.0f (%llu cells)\n", (double)writer.getEncodedBytes() / options.frames, (unsigned long long)cells);
+	std::printf("file size:          %llu (at most %d MB)\n", (unsigned long long)writer.fileSize(), options.recordMb);
+	std::printf("checksum:           %016llx\n", (unsigned long long)checksum);
+	return 0;
+}
+
+// Decode every frame of --play's file without a console and print the same checksum --headless
+// and --record print for those frames
+int runPlaybackCheck(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	RecordingReader recording;
+	std::string error;
+	if (!recording.open(options.play, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	clock::time_point start = clock::now();
+	if (options.seek >= 0 && !recording.seek((uint32_t)options.seek, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	double seekMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+	FrameBuffer frame(recording.getWidth(), recording.getHeight());
+	size_t cells = (size_t)recording.getWidth() * recording.getHeight();
+	uint64_t checksum = 14695981039346656037ull;
+	uint32_t first = recording.getFrameNumber();
+	int frames = 0;
+
+	start = clock::now();
+	do
+	{
+		std::copy(recording.getCells(), recording.getCells() + cells, frame.getBuffer());
+		checksum = (checksum ^ frame.checksum()) * 1099511628211ull;
+		frames++;
+	} while (recording.next(error));
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+	if (!error.empty())
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	std::printf("frames:             %u to %u of %u to %u, %zu keyframes\n", first, recording.getFrameNumber(), recording.firstFrame(), recording.lastFrame(),
+		recording.keyframeCount());
+	if (options.seek >= 0) std::printf("seek ms:            %.3f\n", seekMs);
+	std::printf("decoded frames/s:   %.0f\n", frames / seconds);
+	std::printf("checksum:           %016llx\n", (unsigned long long)checksum);
+	return 0;
+}
+
+// Render the scripted path at --serve-fps for the viewers of --serve until interrupted
+int runServer(const Options &options)
+{
+#if WT_SERVER
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+
+	FrameServer server(options.width, options.height, options.color);
+	std::string error;
+	if (!server.listen(options.serve, error))
+	{
+		std::fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+	stopOnInterrupt();
+
+	Camera camera;
+	FrameBuffer frame(options.width, options.height);
+	if (options.color != ColorMode::Mono) frame.enableColor();
+	ThreadPool pool(options.threads);
+	Renderers renderers;
+	RayStats stats;
+
+	std::printf("serving %dx%d frames at %d/s on %s; Ctrl-C stops\n", options.width, options.height, options.serveFps, options.serve.c_str());
+	std::fflush(stdout);
+
+	clock::duration interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1. / options.serveFps));
+	clock::time_point next = clock::now();
+	double renderSeconds = 0;
+	for (int f = 0; !stopRequested; f++)
+	{
+		applyScriptedPath(f, camera, scene);
+		if (options.animate > 0) animateSpheres(scene, f / 30.f, options.animate);
+		server.acceptClients();
+
+		clock::time_point start = clock::now();
+		renderSelected(options, frame, options.width, options.height, scene, camera, stats, pool, renderers);
+		renderSeconds += std::chrono::duration<double>(clock::now() - start).count();
+
+		server.broadcast(frame.getBuffer(), frame.getColors());
+
+		// don't try to make up for frames that ran late
+		next += interval;
+		if (next < clock::now()) next = clock::now();
+		std::this_thread::sleep_until(next);
+	}
+
+	uint64_t frames = std::max<uint64_t>(server.getFrames(), 1);
+	std::printf("\nframes:             %llu (%.3f ms rendering each)\n", (unsigned long long)server.getFrames(), renderSeconds * 1000 / frames);
+	std::printf("viewers:            %llu connected, %zu at the end\n", (unsigned long long)server.getClientsServed(), server.clientCount());
+	std::printf("delta bytes/frame:  %llu\n", (unsigned long long)(server.getDeltaBytes() / frames));
+	std::printf("keyframes:          %llu\n", (unsigned long long)server.getKeyframes());
+	std::printf("frames skipped:     %llu\n", (unsigned long long)server.getFramesSkipped());
+	return 0;
+#else
+	(void)options;
+	std::fprintf(stderr, "--serve needs UNIX domain sockets, which this build doesn't have\n");
+	return 1;
+#endif
+}
+
+// The time broadcasting a frame takes with 0 to 64 viewers connected through socket pairs.  All
+// but one are read by a thread as fast as it can; the last is never read, to show that a
+// stalled viewer only costs itself frames.
+int runServerBenchmark(const Options &options)
+{
+#if WT_SERVER
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+	const int counts[] = { 0, 1, 8, 64 };
+
+	std::printf("%dx%d, %d frames, %s\n", options.width, options.height, options.frames, colorModeName(options.color));
+	std::printf("%8s %12s %14s %14s %12s %10s\n", "viewers", "render ms", "broadcast us", "bytes sent/f", "keyframes", "skipped");
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		std::unique_ptr<FrameServer> server(new FrameServer(options.width, options.height, options.color));
+		std::vector<int> readEnds;
+		int stalled = -1;
+		for (int v = 0; v < counts[c]; v++)
+		{
+			int ends[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, ends) != 0)
+			{
+				std::fprintf(stderr, "can't create a socket pair: %s\n", std::strerror(errno));
+				return 1;
+			}
+			server->addClient(ends[0]);
+			if (v + 1 < counts[c]) readEnds.push_back(ends[1]);
+			else stalled = ends[1];
+		}
+
+		// the readers: drain every socket until the server side closes
+		std::thread reader([&]()
+		{
+			std::vector<pollfd> waits;
+			for (size_t i = 0; i < readEnds.size(); i++) waits.push_back(pollfd{ readEnds[i], POLLIN, 0 });
+			char buffer[64 * 1024];
+			size_t open = waits.size();
+			while (open > 0)
+			{
+				if (poll(waits.data(), waits.size(), 100) <= 0) continue;
+				for (size_t i = 0; i < waits.size(); i++)
+				{
+					if (waits[i].fd < 0 || !(waits[i].revents & (POLLIN | POLLHUP))) continue;
+					if (read(waits[i].fd, buffer, sizeof(buffer)) <= 0)
+					{
+						waits[i].fd = -1;
+						open--;
+					}
+				}
+			}
+		});
+
+		Camera camera;
+		FrameBuffer frame(options.width, options.height);
+		if (options.color != ColorMode::Mono) frame.enableColor();
+		Renderers renderers;
+		RayStats stats;
+		double renderSeconds = 0, broadcastSeconds = 0;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			applyScriptedPath(f, camera, scene);
+
+			clock::time_point start = clock::now();
+			renderSelected(options, frame, options.width, options.height, scene, camera, stats, pool, renderers);
+			clock::time_point rendered = clock::now();
+			server->broadcast(frame.getBuffer(), frame.getColors());
+			clock::time_point sent = clock::now();
+
+			renderSeconds += std::chrono::duration<double>(rendered - start).count();
+			broadcastSeconds += std::chrono::duration<double>(sent - rendered).count();
+		}
+
+		uint64_t bytesSent = server->getBytesSent(), keyframes = server->getKeyframes(), skipped = server->getFramesSkipped();
+
+		// closing the server's ends lets the reader finish
+		server.reset();
+		reader.join();
+		for (size_t i = 0; i < readEnds.size(); i++) close(readEnds[i]);
+		if (stalled >= 0) close(stalled);
+
+		std::printf("%8d %12.3f %14.1f %14.0f %12llu %10llu\n", counts[c], renderSeconds * 1000 / options.frames, broadcastSeconds * 1e6 / options.frames,
+			(double)bytesSent / options.frames, (unsigned long long)keyframes, (unsigned long long)skipped);
+	}
+
+	return 0;
+#else
+	(void)options;
+	std::fprintf(stderr, "--bench-server needs UNIX domain sockets, which this build doesn't have\n");
+	return 1;
+#endif
+}
+
+// Renders the scripted path with exact and fast math and reports the speed of each and how many
+// cells end up with a different glyph
+int runPrecisionBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	FrameBuffer frames[2] = { FrameBuffer(options.width, options.height), FrameBuffer(options.width, options.height) };
+	Camera cameras[2];
+	Renderers renderers[2];
+	RayStats stats[2];
+	double seconds[2] = {};
+	uint64_t checksums[2] = { 14695981039346656037ull, 14695981039346656037ull };
+
+	GlyphDifference difference;
+
+	for (int f = 0; f < options.frames; f++)
+	{
+		for (int p = 0; p < 2; p++)
+		{
+			Options settings = options;
+			settings.precision = p == 0 ? Precision::Exact : Precision::Fast;
+			applyScriptedPath(f, cameras[p], scene);
+
+			clock::time_point start = clock::now();
+			renderSelected(settings, frames[p], options.width, options.height, scene, cameras[p], stats[p], pool, renderers[p]);
+			seconds[p] += std::chrono::duration<double>(clock::now() - start).count();
+
+			checksums[p] = (checksums[p] ^ frames[p].checksum()) * 1099511628211ull;
+		}
+
+		difference.add(frames[0].getBuffer(), frames[1].getBuffer(), (size_t)options.width * options.height);
+	}
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads\n", options.width, options.height, options.frames,
+		scene.sphereData.count, pool.size());
+	std::printf("%10s %12s %14s %18s\n", "precision", "frames/s", "rays/s", "checksum");
+	for (int p = 0; p < 2; p++)
+	{
+		std::printf("%10s %12.2f %14.0f  %016llx\n", precisionName(p == 0 ? Precision::Exact : Precision::Fast),
+			options.frames / seconds[p], stats[p].total() / seconds[p], (unsigned long long)checksums[p]);
+	}
+
+	difference.print();
+
+	return 0;
+}
+
+// Frame rate and shadow rays at 1 to 1000 lights (see makeRandomLights), shading every light as
+// if none had a range, only the lights in range, and --light-samples of them (default 4) picked
+// at random; sampling is compared with shading the lights in range for glyph error
+int runLightBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	const int counts[] = { 1, 10, 100, 1000 };
+	const char *modes[] = { "all", "in range", "sampled" };
+	int samples = options.lightSamples > 0 ? options.lightSamples : 4;
+
+	Options settings = options;
+	settings.lights = 0;
+	settings.lightSamples = 0;
+	Scene scene;
+	if (!makeScene(settings, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads, %d samples\n", options.width, options.height, options.frames,
+		scene.sphereData.count, pool.size(), samples);
+	std::printf("%7s %9s %12s %16s %14s %12s\n", "lights", "shading", "frames/s", "shadow rays/f", "cells changed", "mean error");
+
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		makeRandomLights(scene, counts[c]);
+		std::vector<Light> ranged = scene.lights;
+		std::vector<Light> unranged = ranged;
+		for (size_t i = 0; i < unranged.size(); i++) unranged[i].range = FLT_MAX;
+
+		FrameBuffer frames[3] = { FrameBuffer(options.width, options.height), FrameBuffer(options.width, options.height), FrameBuffer(options.width, options.height) };
+		Camera cameras[3];
+		RayStats stats[3];
+		double seconds[3] = {};
+		GlyphDifference difference;
+
+		for (int f = 0; f < options.frames; f++)
+		{
+			for (int m = 0; m < 3; m++)
+			{
+				scene.lights = m == 0 ? unranged : ranged;
+				scene.lightSamples = m == 2 ? samples : 0;
+				applyScriptedPath(f, cameras[m], scene);
+
+				clock::time_point start = clock::now();
+				renderFrame(frames[m], options.width, options.height, scene, cameras[m], stats[m], pool);
+				seconds[m] += std::chrono::duration<double>(clock::now() - start).count();
+			}
+
+			difference.add(frames[1].getBuffer(), frames[2].getBuffer(), (size_t)options.width * options.height);
+		}
+
+		for (int m = 0; m < 3; m++)
+		{
+			std::printf("%7d %9s %12.2f %16.0f", counts[c], modes[m], options.frames / seconds[m], (double)stats[m].shadowRays / options.frames);
+			if (m == 2) std::printf(" %13.2f%% %12.4f\n", 100. * difference.changed / difference.cells, (double)difference.steps / difference.cells);
+			else std::printf("\n");
+		}
+	}
+
+	return 0;
+}
+
+// Renders the scripted path in full and with --checkerboard and reports the speed of each and
+// how far the checkerboard frames are from the full ones
+int runCheckerboardBenchmark(const Options &options)
+{
+	typedef std::chrono::steady_clock clock;
+
+	Scene scene;
+	if (!makeScene(options, scene))
+		return 1;
+	ThreadPool pool(options.threads);
+
+	FrameBuffer frames[2] = { FrameBuffer(options.width, options.height), FrameBuffer(options.width, options.height) };
+	Camera cameras[2];
+	Renderers renderers[2];
+	RayStats stats[2];
+	double seconds[2] = {};
+	GlyphDifference difference;
+
+	for (int f = 0; f < options.frames; f++)
+	{
+		for (int p = 0; p < 2; p++)
+		{
+			Options settings = options;
+			settings.checkerboard = p == 1;
+			applyScriptedPath(f, cameras[p], scene);
+
+			clock::time_point start = clock::now();
+			renderSelected(settings, frames[p], options.width, options.height, scene, cameras[p], stats[p], pool, renderers[p]);
+			seconds[p] += std::chrono::duration<double>(clock::now() - start).count();
+		}
+
+		difference.add(frames[0].getBuffer(), frames[1].getBuffer(), (size_t)options.width * options.height);
+	}
+
+	std::printf("%dx%d, %d frames, %zu spheres, %d threads\n", options.width, options.height, options.frames,
+		scene.sphereData.count, pool.size());
+	std::printf("%14s %12s %18s %18s\n", "", "frames/s", "primary rays/f", "shadow rays/f");
+	for (int p = 0; p < 2; p++)
+	{
+		std::printf("%14s %12.2f %18.0f %18.0f\n", p == 0 ? "full" : "checkerboard", options.frames / seconds[p],
+			(double)stats[p].primaryRays / options.frames, (double)stats[p].shadowRays / options.frames);
+	}
+
+	difference.print();
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include "renderer.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// Screen-space binning of spheres for primary rays, as in tiled forward rendering.  Once a frame
+// each sphere's bounds are projected onto the screen and the sphere goes into the bin of every
+// render tile the projection overlaps; primary rays then test only their tile's bin instead of
+// the whole scene or the BVH.  Spheres behind the camera or off screen end up in no bin.
+//
+// Bins keep the scene order, so every ray finds the same sphere a linear search would and
+// frames are identical.  Shadow and secondary rays don't start at the eye and still use the
+// whole scene.
+
+// Cells added around each projected rectangle to absorb rounding
+const float binMargin = .5f;
+
+// Spheres per task when the rectangles are computed in parallel
+const int binChunk = 1024;
+
+class BinnedRenderer
+{
+private:
+	// tiles a sphere covers, inclusive; empty (x0 > x1) when it is off screen
+	struct TileSpan
+	{
+		int x0, y0, x1, y1;
+	};
+
+	std::vector<TileSpan> spans;
+	std::vector<SphereBin> bins;
+	int tilesPerRow = 0;
+	int tileRows = 0;
+
+	// Range of x / depth over the tangents from the eye to a circle at (x, depth), depth > radius
+	static void slopeRange(float x, float depth, float radius, float &lo, float &hi)
+	{
+		float squared = radius * radius;
+		float root = radius * std::sqrt(std::max(0.f, x * x + depth * depth - squared));
+		float denominator = depth * depth - squared;
+		lo = (x * depth - root) / denominator;
+		hi = (x * depth + root) / denominator;
+	}
+
+	TileSpan project(const Camera &camera, const vec3 &center, float radius, int width, int height) const
+	{
+		TileSpan none = { 1, 0, 0, 0 };
+		TileSpan all = { 0, 0, tilesPerRow - 1, tileRows - 1 };
+
+		vec3 view = camera.toView(center);
+		float depth = -view.z;
+		if (depth < -radius) return none;				// wholly behind the eye
+		if (depth < radius * 1.001f + 1e-3f) return all;	// around the eye
+
+		float xLo, xHi, yLo, yHi;
+		slopeRange(view.x, depth, radius, xLo, xHi);
+		slopeRange(view.y, depth, radius, yLo, yHi);
+
+		// screen y runs down, so the top edge comes from the highest slope
+		float left, top, right, bottom;
+		camera.slopeToScreen(xLo, yHi, left, top);
+		camera.slopeToScreen(xHi, yLo, right, bottom);
+
+		// cells whose centre (i + .5, j + .5) is inside, clamped before conversion to int
+		int i0 = (int)std::ceil(std::max(left - .5f - binMargin, -1.f));
+		int i1 = (int)std::floor(std::min(right - .5f + binMargin, (float)width));
+		int j0 = (int)std::ceil(std::max(top - .5f - binMargin, -1.f));
+		int j1 = (int)std::floor(std::min(bottom - .5f + binMargin, (float)height));
+		i0 = std::max(i0, 0);
+		j0 = std::max(j0, 0);
+		i1 = std::min(i1, width - 1);
+		j1 = std::min(j1, height - 1);
+		if (i0 > i1 || j0 > j1) return none;
+
+		TileSpan span = { i0 / tileWidth, j0 / tileHeight, i1 / tileWidth, j1 / tileHeight };
+		return span;
+	}
+
+public:
+	// Bin the scene's spheres for the camera pose of the last prepare()
+	void build(const Scene &scene, const Camera &camera, int width, int height, ThreadPool &pool)
+	{
+		// with a BVH the spheres are in leaf order with padding in between, so every slot is
+		// looked at and padding is skipped
+		const SphereSoA &spheres = scene.sphereData;
+		int count = (int)spheres.paddedCount();
+		tilesPerRow = (width + tileWidth - 1) / tileWidth;
+		tileRows = (height + tileHeight - 1) / tileHeight;
+
+		spans.resize(count);
+		pool.parallelFor((count + binChunk - 1) / binChunk, [&](int chunk, int)
+		{
+			int end = std::min(count, (chunk + 1) * binChunk);
+			for (int i = chunk * binChunk; i < end; i++)
+			{
+				if (spheres.r2[i] < 0) spans[i] = TileSpan{ 1, 0, 0, 0 };
+				else spans[i] = project(camera, spheres.center(i), std::sqrt(spheres.r2[i]), width, height);
+			}
+		});
+
+		bins.resize(tilesPerRow * tileRows);
+		for (size_t b = 0; b < bins.size(); b++) bins[b].index.clear();
+		for (int i = 0; i < count; i++)
+		{
+			const TileSpan &span = spans[i];
+			for (int y = span.y0; y <= span.y1; y++)
+			{
+				for (int x = span.x0; x <= span.x1; x++) bins[y * tilesPerRow + x].index.push_back(i);
+			}
+		}
+
+		// copied rather than set() so the radii squared stay bit for bit the same
+		pool.parallelFor((int)bins.size(), [&](int tile, int)
+		{
+			SphereBin &bin = bins[tile];
+			bin.spheres.resize(bin.index.size());
+			for (size_t k = 0; k < bin.index.size(); k++)
+			{
+				int i = bin.index[k];
+				bin.spheres.cx[k] = spheres.cx[i];
+				bin.spheres.cy[k] = spheres.cy[i];
+				bin.spheres.cz[k] = spheres.cz[i];
+				bin.spheres.r2[k] = spheres.r2[i];
+				bin.spheres.material[k] = spheres.material[i];
+			}
+		});
+	}
+
+	// The spheres primary rays through a tile can hit, as of the last build()
+	const SphereBin& bin(int tile) const { return bins[tile]; }
+
+	// Same output as renderFrame.  Math is the precision policy (see precision.h).
+	template <typename Math = ExactMath, typename Target>
+	void render(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+	{
+		camera.prepare(width, height);
+		build(scene, camera, width, height, pool);
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			RayStats &tileStats = workerStats[worker].stats;
+			const SphereBin &tileBin = bins[tile];
+
+			for (int j = rect.y0; j < rect.y1; j++)
+			{
+				for (int i = rect.x0; i < rect.x1; i++)
+				{
+					vec3 dir = camera.rayDirection(i, j);
+
+					// same as cast_ray, with the tile's spheres
+					tileStats.primaryRays++;
+					vec3 point, N;
+					const Material *material;
+					float val = 0;
+					if (scene_intersect<Math>(camera.position, dir, scene, &tileBin, point, N, material))
+						val = shade<Math>(point, N, material, dir, scene, tileStats);
+
+					target.setPixel(i, j, getShadingChar(val));
+				}
+			}
+		});
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+	}
+};
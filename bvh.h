@@ -0,0 +1,425 @@
+#pragma once
+#include "geometry.h"
+#include "mapped.h"
+#include <vector>
+#include <cfloat>
+#include <algorithm>
+#include <cstdint>
+
+// Axis aligned bounding box
+struct AABB
+{
+	vec3 lo;
+	vec3 hi;
+
+	AABB() : lo(FLT_MAX), hi(-FLT_MAX) {}
+	AABB(const vec3 &lo, const vec3 &hi) : lo(lo), hi(hi) {}
+
+	void grow(const vec3 &p)
+	{
+		lo = vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+		hi = vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+	}
+
+	void grow(const AABB &box)
+	{
+		if (box.empty()) return;
+		grow(box.lo);
+		grow(box.hi);
+	}
+
+	bool empty() const { return lo.x > hi.x; }
+
+	vec3 centroid() const { return (lo + hi) * .5f; }
+
+	float surfaceArea() const
+	{
+		if (empty()) return 0;
+		vec3 d = hi - lo;
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+// Node of a flattened BVH, 32 bytes so two siblings share a cache line.  Siblings are stored
+// next to each other: an interior node's children are at first and first + 1.  A leaf holds
+// the slots [first, first + count) of the primitive arrays, which always cover whole SIMD
+// blocks.
+struct BVHNode
+{
+	float lo[3];
+	int first;
+	float hi[3];
+	int count;				// 0 for interior nodes
+
+	bool isLeaf() const { return count > 0; }
+};
+
+// Ray data reused for every box test during one traversal
+struct BVHRay
+{
+	float ox, oy, oz;
+	float idx, idy, idz;	// reciprocal direction
+
+	BVHRay() {}
+	BVHRay(const vec3 &orig, const vec3 &dir) : ox(orig.x), oy(orig.y), oz(orig.z), idx(1.f / dir.x), idy(1.f / dir.y), idz(1.f / dir.z) {}
+};
+
+// Narrow [tmin, tmax] to where the ray is between two planes at distances t1 and t2.  A ray
+// parallel to the planes that starts on one of them makes 0 * inf = NaN there; std::min and
+// std::max return their first argument when a comparison with NaN fails, so each distance is
+// compared with the running bound first and the NaN drops out, leaving the bounds as they were.
+inline void clipSlab(float t1, float t2, float &tmin, float &tmax)
+{
+	float enter = std::min(std::max(tmin, t1), std::max(tmin, t2));
+	tmax = std::max(std::min(tmax, t1), std::min(tmax, t2));
+	tmin = enter;
+}
+
+// Distance at which the ray enters the node's box, or FLT_MAX if it misses it (or only
+// reaches it beyond tMax).  Rays that graze a face count as hitting the box.
+inline float intersectBox(const BVHNode &node, const BVHRay &ray, float tMax)
+{
+	float tmin = -FLT_MAX, tmax = FLT_MAX;
+	clipSlab((node.lo[0] - ray.ox) * ray.idx, (node.hi[0] - ray.ox) * ray.idx, tmin, tmax);
+	clipSlab((node.lo[1] - ray.oy) * ray.idy, (node.hi[1] - ray.oy) * ray.idy, tmin, tmax);
+	clipSlab((node.lo[2] - ray.oz) * ray.idz, (node.hi[2] - ray.oz) * ray.idz, tmin, tmax);
+
+	if (tmax >= tmin && tmax >= 0 && tmin < tMax) return tmin;
+	return FLT_MAX;
+}
+
+// Bounding volume hierarchy built with the binned surface area heuristic.
+//
+// The primitives themselves are not stored; build() returns the order the caller should lay
+// them out in (with -1 for padding slots), so that every leaf covers a run of whole SIMD
+// blocks and can be handed straight to a block kernel.
+class BVH
+{
+private:
+	static const int binCount = 16;
+
+	// cost of a traversal step relative to intersecting one block of primitives
+	static constexpr float traversalCost = 1.f;
+
+	struct BuildItem
+	{
+		AABB bounds;
+		vec3 centroid;
+		int index;
+	};
+
+	struct Bin
+	{
+		AABB bounds;
+		int count = 0;
+	};
+
+	size_t blockSize = 1;
+	size_t maxLeafSize = 1;
+	std::vector<BuildItem> items;
+	std::vector<int> *slotsOut = nullptr;
+
+	float blocks(size_t count) const { return (float)((count + blockSize - 1) / blockSize); }
+
+	void makeLeaf(BVHNode &node, size_t begin, size_t end)
+	{
+		std::vector<int> &slots = *slotsOut;
+		node.first = (int)slots.size();
+		for (size_t i = begin; i < end; i++) slots.push_back(items[i].index);
+		while (slots.size() % blockSize) slots.push_back(-1);
+		node.count = (int)slots.size() - node.first;
+	}
+
+	void setBounds(BVHNode &node, const AABB &box)
+	{
+		node.lo[0] = box.lo.x; node.lo[1] = box.lo.y; node.lo[2] = box.lo.z;
+		node.hi[0] = box.hi.x; node.hi[1] = box.hi.y; node.hi[2] = box.hi.z;
+	}
+
+	// Split items[begin, end) at the cheapest bin boundary; returns the split point, or begin if
+	// keeping the items in one leaf is cheaper
+	size_t partition(size_t begin, size_t end, const AABB &bounds, int depth)
+	{
+		size_t count = end - begin;
+
+		AABB centroidBounds;
+		for (size_t i = begin; i < end; i++) centroidBounds.grow(items[i].centroid);
+
+		float bestCost = FLT_MAX;
+		int bestAxis = -1;
+		int bestBin = 0;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float lo = centroidBounds.lo[axis];
+			float hi = centroidBounds.hi[axis];
+			if (!(hi > lo)) continue;
+
+			Bin bins[binCount];
+			float scale = binCount / (hi - lo);
+			for (size_t i = begin; i < end; i++)
+			{
+				int b = std::min(binCount - 1, (int)((items[i].centroid[axis] - lo) * scale));
+				bins[b].count++;
+				bins[b].bounds.grow(items[i].bounds);
+			}
+
+			// sweep from the right to get the cost of everything right of each boundary
+			float rightArea[binCount];
+			int rightCount[binCount];
+			AABB right;
+			int n = 0;
+			for (int b = binCount - 1; b > 0; b--)
+			{
+				right.grow(bins[b].bounds);
+				n += bins[b].count;
+				rightArea[b] = right.surfaceArea();
+				rightCount[b] = n;
+			}
+
+			AABB left;
+			n = 0;
+			for (int b = 0; b < binCount - 1; b++)
+			{
+				left.grow(bins[b].bounds);
+				n += bins[b].count;
+				if (n == 0 || rightCount[b + 1] == 0) continue;
+
+				float cost = left.surfaceArea() * blocks(n) + rightArea[b + 1] * blocks(rightCount[b + 1]);
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestBin = b;
+				}
+			}
+		}
+
+		float area = bounds.surfaceArea();
+		float leafCost = blocks(count);
+		float splitCost = area > 0 ? traversalCost + bestCost / area : FLT_MAX;
+
+		bool mustSplit = count > maxLeafSize && depth < maxDepth;
+		if (!mustSplit && leafCost <= splitCost) return begin;
+		if (depth >= maxDepth) return begin;
+
+		size_t mid;
+		if (bestAxis >= 0)
+		{
+			float lo = centroidBounds.lo[bestAxis];
+			float scale = binCount / (centroidBounds.hi[bestAxis] - lo);
+			mid = std::partition(items.begin() + begin, items.begin() + end, [&](const BuildItem &item)
+			{
+				return std::min(binCount - 1, (int)((item.centroid[bestAxis] - lo) * scale)) <= bestBin;
+			}) - items.begin();
+		}
+		else
+		{
+			// every centroid is in the same place: split by count
+			mid = begin + count / 2;
+		}
+
+		if (mid == begin || mid == end) mid = begin + count / 2;
+		return mid;
+	}
+
+	void buildNode(int nodeIndex, size_t begin, size_t end, int depth)
+	{
+		AABB bounds;
+		for (size_t i = begin; i < end; i++) bounds.grow(items[i].bounds);
+		setBounds(nodes[nodeIndex], bounds);
+
+		size_t mid = partition(begin, end, bounds, depth);
+		if (mid == begin)
+		{
+			makeLeaf(nodes[nodeIndex], begin, end);
+			return;
+		}
+
+		// children are allocated as a pair
+		int left = (int)nodes.size();
+		nodes.push_back(BVHNode());
+		nodes.push_back(BVHNode());
+		nodes[nodeIndex].first = left;
+		nodes[nodeIndex].count = 0;
+
+		buildNode(left, begin, mid, depth + 1);
+		buildNode(left + 1, mid, end, depth + 1);
+	}
+
+public:
+	// Deepest a node lies below the root; traversal stacks are sized for it
+	static const int maxDepth = 64;
+
+	MappedArray<BVHNode> nodes;
+
+	bool empty() const { return nodes.empty(); }
+
+	// Build over the given primitive bounds.  Leaves hold at most maxLeafBlocks blocks of
+	// primitivesPerBlock primitives.  slots receives the primitive index for every slot of the
+	// primitive arrays, -1 for padding.
+	void build(const std::vector<AABB> &bounds, size_t primitivesPerBlock, size_t maxLeafBlocks, std::vector<int> &slots)
+	{
+		blockSize = primitivesPerBlock;
+		maxLeafSize = primitivesPerBlock * maxLeafBlocks;
+		slotsOut = &slots;
+		slots.clear();
+		nodes.clear();
+
+		items.resize(bounds.size());
+		for (size_t i = 0; i < bounds.size(); i++)
+		{
+			items[i].bounds = bounds[i];
+			items[i].centroid = bounds[i].centroid();
+			items[i].index = (int)i;
+		}
+
+		if (!items.empty())
+		{
+			nodes.reserve(2 * (items.size() / primitivesPerBlock + 1));
+			nodes.push_back(BVHNode());
+			buildNode(0, 0, items.size(), 0);
+		}
+
+		items.clear();
+		items.shrink_to_fit();
+		slotsOut = nullptr;
+	}
+
+	// Visit the leaves the ray passes through, nearest first.  leaf(first, count, tMax) tests
+	// the leaf's primitives and lowers tMax to the nearest hit; leaves and subtrees entered
+	// beyond tMax are skipped.  Traversal stops early if leaf returns true.
+	template <typename LeafFn>
+	void traverse(const vec3 &orig, const vec3 &dir, float &tMax, LeafFn leaf) const
+	{
+		if (nodes.empty()) return;
+
+		BVHRay ray(orig, dir);
+		if (intersectBox(nodes[0], ray, tMax) == FLT_MAX) return;
+
+		struct Entry { int node; float t; };
+		Entry stack[maxDepth * 2];
+		int stackSize = 0;
+
+		int current = 0;
+		for (;;)
+		{
+			const BVHNode &node = nodes[current];
+			if (node.isLeaf())
+			{
+				if (leaf(node.first, node.count, tMax)) return;
+			}
+			else
+			{
+				float tLeft = intersectBox(nodes[node.first], ray, tMax);
+				float tRight = intersectBox(nodes[node.first + 1], ray, tMax);
+
+				int nearChild = node.first, farChild = node.first + 1;
+				if (tRight < tLeft)
+				{
+					std::swap(tLeft, tRight);
+					std::swap(nearChild, farChild);
+				}
+
+				if (tLeft != FLT_MAX)
+				{
+					if (tRight != FLT_MAX)
+					{
+						stack[stackSize].node = farChild;
+						stack[stackSize].t = tRight;
+						stackSize++;
+					}
+					current = nearChild;
+					continue;
+				}
+			}
+
+			// resume with the nearest postponed subtree that can still hold a closer hit
+			for (;;)
+			{
+				if (stackSize == 0) return;
+				stackSize--;
+				if (stack[stackSize].t < tMax) break;
+			}
+			current = stack[stackSize].node;
+		}
+	}
+
+	// Bitmask of the rays in mask whose segment [0, tMax) passes through the node's box
+	static uint32_t intersectBoxes(const BVHNode &node, const BVHRay *rays, const float *tMax, uint32_t mask)
+	{
+		uint32_t hit = 0;
+		for (uint32_t remaining = mask; remaining; remaining &= remaining - 1)
+		{
+			int r = lowestBit(remaining);
+			if (intersectBox(node, rays[r], tMax[r]) != FLT_MAX) hit |= 1u << r;
+		}
+		return hit;
+	}
+
+	static int lowestBit(uint32_t mask)
+	{
+		int bit = 0;
+		while (!(mask & 1)) { mask >>= 1; bit++; }
+		return bit;
+	}
+
+	// Visit the leaves that any of up to 32 rays pass through, each leaf once for all of them,
+	// so rays that travel together share node fetches and box tests.  leaf(first, count, mask)
+	// tests the leaf against the rays in mask and returns the bits of the rays that are done;
+	// traversal stops once every ray in active is done.
+	template <typename LeafFn>
+	void traverseBatch(const BVHRay *rays, const float *tMax, uint32_t active, LeafFn leaf) const
+	{
+		if (nodes.empty()) return;
+
+		struct Entry { int node; uint32_t mask; };
+		Entry stack[maxDepth * 2];
+		int stackSize = 0;
+
+		int current = 0;
+		uint32_t mask = intersectBoxes(nodes[0], rays, tMax, active);
+		while (mask)
+		{
+			const BVHNode &node = nodes[current];
+			if (node.isLeaf())
+			{
+				active &= ~leaf(node.first, node.count, mask);
+				if (!active) return;
+			}
+			else
+			{
+				uint32_t leftMask = intersectBoxes(nodes[node.first], rays, tMax, mask);
+				uint32_t rightMask = intersectBoxes(nodes[node.first + 1], rays, tMax, mask);
+
+				if (leftMask && rightMask)
+				{
+					stack[stackSize].node = node.first + 1;
+					stack[stackSize].mask = rightMask;
+					stackSize++;
+				}
+				if (leftMask)
+				{
+					current = node.first;
+					mask = leftMask;
+					continue;
+				}
+				if (rightMask)
+				{
+					current = node.first + 1;
+					mask = rightMask;
+					continue;
+				}
+			}
+
+			// resume with a postponed subtree that still has unfinished rays
+			mask = 0;
+			while (!mask && stackSize > 0)
+			{
+				stackSize--;
+				current = stack[stackSize].node;
+				mask = stack[stackSize].mask & active;
+			}
+		}
+	}
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include "geometry.h"
+#include "profile.h"
+#include <vector>
+
+const float PI = 3.14f;
+
+// corrective scalar (monospace characters are not square, they are rectangular)
+const float consoleViewportCorrection = .5f;
+
+// Where the image is seen from.
+//
+// The view space direction through every console cell only depends on the console size and
+// the field of view, so they are computed once and kept; each frame only builds the rotation
+// from yaw and pitch and applies it with a single matrix multiply per cell.
+class Camera
+{
+private:
+	int cachedWidth = 0;
+	int cachedHeight = 0;
+	float cachedFov = 0;
+	float tanHalfFov = 0;
+	std::vector<vec3> viewDirections;	// row-major, one per cell
+
+	mat3 orientation = identity<3, 3, float>();
+
+public:
+	vec3 position;
+	vec3 rotation;						// x: pitch, y: yaw (radians)
+	float fov = PI / 4.f;
+
+	// Bring the cached directions and the orientation up to date; call once per frame before
+	// rayDirection() is used (not thread safe)
+	void prepare(int width, int height)
+	{
+		WT_PROFILE_SCOPE(RayGeneration);
+		if (width != cachedWidth || height != cachedHeight || fov != cachedFov)
+		{
+			cachedWidth = width;
+			cachedHeight = height;
+			cachedFov = fov;
+
+			tanHalfFov = tan(fov / 2.);
+			viewDirections.resize(width * height);
+			for (int j = 0; j < height; j++)
+			{
+				for (int i = 0; i < width; i++)
+				{
+					float x = (2 * (i + 0.5) / (float)width - 1) * tanHalfFov * width * consoleViewportCorrection / (float)height;
+					float y = -(2 * (j + 0.5) / (float)height - 1) * tanHalfFov;
+					viewDirections[j * width + i] = vec3(x, y, -1).normalize();
+				}
+			}
+		}
+
+		// yaw first, then pitch
+		orientation = rotationX(rotation.x) * rotationY(rotation.y);
+	}
+
+	const mat3& getOrientation() const { return orientation; }
+
+	// World space direction of the primary ray through the centre of cell (i, j)
+	vec3 rayDirection(int i, int j) const
+	{
+		return orientation * viewDirections[j * cachedWidth + i];
+	}
+
+	// World space direction of the primary ray through screen position (x, y), in cells; cell
+	// (i, j) spans i..i+1, j..j+1.  For points inside a cell, where rayDirection() only has the
+	// centre.
+	vec3 rayDirectionAt(float x, float y) const
+	{
+		float slopeX = (2 * x / (float)cachedWidth - 1) * tanHalfFov * cachedWidth * consoleViewportCorrection / (float)cachedHeight;
+		float slopeY = -(2 * y / (float)cachedHeight - 1) * tanHalfFov;
+		return orientation * vec3(slopeX, slopeY, -1).normalize();
+	}
+
+	// A world space point in view space, where the camera looks down -z
+	vec3 toView(const vec3 &point) const
+	{
+		// the orientation is a rotation, so its transpose takes world space back to view space
+		vec3 offset = point - position;
+		return vec3(orientation[0] * offset, orientation[1] * offset, orientation[2] * offset);
+	}
+
+	// Screen position, in cells, of the view direction (slopeX, slopeY, -1); cell (i, j) spans
+	// i..i+1, j..j+1
+	void slopeToScreen(float slopeX, float slopeY, float &x, float &y) const
+	{
+		float aspect = cachedWidth * consoleViewportCorrection / (float)cachedHeight;
+		x = (slopeX / (tanHalfFov * aspect) + 1) * cachedWidth / 2;
+		y = (-slopeY / tanHalfFov + 1) * cachedHeight / 2;
+	}
+
+	// Where a world space point lands on screen and its distance along the view axis; false if
+	// it is behind the camera.  The inverse of rayDirection() for the pose of the last prepare().
+	bool project(const vec3 &point, float &x, float &y, float &depth) const
+	{
+		vec3 view = toView(point);
+		if (view.z > -1e-3f) return false;
+
+		depth = -view.z;
+		slopeToScreen(view.x / depth, view.y / depth, x, y);
+		return true;
+	}
+};
@@ -0,0 +1,181 @@
+#pragma once
+#include "renderer.h"
+#include "gbuffer.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+
+// Checkerboard rendering: each frame traces primary rays for the cells of one colour of a
+// checkerboard, swapping colours every frame, and rebuilds the other half from the last frame.
+//
+// The last frame's hits are kept in world space and projected through the new camera; each cell
+// that wasn't traced takes the nearest hit that lands in it and is shaded again from there, so
+// moving lights stay correct and only the primary rays are saved.  A cell that no hit lands in,
+// or whose hit is now behind everything its traced neighbours see, gets the mean of those
+// neighbours.  Any change in size or scene traces the whole frame.
+
+// A reprojected hit further away than every traced neighbour's by more than this fraction is
+// taken to be hidden now
+const float checkerboardOcclusion = .05f;
+
+class CheckerboardRenderer
+{
+private:
+	// a cell's primary hit; material is -1 for a miss and -2 when the cell was filled in from
+	// its neighbours and has no hit of its own
+	struct Sample
+	{
+		vec3 point;
+		vec3 N;
+		int material;
+	};
+
+	std::vector<Sample> samples;
+	std::vector<Sample> previous;
+	std::vector<float> values;		// shading value of each cell
+	std::vector<float> depths;		// distance of each cell's hit along the view axis
+	std::vector<int> landed;		// nearest previous sample projected into each untraced cell, or -1
+
+	bool valid = false;
+	int cachedWidth = 0;
+	int cachedHeight = 0;
+	uint64_t sceneVersion = 0;
+	int parity = 0;					// traced cells have (i + j) % 2 == parity
+
+	// project the previous frame's hits into the cells that weren't traced this frame
+	void reproject(int width, int height, const Camera &camera)
+	{
+		landed.assign(width * height, -1);
+		for (size_t k = 0; k < previous.size(); k++)
+		{
+			if (previous[k].material < 0) continue;
+
+			float x, y, depth;
+			if (!camera.project(previous[k].point, x, y, depth)) continue;
+			if (x < 0 || y < 0 || x >= width || y >= height) continue;
+
+			int i = (int)x, j = (int)y;
+			if (((i + j) & 1) == parity) continue;
+
+			int cell = j * width + i;
+			if (landed[cell] < 0 || depth < depths[cell])
+			{
+				landed[cell] = (int)k;
+				depths[cell] = depth;
+			}
+		}
+	}
+
+public:
+	// Forget the last frame, so the next one is traced in full
+	void invalidate() { valid = false; }
+
+	// Primary rays of the cells traced this frame are added to stats as usual; reprojected
+	// cells add only their shadow rays.  Math is the precision policy (see precision.h).
+	template <typename Math = ExactMath, typename Target>
+	FrameWork render(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+	{
+		bool full = !valid || width != cachedWidth || height != cachedHeight || scene.version != sceneVersion;
+
+		camera.prepare(width, height);
+		samples.swap(previous);
+		samples.resize(width * height);
+		values.resize(width * height);
+		depths.resize(width * height);
+		parity ^= 1;
+
+		vec3 forward = -camera.getOrientation()[2];
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			RayStats &tileStats = workerStats[worker].stats;
+
+			for (int j = rect.y0; j < rect.y1; j++)
+			{
+				for (int i = rect.x0; i < rect.x1; i++)
+				{
+					if (!full && ((i + j) & 1) != parity) continue;
+
+					int cell = j * width + i;
+					Sample &sample = samples[cell];
+					vec3 dir = camera.rayDirection(i, j);
+
+					tileStats.primaryRays++;
+					const Material *material;
+					sample.material = scene_intersect<Math>(camera.position, dir, scene, sample.point, sample.N, material)
+						? (int)(material - scene.materials.data()) : -1;
+
+					float val = 0;
+					if (sample.material >= 0) val = shade<Math>(sample.point, sample.N, &scene.materials[sample.material], dir, scene, tileStats);
+					values[cell] = val;
+					depths[cell] = sample.material >= 0 ? (sample.point - camera.position) * forward : FLT_MAX;
+
+					target.setPixel(i, j, getShadingChar(val));
+				}
+			}
+		});
+
+		if (!full)
+		{
+			reproject(width, height, camera);
+
+			pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+			{
+				TileRect rect = tileRect(tile, width, height);
+				RayStats &tileStats = workerStats[worker].stats;
+
+				for (int j = rect.y0; j < rect.y1; j++)
+				{
+					for (int i = rect.x0 + ((rect.x0 + j + parity + 1) & 1); i < rect.x1; i += 2)
+					{
+						int cell = j * width + i;
+						Sample &sample = samples[cell];
+
+						// the traced cells next to this one
+						int neighbours[4];
+						int count = 0;
+						if (i > 0) neighbours[count++] = cell - 1;
+						if (i + 1 < width) neighbours[count++] = cell + 1;
+						if (j > 0) neighbours[count++] = cell - width;
+						if (j + 1 < height) neighbours[count++] = cell + width;
+
+						bool hidden = landed[cell] >= 0;
+						for (int n = 0; n < count && hidden; n++)
+						{
+							hidden = depths[neighbours[n]] * (1 + checkerboardOcclusion) < depths[cell];
+						}
+
+						float val = 0;
+						if (landed[cell] >= 0 && !hidden)
+						{
+							sample = previous[landed[cell]];
+							vec3 dir = Math::normalize(sample.point - camera.position);
+							val = shade<Math>(sample.point, sample.N, &scene.materials[sample.material], dir, scene, tileStats);
+						}
+						else
+						{
+							sample.material = -2;
+							for (int n = 0; n < count; n++) val += values[neighbours[n]];
+							if (count > 0) val /= count;
+						}
+						values[cell] = val;
+
+						target.setPixel(i, j, getShadingChar(val));
+					}
+				}
+			});
+		}
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+
+		valid = true;
+		cachedWidth = width;
+		cachedHeight = height;
+		sceneVersion = scene.version;
+
+		return FrameWork::Traced;
+	}
+};
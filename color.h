@@ -0,0 +1,115 @@
+#pragma once
+#include "geometry.h"
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+
+// Colour output.  A cell's glyph carries its brightness as before; with colour on, the cell also
+// gets the hue of its shading (scaled up to full brightness so the glyph isn't darkened twice),
+// packed as 0xRRGGBB.  Terminals are sent either 24-bit colour or the nearest of the 240 fixed
+// colours of the 256-colour palette (the 6x6x6 cube and the grey ramp; the first 16 vary between
+// terminals and aren't used).
+
+enum class ColorMode
+{
+	Mono,			// one text colour, as the Windows console is set up
+	Palette256,
+	TrueColor
+};
+
+const char* colorModeName(ColorMode mode)
+{
+	switch (mode)
+	{
+	case ColorMode::Palette256: return "256";
+	case ColorMode::TrueColor: return "truecolor";
+	default: return "mono";
+	}
+}
+
+// Parses "mono", "256" or "truecolor"; returns false for anything else
+bool parseColorMode(const char *name, ColorMode &mode)
+{
+	std::string value(name);
+	if (value == "mono") mode = ColorMode::Mono;
+	else if (value == "256") mode = ColorMode::Palette256;
+	else if (value == "truecolor") mode = ColorMode::TrueColor;
+	else return false;
+	return true;
+}
+
+// Colour of cells that aren't shaded (text, and renderers without colour): the bright cyan the
+// console is set up with
+const uint32_t textColor = 0x55ffff;
+
+inline uint32_t packColor(int r, int g, int b) { return (uint32_t)(r << 16 | g << 8 | b); }
+inline int colorRed(uint32_t color) { return (int)(color >> 16 & 0xff); }
+inline int colorGreen(uint32_t color) { return (int)(color >> 8 & 0xff); }
+inline int colorBlue(uint32_t color) { return (int)(color & 0xff); }
+
+// The hue of a shaded colour at full brightness; textColor for black
+inline uint32_t cellColor(const vec3 &color)
+{
+	float brightest = std::max(color.x, std::max(color.y, color.z));
+	if (brightest <= 0) return textColor;
+
+	float scale = 255 / brightest;
+	return packColor((int)(std::max(color.x, 0.f) * scale + .5f), (int)(std::max(color.y, 0.f) * scale + .5f), (int)(std::max(color.z, 0.f) * scale + .5f));
+}
+
+// Nearest 256-colour palette entry of every colour at 5 bits per channel, built on first use
+class AnsiPalette
+{
+private:
+	uint8_t nearest[1 << 15];
+
+	static const int cubeLevels[6];
+
+	static int square(int x) { return x * x; }
+
+	// nearest cube level to a channel value; the cube is separable, so this per channel gives
+	// the nearest cube colour
+	static int cubeLevel(int value)
+	{
+		int best = 0;
+		for (int i = 1; i < 6; i++)
+		{
+			if (std::abs(cubeLevels[i] - value) < std::abs(cubeLevels[best] - value)) best = i;
+		}
+		return best;
+	}
+
+	AnsiPalette()
+	{
+		for (int key = 0; key < (1 << 15); key++)
+		{
+			// middle of the 8 channel values that share a key, 8k .. 8k + 7
+			int r = (key >> 10) * 8 + 4, g = (key >> 5 & 31) * 8 + 4, b = (key & 31) * 8 + 4;
+
+			int cr = cubeLevel(r), cg = cubeLevel(g), cb = cubeLevel(b);
+			int cubeDistance = square(cubeLevels[cr] - r) + square(cubeLevels[cg] - g) + square(cubeLevels[cb] - b);
+
+			// greys run 8, 18, ... 238; the nearest grey is the one nearest the mean
+			int grey = std::min(std::max(((r + g + b) / 3 - 8 + 5) / 10, 0), 23);
+			int level = 8 + grey * 10;
+			int greyDistance = square(level - r) + square(level - g) + square(level - b);
+
+			nearest[key] = (uint8_t)(greyDistance < cubeDistance ? 232 + grey : 16 + 36 * cr + 6 * cg + cb);
+		}
+	}
+
+public:
+	static const AnsiPalette& instance()
+	{
+		static const AnsiPalette palette;
+		return palette;
+	}
+
+	uint8_t index(uint32_t color) const
+	{
+		return nearest[(colorRed(color) >> 3) << 10 | (colorGreen(color) >> 3) << 5 | colorBlue(color) >> 3];
+	}
+};
+
+const int AnsiPalette::cubeLevels[6] = { 0, 95, 135, 175, 215, 255 };
@@ -0,0 +1,117 @@
+#pragma once
+#include "renderer.h"
+#include <vector>
+#include <cstdint>
+
+// Deferred shading: the primary hits of the last camera pose are kept per cell, so a frame where
+// only the lights changed runs just the shadow rays and the Phong terms, and a frame where
+// nothing changed isn't rendered at all.
+
+// How much of a frame GBuffer::render had to redo
+enum class FrameWork
+{
+	Skipped,	// nothing changed, the target still holds the frame
+	Shaded,		// lights changed; shaded from the cached hits
+	Traced		// camera, spheres or size changed; primary rays traced again
+};
+
+class GBuffer
+{
+private:
+	// what the primary ray through a cell hit; material is -1 when it hit nothing
+	struct Sample
+	{
+		vec3 point;
+		vec3 N;
+		int material;
+	};
+
+	std::vector<Sample> samples;
+
+	// what the samples and the target were rendered from
+	bool valid = false;
+	int cachedWidth = 0;
+	int cachedHeight = 0;
+	vec3 cameraPosition;
+	vec3 cameraRotation;
+	float cameraFov = 0;
+	uint64_t sceneVersion = 0;
+	std::vector<Light> lights;
+
+	bool sameCamera(int width, int height, const Camera &camera) const
+	{
+		return width == cachedWidth && height == cachedHeight && camera.position == cameraPosition
+			&& camera.rotation == cameraRotation && camera.fov == cameraFov;
+	}
+
+	bool sameLights(const Scene &scene) const
+	{
+		if (scene.lights.size() != lights.size()) return false;
+		for (size_t i = 0; i < lights.size(); i++)
+		{
+			if (scene.lights[i].position != lights[i].position || scene.lights[i].intensity != lights[i].intensity
+				|| scene.lights[i].range != lights[i].range) return false;
+		}
+		return true;
+	}
+
+public:
+	// Forget the cached frame, e.g. after something else drew over the target
+	void invalidate() { valid = false; }
+
+	// Same output as renderFrame, redoing only what changed since the last call.  The target
+	// has to be the same one every time since skipped frames leave it untouched.  Math is the
+	// precision policy (see precision.h).
+	template <typename Math = ExactMath, typename Target>
+	FrameWork render(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+	{
+		bool retrace = !valid || scene.version != sceneVersion || !sameCamera(width, height, camera);
+		if (!retrace && sameLights(scene)) return FrameWork::Skipped;
+
+		camera.prepare(width, height);
+		samples.resize(width * height);
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			RayStats &tileStats = workerStats[worker].stats;
+
+			for (int j = rect.y0; j < rect.y1; j++)
+			{
+				for (int i = rect.x0; i < rect.x1; i++)
+				{
+					Sample &sample = samples[j * width + i];
+					vec3 dir = camera.rayDirection(i, j);
+
+					if (retrace)
+					{
+						tileStats.primaryRays++;
+						const Material *material;
+						sample.material = scene_intersect<Math>(camera.position, dir, scene, sample.point, sample.N, material)
+							? (int)(material - scene.materials.data()) : -1;
+					}
+
+					// same as cast_ray from here on
+					float val = 0;
+					if (sample.material >= 0) val = shade<Math>(sample.point, sample.N, &scene.materials[sample.material], dir, scene, tileStats);
+
+					target.setPixel(i, j, getShadingChar(val));
+				}
+			}
+		});
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+
+		valid = true;
+		cachedWidth = width;
+		cachedHeight = height;
+		cameraPosition = camera.position;
+		cameraRotation = camera.rotation;
+		cameraFov = camera.fov;
+		sceneVersion = scene.version;
+		lights = scene.lights;
+
+		return retrace ? FrameWork::Traced : FrameWork::Shaded;
+	}
+};
@@ -2,8 +2,10 @@
 #define __GEOMETRY_H__
 #include <vector>
 #include <cmath>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include "simd.h"
 
 namespace lm
 {
@@ -33,9 +35,9 @@ typedef vec<4, float> vec4;
 typedef vec<4, int  > vec4i;
 
 template <typename T> struct vec<2, T> {
-	vec() : x(T()), y(T()) {}
-	vec(T S) : x(S), y(S) {}
-	vec(T X, T Y) : x(X), y(Y) {}
+	constexpr vec() : x(T()), y(T()) {}
+	constexpr vec(T S) : x(S), y(S) {}
+	constexpr vec(T X, T Y) : x(X), y(Y) {}
 	//template <class U> vec<2, T>(const vec<2, U> &v);
 	T& operator[](const size_t i) { assert(i < 2); return i <= 0 ? x : y; }
 	const T& operator[](const size_t i) const { assert(i < 2); return i <= 0 ? x : y; }
@@ -43,20 +45,20 @@ template <typename T> struct vec<2, T> {
 };
 
 template <typename T> struct vec<3, T> {
-	vec() : x(T()), y(T()), z(T()) {}
-	vec(T S) : x(S), y(S), z(S) {}
-	vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
+	constexpr vec() : x(T()), y(T()), z(T()) {}
+	constexpr vec(T S) : x(S), y(S), z(S) {}
+	constexpr vec(T X, T Y, T Z) : x(X), y(Y), z(Z) {}
 	T& operator[](const size_t i) { assert(i < 3); return i <= 0 ? x : (1 == i ? y : z); }
 	const T& operator[](const size_t i) const { assert(i < 3); return i <= 0 ? x : (1 == i ? y : z); }
-	float norm() { return std::sqrt(x*x + y * y + z * z); }
+	float norm() const { return std::sqrt(x*x + y * y + z * z); }
 	vec<3, T> & normalize(T l = 1) { *this = (*this)*(l / norm()); return *this; }
 	T x, y, z;
 };
 
 template <typename T> struct vec<4, T> {
-	vec() : x(T()), y(T()), z(T()), w(T()) {}
-	vec(T S) : x(S), y(S), z(S), w(S) {}
-	vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
+	constexpr vec() : x(T()), y(T()), z(T()), w(T()) {}
+	constexpr vec(T S) : x(S), y(S), z(S), w(S) {}
+	constexpr vec(T X, T Y, T Z, T W) : x(X), y(Y), z(Z), w(W) {}
 	T& operator[](const size_t i) { assert(i < 4); return i <= 0 ? x : (1 == i ? y : (2 == i ? z : w)); }
 	const T& operator[](const size_t i) const { assert(i < 4); return i <= 0 ? x : (1 == i ? y : (2 == i ? z : w)); }
 	T x, y, z, w;
@@ -90,6 +92,50 @@ template<size_t DIM, typename T> vec<DIM, T> operator-(const vec<DIM, T> &lhs) {
 	return lhs * T(-1);
 }
 
+// Straight-line versions of the above for 3 and 4 components, which is nearly every vector
+// in the program.  Terms are added in the same order as the loops, so the results are
+// bit-identical; they are also the scalar reference for the aligned vectors further down.
+
+template<typename T> constexpr T operator*(const vec<3, T> &lhs, const vec<3, T> &rhs) {
+	return T() + lhs.z * rhs.z + lhs.y * rhs.y + lhs.x * rhs.x;
+}
+
+template<typename T> constexpr T operator*(const vec<4, T> &lhs, const vec<4, T> &rhs) {
+	return T() + lhs.w * rhs.w + lhs.z * rhs.z + lhs.y * rhs.y + lhs.x * rhs.x;
+}
+
+template<typename T> constexpr vec<3, T> operator+(const vec<3, T> &lhs, const vec<3, T> &rhs) {
+	return vec<3, T>(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z);
+}
+
+template<typename T> constexpr vec<4, T> operator+(const vec<4, T> &lhs, const vec<4, T> &rhs) {
+	return vec<4, T>(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z, lhs.w + rhs.w);
+}
+
+template<typename T> constexpr vec<3, T> operator-(const vec<3, T> &lhs, const vec<3, T> &rhs) {
+	return vec<3, T>(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z);
+}
+
+template<typename T> constexpr vec<4, T> operator-(const vec<4, T> &lhs, const vec<4, T> &rhs) {
+	return vec<4, T>(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z, lhs.w - rhs.w);
+}
+
+template<typename T, typename U> constexpr vec<3, T> operator*(const vec<3, T> &lhs, const U &rhs) {
+	return vec<3, T>(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs);
+}
+
+template<typename T, typename U> constexpr vec<4, T> operator*(const vec<4, T> &lhs, const U &rhs) {
+	return vec<4, T>(lhs.x * rhs, lhs.y * rhs, lhs.z * rhs, lhs.w * rhs);
+}
+
+template<typename T> constexpr vec<3, T> operator-(const vec<3, T> &lhs) {
+	return vec<3, T>(-lhs.x, -lhs.y, -lhs.z);
+}
+
+template<typename T> constexpr vec<4, T> operator-(const vec<4, T> &lhs) {
+	return vec<4, T>(-lhs.x, -lhs.y, -lhs.z, -lhs.w);
+}
+
 // Comparison operators
 template<size_t DIM, typename T> bool operator==(const vec<DIM, T> &lhs, const vec<DIM, T> &rhs) {
 	for (size_t i = DIM; i--;)
@@ -149,19 +195,19 @@ template<size_t DIM, typename T> float dot(vec<DIM, T> lhs, vec<DIM, T> rhs)
 	return dotProduct;
 }
 
-template <typename T> vec<3, T> cross(vec<3, T> v1, vec<3, T> v2) {
+template <typename T> constexpr vec<3, T> cross(const vec<3, T> &v1, const vec<3, T> &v2) {
 	return vec<3, T>(v1.y*v2.z - v1.z*v2.y, v1.z*v2.x - v1.x*v2.z, v1.x*v2.y - v1.y*v2.x);
 }
 
 template<size_t DIM, typename T> vec<DIM, T> minimum(vec<DIM, T> lhs, vec<DIM, T> rhs) {
 	vec<DIM, T> ret;
-	for (size_t i = DIM; i--; ret[i] = min(lhs[i], rhs[i]));
+	for (size_t i = DIM; i--; ret[i] = std::min(lhs[i], rhs[i]));
 	return ret;
 }
 
 template<size_t DIM, typename T> vec<DIM, T> maximum(vec<DIM, T> lhs, vec<DIM, T> rhs) {
 	vec<DIM, T> ret;
-	for (size_t i = DIM; i--; ret[i] = max(lhs[i], rhs[i]));
+	for (size_t i = DIM; i--; ret[i] = std::max(lhs[i], rhs[i]));
 	return ret;
 }
 
@@ -169,6 +215,145 @@ vec3 reflect(const vec3 &I, const vec3 &N) {
 	return I - N * 2.f*(I*N);
 }
 
+// Snell's law; returns false on total internal reflection
+bool refract(const vec3 &I, const vec3 &N, const float eta_t, vec3 &out, const float eta_i = 1.f) {
+	float cosi = -std::max(-1.f, std::min(1.f, I*N));
+	// if the ray comes from inside the object, swap the media and flip the normal
+	if (cosi < 0) return refract(I, -N, eta_i, out, eta_t);
+	float eta = eta_i / eta_t;
+	float k = 1 - eta * eta*(1 - cosi * cosi);
+	if (k < 0) return false;
+	out = I * eta + N * (eta*cosi - sqrtf(k));
+	return true;
+}
+
+//
+// Aligned vectors
+//
+// vec3a and vec4a hold their components in one 16-byte register: SSE2 or NEON where the target
+// has it, four plain floats otherwise.  vec3a keeps w at 0.  Every operation gives exactly what
+// the same vec3/vec4 expression gives (dot products and lengths add the lanes in the same order),
+// so code can move between the two without changing a frame.  normalizeFast() is the exception:
+// it uses a reciprocal square root estimate refined by one Newton-Raphson step.
+
+#if WT_BASELINE_SSE2
+typedef __m128 float4;
+
+inline float4 f4make(float x, float y, float z, float w) { return _mm_set_ps(w, z, y, x); }
+inline float4 f4splat(float s) { return _mm_set1_ps(s); }
+inline float4 f4add(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 f4sub(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 f4mul(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 f4neg(float4 a) { return _mm_xor_ps(a, _mm_set1_ps(-0.f)); }
+// same as std::min(a, b) and std::max(a, b) lane by lane, including signed zeros and NaNs
+inline float4 f4min(float4 a, float4 b) { return _mm_min_ps(b, a); }
+inline float4 f4max(float4 a, float4 b) { return _mm_max_ps(b, a); }
+inline float4 f4rsqrt(float4 a) { return _mm_rsqrt_ps(a); }
+inline void f4store(float *out, float4 a) { _mm_store_ps(out, a); }
+// lanes (y, z, x, w), for cross products
+inline float4 f4yzxw(float4 a) { return _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1)); }
+#elif WT_BASELINE_NEON
+typedef float32x4_t float4;
+
+inline float4 f4make(float x, float y, float z, float w) { float lanes[4] = { x, y, z, w }; return vld1q_f32(lanes); }
+inline float4 f4splat(float s) { return vdupq_n_f32(s); }
+inline float4 f4add(float4 a, float4 b) { return vaddq_f32(a, b); }
+inline float4 f4sub(float4 a, float4 b) { return vsubq_f32(a, b); }
+inline float4 f4mul(float4 a, float4 b) { return vmulq_f32(a, b); }
+inline float4 f4neg(float4 a) { return vnegq_f32(a); }
+// vminq/vmaxq treat signed zeros and NaNs differently from std::min/max, so compare and select
+inline float4 f4min(float4 a, float4 b) { return vbslq_f32(vcltq_f32(b, a), b, a); }
+inline float4 f4max(float4 a, float4 b) { return vbslq_f32(vcltq_f32(a, b), b, a); }
+inline float4 f4rsqrt(float4 a) { return vrsqrteq_f32(a); }
+inline void f4store(float *out, float4 a) { vst1q_f32(out, a); }
+inline float4 f4yzxw(float4 a) { float32x4_t yzwx = vextq_f32(a, a, 1); return vsetq_lane_f32(vgetq_lane_f32(a, 3), vsetq_lane_f32(vgetq_lane_f32(a, 0), yzwx, 2), 3); }
+#else
+struct float4 { float lane[4]; };
+
+inline float4 f4make(float x, float y, float z, float w) { float4 r = { { x, y, z, w } }; return r; }
+inline float4 f4splat(float s) { return f4make(s, s, s, s); }
+inline float4 f4add(float4 a, float4 b) { return f4make(a.lane[0] + b.lane[0], a.lane[1] + b.lane[1], a.lane[2] + b.lane[2], a.lane[3] + b.lane[3]); }
+inline float4 f4sub(float4 a, float4 b) { return f4make(a.lane[0] - b.lane[0], a.lane[1] - b.lane[1], a.lane[2] - b.lane[2], a.lane[3] - b.lane[3]); }
+inline float4 f4mul(float4 a, float4 b) { return f4make(a.lane[0] * b.lane[0], a.lane[1] * b.lane[1], a.lane[2] * b.lane[2], a.lane[3] * b.lane[3]); }
+inline float4 f4neg(float4 a) { return f4make(-a.lane[0], -a.lane[1], -a.lane[2], -a.lane[3]); }
+inline float4 f4min(float4 a, float4 b) { return f4make(std::min(a.lane[0], b.lane[0]), std::min(a.lane[1], b.lane[1]), std::min(a.lane[2], b.lane[2]), std::min(a.lane[3], b.lane[3])); }
+inline float4 f4max(float4 a, float4 b) { return f4make(std::max(a.lane[0], b.lane[0]), std::max(a.lane[1], b.lane[1]), std::max(a.lane[2], b.lane[2]), std::max(a.lane[3], b.lane[3])); }
+inline float4 f4rsqrt(float4 a) { return f4make(1 / std::sqrt(a.lane[0]), 1 / std::sqrt(a.lane[1]), 1 / std::sqrt(a.lane[2]), 1 / std::sqrt(a.lane[3])); }
+inline void f4store(float *out, float4 a) { for (int i = 0; i < 4; i++) out[i] = a.lane[i]; }
+inline float4 f4yzxw(float4 a) { return f4make(a.lane[1], a.lane[2], a.lane[0], a.lane[3]); }
+#endif
+
+template <size_t DIM> struct alignas(16) veca {
+	static_assert(DIM == 3 || DIM == 4, "aligned vectors have 3 or 4 components");
+
+	float4 v;
+
+	veca() : v(f4splat(0)) {}
+	explicit veca(float4 V) : v(V) {}
+	veca(float X, float Y, float Z) : v(f4make(X, Y, Z, 0)) { static_assert(DIM == 3, "vec4a needs w"); }
+	veca(float X, float Y, float Z, float W) : v(f4make(X, Y, Z, W)) { static_assert(DIM == 4, "vec3a has no w"); }
+	explicit veca(const vec<3, float> &u) : v(f4make(u.x, u.y, u.z, 0)) { static_assert(DIM == 3, "vec4a needs w"); }
+	explicit veca(const vec<4, float> &u) : v(f4make(u.x, u.y, u.z, u.w)) { static_assert(DIM == 4, "vec3a has no w"); }
+
+	// components, in x, y, z, w order
+	void store(float *out) const { alignas(16) float lanes[4]; f4store(lanes, v); for (size_t i = 0; i < DIM; i++) out[i] = lanes[i]; }
+	float operator[](const size_t i) const { assert(i < DIM); alignas(16) float lanes[4]; f4store(lanes, v); return lanes[i]; }
+
+	vec<3, float> xyz() const { alignas(16) float lanes[4]; f4store(lanes, v); return vec<3, float>(lanes[0], lanes[1], lanes[2]); }
+	vec<4, float> xyzw() const { alignas(16) float lanes[4]; f4store(lanes, v); return vec<4, float>(lanes[0], lanes[1], lanes[2], lanes[3]); }
+
+	// same order of additions as vec3::norm()
+	float norm() const
+	{
+		alignas(16) float sq[4];
+		f4store(sq, f4mul(v, v));
+		return std::sqrt(DIM == 4 ? sq[0] + sq[1] + sq[2] + sq[3] : sq[0] + sq[1] + sq[2]);
+	}
+
+	veca<DIM>& normalize(float l = 1) { v = f4mul(v, f4splat(l / norm())); return *this; }
+
+	// about 22 bits of precision instead of 24
+	veca<DIM>& normalizeFast()
+	{
+		alignas(16) float sq[4];
+		f4store(sq, f4mul(v, v));
+		float4 d = f4splat(DIM == 4 ? sq[0] + sq[1] + sq[2] + sq[3] : sq[0] + sq[1] + sq[2]);
+		float4 r = f4rsqrt(d);
+		r = f4mul(r, f4sub(f4splat(1.5f), f4mul(f4mul(f4splat(.5f), d), f4mul(r, r))));
+		v = f4mul(v, r);
+		return *this;
+	}
+};
+
+typedef veca<3> vec3a;
+typedef veca<4> vec4a;
+
+// dot product
+template <size_t DIM> float operator*(const veca<DIM> &lhs, const veca<DIM> &rhs) {
+	alignas(16) float p[4];
+	f4store(p, f4mul(lhs.v, rhs.v));
+	return DIM == 4 ? 0.f + p[3] + p[2] + p[1] + p[0] : 0.f + p[2] + p[1] + p[0];
+}
+
+template <size_t DIM> veca<DIM> operator+(const veca<DIM> &lhs, const veca<DIM> &rhs) { return veca<DIM>(f4add(lhs.v, rhs.v)); }
+template <size_t DIM> veca<DIM> operator-(const veca<DIM> &lhs, const veca<DIM> &rhs) { return veca<DIM>(f4sub(lhs.v, rhs.v)); }
+template <size_t DIM> veca<DIM> operator*(const veca<DIM> &lhs, float rhs) { return veca<DIM>(f4mul(lhs.v, f4splat(rhs))); }
+template <size_t DIM> veca<DIM> operator-(const veca<DIM> &lhs) { return veca<DIM>(f4neg(lhs.v)); }
+
+template <size_t DIM> float dot(const veca<DIM> &lhs, const veca<DIM> &rhs) { return lhs * rhs; }
+template <size_t DIM> veca<DIM> minimum(const veca<DIM> &lhs, const veca<DIM> &rhs) { return veca<DIM>(f4min(lhs.v, rhs.v)); }
+template <size_t DIM> veca<DIM> maximum(const veca<DIM> &lhs, const veca<DIM> &rhs) { return veca<DIM>(f4max(lhs.v, rhs.v)); }
+
+inline vec3a cross(const vec3a &v1, const vec3a &v2) {
+	// (y1 z2, z1 x2, x1 y2) - (z1 y2, x1 z2, y1 x2), lane by lane as in cross() above
+	float4 a = f4yzxw(v1.v), b = f4yzxw(v2.v);
+	return vec3a(f4sub(f4mul(a, f4yzxw(b)), f4mul(f4yzxw(a), b)));
+}
+
+inline vec3a reflect(const vec3a &I, const vec3a &N) {
+	return I - N * 2.f*(I*N);
+}
+
 //
 // Matrices
 //
@@ -176,8 +361,7 @@ vec3 reflect(const vec3 &I, const vec3 &N) {
 template <size_t M, size_t N, typename T> struct mat {
 	mat()
 	{
-		for (size_t i = M; i--;)
-			for (size_t j = N; j--;) data_[i] = T();
+		for (size_t j = N; j--;) data_[j] = vec<M, T>();
 	}
 
 	vec<M, T>& operator[](const size_t i) { assert(i < N); return data_[i]; }
@@ -215,11 +399,11 @@ template <typename T> struct mat<2, 3, T> {
 };
 
 template <typename T> struct mat<3, 3, T> {
-	mat() : c0(T()), c1(T()), c2(T()) {}
-	mat(T S) : c0(S), c1(S), c2(S) {}
-	mat(vec<3, T> C0, vec<3, T> C1, vec<3, T> C2) : c0(C0), c1(C1), c2(C2) {}
+	constexpr mat() : c0(T()), c1(T()), c2(T()) {}
+	constexpr mat(T S) : c0(S), c1(S), c2(S) {}
+	constexpr mat(vec<3, T> C0, vec<3, T> C1, vec<3, T> C2) : c0(C0), c1(C1), c2(C2) {}
 	vec<3, T>& operator[](const size_t i) { assert(i < 3); return i <= 0 ? c0 : (1 == i ? c1 : c2); }
-	const vec<2, T>& operator[](const size_t i) const { assert(i < 3); return i <= 0 ? c0 : (1 == i ? c1 : c2); }
+	const vec<3, T>& operator[](const size_t i) const { assert(i < 3); return i <= 0 ? c0 : (1 == i ? c1 : c2); }
 	vec<3, T> c0, c1, c2;
 };
 
@@ -230,9 +414,71 @@ template <typename T> struct mat<4, 4, T> {
 	vec<4, T>& operator[](const size_t i) { assert(i < 4); return i <= 0 ? c0 : (1 == i ? c1 : (2 == i ? c2 : c3)); }
 	const vec<4, T>& operator[](const size_t i) const { assert(i < 4); return i <= 0 ? c0 : (1 == i ? c1 : (2 == i ? c2 : c3)); }
 
-	vec<3, T> c0, c1, c2, c3;
+	vec<4, T> c0, c1, c2, c3;
 };
 
+// Matrix operations (matrices are stored as columns: m[column][row])
+
+template <size_t M, size_t N, typename T> mat<M, N, T> identity() {
+	mat<M, N, T> ret;
+	for (size_t i = (M < N ? M : N); i--; ret[i][i] = T(1));
+	return ret;
+}
+
+template <size_t M, size_t N, typename T> vec<M, T> operator*(const mat<M, N, T> &lhs, const vec<N, T> &rhs) {
+	vec<M, T> ret;
+	for (size_t j = 0; j < N; j++)
+		for (size_t i = M; i--; ret[i] += lhs[j][i] * rhs[j]);
+	return ret;
+}
+
+// Straight-line 3x3 version, with the same order of additions as the loops
+template <typename T> constexpr vec<3, T> operator*(const mat<3, 3, T> &lhs, const vec<3, T> &rhs) {
+	return vec<3, T>(T() + lhs.c0.x * rhs.x + lhs.c1.x * rhs.y + lhs.c2.x * rhs.z,
+		T() + lhs.c0.y * rhs.x + lhs.c1.y * rhs.y + lhs.c2.y * rhs.z,
+		T() + lhs.c0.z * rhs.x + lhs.c1.z * rhs.y + lhs.c2.z * rhs.z);
+}
+
+template <size_t M, size_t N, size_t P, typename T> mat<M, P, T> operator*(const mat<M, N, T> &lhs, const mat<N, P, T> &rhs) {
+	mat<M, P, T> ret;
+	for (size_t j = P; j--; ret[j] = lhs * rhs[j]);
+	return ret;
+}
+
+template <size_t M, size_t N, typename T> mat<N, M, T> transpose(const mat<M, N, T> &m) {
+	mat<N, M, T> ret;
+	for (size_t j = N; j--;)
+		for (size_t i = M; i--; ret[i][j] = m[j][i]);
+	return ret;
+}
+
+// Rotation about the x axis (pitch), positive angles turn +y towards +z
+template <typename T> mat<3, 3, T> rotationX(T angle) {
+	T c = std::cos(angle), s = std::sin(angle);
+	return mat<3, 3, T>(vec<3, T>(1, 0, 0), vec<3, T>(0, c, s), vec<3, T>(0, -s, c));
+}
+
+// Rotation about the y axis (yaw), positive angles turn +z towards +x
+template <typename T> mat<3, 3, T> rotationY(T angle) {
+	T c = std::cos(angle), s = std::sin(angle);
+	return mat<3, 3, T>(vec<3, T>(c, 0, -s), vec<3, T>(0, 1, 0), vec<3, T>(s, 0, c));
+}
+
+// Rotation about the z axis (roll), positive angles turn +x towards +y
+template <typename T> mat<3, 3, T> rotationZ(T angle) {
+	T c = std::cos(angle), s = std::sin(angle);
+	return mat<3, 3, T>(vec<3, T>(c, s, 0), vec<3, T>(-s, c, 0), vec<3, T>(0, 0, 1));
+}
+
+// Affine transform from a rotation and a translation
+template <typename T> mat<4, 4, T> transform(const mat<3, 3, T> &rotation, const vec<3, T> &translation) {
+	mat<4, 4, T> ret = identity<4, 4, T>();
+	for (size_t j = 3; j--;)
+		for (size_t i = 3; i--; ret[j][i] = rotation[j][i]);
+	ret[3] = vec<4, T>(translation.x, translation.y, translation.z, 1);
+	return ret;
+}
+
 
 
 template <size_t M, size_t N, typename T> std::ostream& operator<<(std::ostream& out, const mat<M, N, T>& v) {
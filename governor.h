@@ -0,0 +1,106 @@
+#pragma once
+#include "renderer.h"
+#include <cmath>
+#include <algorithm>
+
+// Frame time governor: renders at a lower internal resolution when frames cost more than the
+// budget and fills the console grid from it.
+//
+// The cost of a cell is tracked as a moving average of measured frame time / cells rendered.
+// The scale drops as soon as a frame runs over budget, so a host that suddenly has less CPU to
+// spare is caught within a frame or two, but it only rises one step at a time after a run of
+// frames with room to spare, so the resolution doesn't oscillate around the budget.
+
+// Internal resolution is a multiple of this fraction of the console size (per axis)
+const float governorStep = 1.f / 16.f;
+const float governorMinScale = .25f;
+
+// Frames in a row that must have room to spare before the scale goes up a step
+const int governorCalmFrames = 8;
+
+class FrameGovernor
+{
+private:
+	double targetMs;
+	double msPerCell = 0;		// smoothed
+	float scale = 1;			// internal size / console size, per axis
+	int calmFrames = 0;
+
+	// Largest scale step whose cells are expected to fit in the budget at the given cost
+	float affordableScale(double costPerCell, int width, int height) const
+	{
+		double cells = targetMs / costPerCell;
+		float fit = (float)std::sqrt(cells / ((double)width * height));
+		fit = std::floor(fit / governorStep) * governorStep;
+		return std::min(1.f, std::max(governorMinScale, fit));
+	}
+
+public:
+	explicit FrameGovernor(double frameMs) : targetMs(frameMs) {}
+
+	float getScale() const { return scale; }
+	double getTargetMs() const { return targetMs; }
+
+	// Size to render the next frame at
+	void internalSize(int width, int height, int &internalWidth, int &internalHeight) const
+	{
+		internalWidth = std::max(1, (int)std::lround(width * scale));
+		internalHeight = std::max(1, (int)std::lround(height * scale));
+	}
+
+	// Feed back what a frame of cells internal cells cost (render and present, in ms)
+	void record(double frameMs, int cells, int width, int height)
+	{
+		double sample = frameMs / std::max(cells, 1);
+		msPerCell = msPerCell == 0 ? sample : msPerCell + (sample - msPerCell) * .2;
+
+		if (frameMs > targetMs)
+		{
+			// over budget: plan with the worse of the average and this frame and drop at once
+			calmFrames = 0;
+			scale = std::min(scale, affordableScale(std::max(msPerCell, sample), width, height));
+			return;
+		}
+
+		if (affordableScale(msPerCell, width, height) > scale)
+		{
+			if (++calmFrames >= governorCalmFrames)
+			{
+				scale = std::min(1.f, scale + governorStep);
+				calmFrames = 0;
+			}
+		}
+		else
+		{
+			calmFrames = 0;
+		}
+	}
+};
+
+// Nearest-neighbour fill of a width x height target from a smaller frame
+template <typename Target>
+void fillFrom(const FrameBuffer &source, Target &target, int width, int height)
+{
+	const wchar_t *cells = source.getBuffer();
+	int sourceWidth = source.getWidth(), sourceHeight = source.getHeight();
+
+	for (int j = 0; j < height; j++)
+	{
+		const wchar_t *row = cells + (j * sourceHeight / height) * sourceWidth;
+		for (int i = 0; i < width; i++)
+		{
+			target.setPixel(i, j, (char)row[i * sourceWidth / width]);
+		}
+	}
+
+	const uint32_t *colors = source.getColors();
+	if (!colors || !target.getColors()) return;
+	for (int j = 0; j < height; j++)
+	{
+		const uint32_t *row = colors + (j * sourceHeight / height) * sourceWidth;
+		for (int i = 0; i < width; i++)
+		{
+			target.setColor(i, j, row[i * sourceWidth / width]);
+		}
+	}
+}
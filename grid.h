@@ -0,0 +1,287 @@
+#pragma once
+#include "geometry.h"
+#include "spheres.h"
+#include "bvh.h"
+#include "profile.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+// Uniform grid over the spheres, for scenes where spheres move every frame.
+//
+// Each cell lists the spheres whose bounding box overlaps it.  Moving a sphere only touches the
+// cells of its old and new boxes, so updating the grid costs in proportion to the spheres that
+// moved rather than to the size of the scene.  The grid covers the scene as it was when built,
+// plus a margin; spheres that stray outside are kept on a list that every ray tests.
+//
+// Rays walk the cells they pass through front to back with a 3D-DDA (Amanatides and Woo) and
+// stop once the nearest hit found lies within the cell they are in.  Hits are tested with the
+// same arithmetic as the sphere kernels and ties go to the lowest slot, so the results are the
+// same as a linear search.
+
+// Cells per sphere the resolution aims for
+const float gridDensity = 2.f;
+const int gridMaxResolution = 128;		// per axis
+
+// Room left around the scene for spheres to move into, as a fraction of its extent per side
+const float gridMargin = .25f;
+
+class SphereGrid
+{
+private:
+	// cells a sphere is listed in, inclusive; none when x0 > x1, and x0 is -1 for spheres on the
+	// outside list
+	struct CellRange
+	{
+		int x0, y0, z0, x1, y1, z1;
+
+		bool operator==(const CellRange &other) const
+		{
+			return x0 == other.x0 && y0 == other.y0 && z0 == other.z0 && x1 == other.x1 && y1 == other.y1 && z1 == other.z1;
+		}
+	};
+
+	vec3 lo;
+	vec3 hi;
+	vec3 cellSize;
+	int resolution[3] = { 0, 0, 0 };
+
+	std::vector<std::vector<int> > cells;
+	std::vector<int> outside;				// slots of spheres not wholly inside the grid
+	std::vector<CellRange> ranges;			// per slot
+
+	int cellIndex(int x, int y, int z) const { return (z * resolution[1] + y) * resolution[0] + x; }
+
+	int cellCoordinate(float p, int axis) const
+	{
+		int c = (int)std::floor((p - lo[axis]) / cellSize[axis]);
+		return std::min(std::max(c, 0), resolution[axis] - 1);
+	}
+
+	CellRange rangeOf(const SphereSoA &spheres, int slot) const
+	{
+		CellRange range = { 1, 0, 0, 0, 0, 0 };
+		if (spheres.r2[slot] < 0) return range;		// padding
+
+		float radius = std::sqrt(spheres.r2[slot]);
+		vec3 center = spheres.center(slot);
+		vec3 boxLo = center - vec3(radius), boxHi = center + vec3(radius);
+		if (boxLo.x < lo.x || boxLo.y < lo.y || boxLo.z < lo.z || boxHi.x > hi.x || boxHi.y > hi.y || boxHi.z > hi.z)
+		{
+			range.x0 = -1;		// outside; x1 < x0 keeps it out of every cell
+			range.x1 = -2;
+			return range;
+		}
+
+		range.x0 = cellCoordinate(boxLo.x, 0);
+		range.y0 = cellCoordinate(boxLo.y, 1);
+		range.z0 = cellCoordinate(boxLo.z, 2);
+		range.x1 = cellCoordinate(boxHi.x, 0);
+		range.y1 = cellCoordinate(boxHi.y, 1);
+		range.z1 = cellCoordinate(boxHi.z, 2);
+		return range;
+	}
+
+	void insert(int slot, const CellRange &range)
+	{
+		ranges[slot] = range;
+		if (range.x0 < 0) outside.push_back(slot);
+		for (int z = range.z0; z <= range.z1; z++)
+			for (int y = range.y0; y <= range.y1; y++)
+				for (int x = range.x0; x <= range.x1; x++) cells[cellIndex(x, y, z)].push_back(slot);
+	}
+
+	static void removeFrom(std::vector<int> &list, int slot)
+	{
+		std::vector<int>::iterator found = std::find(list.begin(), list.end(), slot);
+		if (found == list.end()) return;
+		*found = list.back();
+		list.pop_back();
+	}
+
+	void remove(int slot)
+	{
+		const CellRange &range = ranges[slot];
+		if (range.x0 < 0) removeFrom(outside, slot);
+		for (int z = range.z0; z <= range.z1; z++)
+			for (int y = range.y0; y <= range.y1; y++)
+				for (int x = range.x0; x <= range.x1; x++) removeFrom(cells[cellIndex(x, y, z)], slot);
+	}
+
+	// Same arithmetic as closestSphereScalar for one sphere; false if the ray misses it
+	static bool hitDistance(const SphereSoA &spheres, int i, const vec3 &orig, const vec3 &dir, float &t)
+	{
+		float Lx = spheres.cx[i] - orig.x;
+		float Ly = spheres.cy[i] - orig.y;
+		float Lz = spheres.cz[i] - orig.z;
+		float tca = Lz * dir.z + Ly * dir.y + Lx * dir.x;
+		float d2 = (Lz * Lz + Ly * Ly + Lx * Lx) - tca * tca;
+		if (d2 > spheres.r2[i]) return false;
+		float thc = sqrtf(spheres.r2[i] - d2);
+		t = tca - thc;
+		if (t < 0) t = tca + thc;
+		return t >= 0;
+	}
+
+	// Nearest hit in a list, lowest slot on ties
+	static void closestIn(const std::vector<int> &list, const SphereSoA &spheres, const vec3 &orig, const vec3 &dir, float &tNearest, int &nearest)
+	{
+		WT_PROFILE_COUNT(SphereTests, list.size());
+		for (size_t k = 0; k < list.size(); k++)
+		{
+			int slot = list[k];
+			float t;
+			if (!hitDistance(spheres, slot, orig, dir, t)) continue;
+			if (t < tNearest || (t == tNearest && nearest >= 0 && slot < nearest))
+			{
+				tNearest = t;
+				nearest = slot;
+			}
+		}
+	}
+
+	static bool anyIn(const std::vector<int> &list, const SphereSoA &spheres, const vec3 &orig, const vec3 &dir, float tMax)
+	{
+		WT_PROFILE_COUNT(SphereTests, list.size());
+		for (size_t k = 0; k < list.size(); k++)
+		{
+			float t;
+			if (hitDistance(spheres, list[k], orig, dir, t) && t < tMax) return true;
+		}
+		return false;
+	}
+
+	// Walks the cells the ray passes through before tMax, front to back, calling visit(cell)
+	// with each; visit returns the distance after which nothing more needs looking at
+	template <typename VisitFn>
+	void walk(const vec3 &orig, const vec3 &dir, float tMax, VisitFn visit) const
+	{
+		// clip the ray to the grid
+		float tEnter = 0, tExit = tMax;
+		for (int a = 0; a < 3; a++)
+		{
+			if (dir[a] == 0)
+			{
+				if (orig[a] < lo[a] || orig[a] > hi[a]) return;
+				continue;
+			}
+			float t0 = (lo[a] - orig[a]) / dir[a], t1 = (hi[a] - orig[a]) / dir[a];
+			tEnter = std::max(tEnter, std::min(t0, t1));
+			tExit = std::min(tExit, std::max(t0, t1));
+		}
+		if (tEnter > tExit) return;
+
+		vec3 start = orig + dir * tEnter;
+		int cell[3], step[3];
+		float tNext[3], tDelta[3];
+		for (int a = 0; a < 3; a++)
+		{
+			cell[a] = cellCoordinate(start[a], a);
+			if (dir[a] > 0)
+			{
+				step[a] = 1;
+				tNext[a] = (lo[a] + (cell[a] + 1) * cellSize[a] - orig[a]) / dir[a];
+				tDelta[a] = cellSize[a] / dir[a];
+			}
+			else if (dir[a] < 0)
+			{
+				step[a] = -1;
+				tNext[a] = (lo[a] + cell[a] * cellSize[a] - orig[a]) / dir[a];
+				tDelta[a] = -cellSize[a] / dir[a];
+			}
+			else
+			{
+				step[a] = 0;
+				tNext[a] = FLT_MAX;
+				tDelta[a] = FLT_MAX;
+			}
+		}
+
+		for (;;)
+		{
+			float done = visit(cells[cellIndex(cell[0], cell[1], cell[2])]);
+
+			int a = tNext[0] < tNext[1] ? (tNext[0] < tNext[2] ? 0 : 2) : (tNext[1] < tNext[2] ? 1 : 2);
+			if (done <= tNext[a] || tNext[a] > tExit) return;
+
+			cell[a] += step[a];
+			if (cell[a] < 0 || cell[a] >= resolution[a]) return;
+			tNext[a] += tDelta[a];
+		}
+	}
+
+public:
+	bool empty() const { return cells.empty(); }
+
+	// Lists every slot of spheres (padding is skipped)
+	void build(const SphereSoA &spheres)
+	{
+		AABB bounds;
+		size_t count = 0;
+		for (size_t i = 0; i < spheres.paddedCount(); i++)
+		{
+			if (spheres.r2[i] < 0) continue;
+			vec3 extent(std::sqrt(spheres.r2[i]));
+			bounds.grow(AABB(spheres.center(i) - extent, spheres.center(i) + extent));
+			count++;
+		}
+		if (bounds.empty()) bounds = AABB(vec3(-1), vec3(1));
+
+		vec3 extent = bounds.hi - bounds.lo;
+		float largest = std::max(extent.x, std::max(extent.y, extent.z));
+		for (int a = 0; a < 3; a++) extent[a] = std::max(extent[a], largest * .01f) * (1 + 2 * gridMargin);
+		lo = bounds.centroid() - extent * .5f;
+		hi = bounds.centroid() + extent * .5f;
+
+		// cubic cells, gridDensity of them per sphere
+		float cellEdge = std::cbrt(extent.x * extent.y * extent.z / (gridDensity * std::max(count, (size_t)1)));
+		for (int a = 0; a < 3; a++)
+		{
+			resolution[a] = std::min(std::max((int)std::ceil(extent[a] / cellEdge), 1), gridMaxResolution);
+			cellSize[a] = extent[a] / resolution[a];
+		}
+
+		cells.assign((size_t)resolution[0] * resolution[1] * resolution[2], std::vector<int>());
+		outside.clear();
+		ranges.assign(spheres.paddedCount(), CellRange());
+		for (size_t i = 0; i < spheres.paddedCount(); i++) insert((int)i, rangeOf(spheres, (int)i));
+	}
+
+	// Update a sphere's cells after it moved (or changed size) in spheres
+	void move(const SphereSoA &spheres, int slot)
+	{
+		CellRange range = rangeOf(spheres, slot);
+		if (range == ranges[slot]) return;
+		remove(slot);
+		insert(slot, range);
+	}
+
+	// Like sphereKernels.closest over every sphere: the nearest hit closer than tNearest, whose
+	// slot is returned (with tNearest updated), or -1
+	int closest(const SphereSoA &spheres, const vec3 &orig, const vec3 &dir, float &tNearest) const
+	{
+		int nearest = -1;
+		closestIn(outside, spheres, orig, dir, tNearest, nearest);
+		walk(orig, dir, tNearest, [&](const std::vector<int> &cell)
+		{
+			closestIn(cell, spheres, orig, dir, tNearest, nearest);
+			return tNearest;
+		});
+		return nearest;
+	}
+
+	// Like sphereKernels.any over every sphere: is anything hit nearer than tMax?
+	bool any(const SphereSoA &spheres, const vec3 &orig, const vec3 &dir, float tMax) const
+	{
+		if (anyIn(outside, spheres, orig, dir, tMax)) return true;
+
+		bool occluded = false;
+		walk(orig, dir, tMax, [&](const std::vector<int> &cell)
+		{
+			occluded = anyIn(cell, spheres, orig, dir, tMax);
+			return occluded ? -FLT_MAX : FLT_MAX;
+		});
+		return occluded;
+	}
+};
@@ -0,0 +1,194 @@
+#pragma once
+#include "geometry.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#endif
+
+// Input sampled for one frame
+struct InputState
+{
+	vec2 mouseOffset;		// cursor offset from where it was at startup (pixels)
+	vec3 movement;			// camera movement direction
+	vec3 lightMovement;		// light movement direction
+	bool quit = false;
+};
+
+#ifdef _WIN32
+
+// Mouse look, WASD camera movement, arrow keys move the light and escape quits
+class Input
+{
+private:
+	POINT initialPos;
+
+public:
+	Input()
+	{
+		// Get initial mouse position to calculate offset
+		GetCursorPos(&initialPos);
+	}
+
+	InputState poll()
+	{
+		InputState state;
+
+		// Get mouse offset amount
+		POINT currentPos;
+		GetCursorPos(&currentPos);
+		state.mouseOffset = vec2(currentPos.x - initialPos.x, currentPos.y - initialPos.y);
+
+		// Handle camera movement
+		if (GetAsyncKeyState((unsigned short)'A') & 0x8000)
+			state.movement.x -= 1;
+		if (GetAsyncKeyState((unsigned short)'D') & 0x8000)
+			state.movement.x += 1;
+		if (GetAsyncKeyState((unsigned short)'W') & 0x8000)
+			state.movement.z -= 1;
+		if (GetAsyncKeyState((unsigned short)'S') & 0x8000)
+			state.movement.z += 1;
+
+		// Handle light movement
+		if (GetAsyncKeyState(VK_LEFT) & 0x8000)
+			state.lightMovement.x -= 1;
+		if (GetAsyncKeyState(VK_RIGHT) & 0x8000)
+			state.lightMovement.x += 1;
+		if (GetAsyncKeyState(VK_UP) & 0x8000)
+			state.lightMovement.y -= 1;
+		if (GetAsyncKeyState(VK_DOWN) & 0x8000)
+			state.lightMovement.y += 1;
+
+		// Handle application exit
+		if (GetAsyncKeyState(VK_ESCAPE) & 0x8000)
+			state.quit = true;
+
+		return state;
+	}
+};
+
+#else
+
+// Terminals only deliver key presses (and auto-repeats), never key releases, so a key counts
+// as held for a short while after each press.  There is no mouse: IJKL turn the camera by
+// moving a virtual cursor instead.  Escape or q quits.
+class Input
+{
+private:
+	typedef std::chrono::steady_clock clock;
+
+	enum Key { KeyW, KeyA, KeyS, KeyD, KeyLeft, KeyRight, KeyUp, KeyDown, KeyCount };
+
+	// long enough to bridge the gap between auto-repeated presses
+	const std::chrono::milliseconds holdTime = std::chrono::milliseconds(120);
+	const float lookStep = 8.f;
+
+	termios originalMode;
+	bool restoreMode = false;
+	int originalFlags = 0;
+
+	clock::time_point lastPressed[KeyCount];
+	vec2 virtualCursor;
+
+	bool held(Key key, clock::time_point now) const { return now - lastPressed[key] < holdTime; }
+
+public:
+	Input()
+	{
+		for (int i = 0; i < KeyCount; i++) lastPressed[i] = clock::time_point();
+
+		// unbuffered, silent, non-blocking reads from the terminal
+		if (tcgetattr(STDIN_FILENO, &originalMode) == 0)
+		{
+			termios raw = originalMode;
+			raw.c_lflag &= ~(ICANON | ECHO);
+			raw.c_cc[VMIN] = 0;
+			raw.c_cc[VTIME] = 0;
+			tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+			restoreMode = true;
+		}
+		originalFlags = fcntl(STDIN_FILENO, F_GETFL);
+		fcntl(STDIN_FILENO, F_SETFL, originalFlags | O_NONBLOCK);
+	}
+
+	~Input()
+	{
+		fcntl(STDIN_FILENO, F_SETFL, originalFlags);
+		if (restoreMode) tcsetattr(STDIN_FILENO, TCSANOW, &originalMode);
+	}
+
+	InputState poll()
+	{
+		InputState state;
+		clock::time_point now = clock::now();
+
+		char buffer[64];
+		ssize_t count;
+		while ((count = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
+		{
+			for (ssize_t i = 0; i < count; i++)
+			{
+				char c = buffer[i];
+
+				// arrow keys arrive as ESC [ A..D, a lone escape quits
+				if (c == 27)
+				{
+					if (i + 2 < count && buffer[i + 1] == '[')
+					{
+						switch (buffer[i + 2])
+						{
+						case 'A': lastPressed[KeyUp] = now; break;
+						case 'B': lastPressed[KeyDown] = now; break;
+						case 'C': lastPressed[KeyRight] = now; break;
+						case 'D': lastPressed[KeyLeft] = now; break;
+						}
+						i += 2;
+					}
+					else
+					{
+						state.quit = true;
+					}
+					continue;
+				}
+
+				switch (c)
+				{
+				case 'w': case 'W': lastPressed[KeyW] = now; break;
+				case 'a': case 'A': lastPressed[KeyA] = now; break;
+				case 's': case 'S': lastPressed[KeyS] = now; break;
+				case 'd': case 'D': lastPressed[KeyD] = now; break;
+				case 'i': case 'I': virtualCursor.y -= lookStep; break;
+				case 'k': case 'K': virtualCursor.y += lookStep; break;
+				case 'j': case 'J': virtualCursor.x -= lookStep; break;
+				case 'l': case 'L': virtualCursor.x += lookStep; break;
+				case 'q': case 'Q': state.quit = true; break;
+				}
+			}
+		}
+
+		state.mouseOffset = virtualCursor;
+
+		// Handle camera movement
+		if (held(KeyA, now)) state.movement.x -= 1;
+		if (held(KeyD, now)) state.movement.x += 1;
+		if (held(KeyW, now)) state.movement.z -= 1;
+		if (held(KeyS, now)) state.movement.z += 1;
+
+		// Handle light movement
+		if (held(KeyLeft, now)) state.lightMovement.x -= 1;
+		if (held(KeyRight, now)) state.lightMovement.x += 1;
+		if (held(KeyUp, now)) state.lightMovement.y -= 1;
+		if (held(KeyDown, now)) state.lightMovement.y += 1;
+
+		return state;
+	}
+};
+
+#endif
@@ -0,0 +1,215 @@
+#pragma once
+#include "geometry.h"
+#include "raytracing.h"
+#include "bvh.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+
+// Light culling and sampling for scenes with many lights.
+//
+// A light with a finite range fades out smoothly and is gone at that distance (lightFalloff),
+// so it can't change the glyph of any point outside its range.  LightTree is a bounding volume
+// hierarchy over the spheres the lights reach: lightsAt() finds the lights that reach a point by
+// visiting only the nodes whose box holds it, and sample() picks a light at random in proportion
+// to its power by walking down the tree, so a fixed number of samples costs the same however
+// many lights there are.  Lights without a range reach everywhere and are in every query.
+
+// Fraction of a light's intensity left at distance: 1 at the light, falling smoothly to 0 at
+// range; always 1 for lights without a range
+inline float lightFalloff(float distance, float range)
+{
+	if (range == FLT_MAX) return 1;
+	float x = distance / range;
+	x = 1 - x * x;
+	return x > 0 ? x * x : 0;
+}
+
+// Lights at most in a leaf of the tree
+const int lightLeafSize = 4;
+
+class LightTree
+{
+private:
+	// leaves hold order[first, first + count); interior nodes have count 0 and their children
+	// at first and first + 1
+	struct Node
+	{
+		AABB box;			// everywhere the node's lights reach
+		float power;		// summed intensity
+		int first;
+		int count;
+	};
+
+	std::vector<Node> nodes;
+	std::vector<int> order;			// light indices in leaf order
+	bool ranged = false;
+
+	static AABB reach(const Light &light)
+	{
+		if (light.range == FLT_MAX) return AABB(vec3(-FLT_MAX), vec3(FLT_MAX));
+		vec3 extent(light.range);
+		return AABB(light.position - extent, light.position + extent);
+	}
+
+	static bool contains(const AABB &box, const vec3 &p)
+	{
+		return p.x >= box.lo.x && p.y >= box.lo.y && p.z >= box.lo.z && p.x <= box.hi.x && p.y <= box.hi.y && p.z <= box.hi.z;
+	}
+
+	static bool reaches(const Light &light, const vec3 &p)
+	{
+		if (light.range == FLT_MAX) return true;
+		vec3 d = light.position - p;
+		return d * d < light.range * light.range;
+	}
+
+	// median split on the longest axis of the light positions
+	void buildNode(int nodeIndex, int begin, int end, const std::vector<Light> &lights)
+	{
+		AABB box, centers;
+		float power = 0;
+		for (int i = begin; i < end; i++)
+		{
+			box.grow(reach(lights[order[i]]));
+			centers.grow(lights[order[i]].position);
+			power += lights[order[i]].intensity;
+		}
+		nodes[nodeIndex].box = box;
+		nodes[nodeIndex].power = power;
+
+		if (end - begin <= lightLeafSize)
+		{
+			nodes[nodeIndex].first = begin;
+			nodes[nodeIndex].count = end - begin;
+			return;
+		}
+
+		vec3 size = centers.hi - centers.lo;
+		int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+		int middle = (begin + end) / 2;
+		std::nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&](int a, int b)
+		{
+			return lights[a].position[axis] < lights[b].position[axis];
+		});
+
+		int children = (int)nodes.size();
+		nodes[nodeIndex].first = children;
+		nodes[nodeIndex].count = 0;
+		nodes.resize(nodes.size() + 2);
+		buildNode(children, begin, middle, lights);
+		buildNode(children + 1, middle, end, lights);
+	}
+
+public:
+	void build(const std::vector<Light> &lights)
+	{
+		nodes.clear();
+		order.clear();
+		ranged = false;
+		for (size_t i = 0; i < lights.size(); i++)
+		{
+			order.push_back((int)i);
+			if (lights[i].range != FLT_MAX) ranged = true;
+		}
+		if (lights.empty()) return;
+
+		nodes.reserve(2 * lights.size() / lightLeafSize + 1);
+		nodes.resize(1);
+		buildNode(0, 0, (int)lights.size(), lights);
+	}
+
+	// Does any light have a range?  Without one there is nothing to cull.
+	bool hasRanges() const { return ranged; }
+
+	// The lights that reach p, in index order, into found
+	void lightsAt(const std::vector<Light> &lights, const vec3 &p, std::vector<int> &found) const
+	{
+		found.clear();
+		if (nodes.empty()) return;
+
+		int stack[64];
+		int depth = 0;
+		stack[depth++] = 0;
+		while (depth > 0)
+		{
+			const Node &node = nodes[stack[--depth]];
+			if (!contains(node.box, p)) continue;
+
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+				{
+					if (reaches(lights[order[i]], p)) found.push_back(order[i]);
+				}
+			}
+			else
+			{
+				stack[depth++] = node.first;
+				stack[depth++] = node.first + 1;
+			}
+		}
+		std::sort(found.begin(), found.end());
+	}
+
+	// False if no light can reach p, so sample() would never pick one
+	bool covers(const vec3 &p) const
+	{
+		return !nodes.empty() && contains(nodes[0].box, p);
+	}
+
+	// Picks a light that may reach p with probability in proportion to its intensity, using u
+	// in [0, 1).  Returns the light's index and its probability, or -1 if no light reaches p.
+	int sample(const std::vector<Light> &lights, const vec3 &p, float u, float &probability) const
+	{
+		probability = 1;
+		if (nodes.empty()) return -1;
+
+		const Node *node = &nodes[0];
+		if (!contains(node->box, p)) return -1;
+		while (node->count == 0)
+		{
+			const Node &left = nodes[node->first], &right = nodes[node->first + 1];
+			float leftWeight = contains(left.box, p) ? left.power : 0;
+			float rightWeight = contains(right.box, p) ? right.power : 0;
+			float total = leftWeight + rightWeight;
+			if (total <= 0) return -1;
+
+			// reuse what is left of u on the way down
+			float leftShare = leftWeight / total;
+			if (u < leftShare)
+			{
+				node = &left;
+				probability *= leftShare;
+				u = u / leftShare;
+			}
+			else
+			{
+				node = &right;
+				probability *= 1 - leftShare;
+				u = std::min((u - leftShare) / (1 - leftShare), .99999994f);
+			}
+		}
+
+		float total = 0;
+		for (int i = node->first; i < node->first + node->count; i++)
+		{
+			if (reaches(lights[order[i]], p)) total += lights[order[i]].intensity;
+		}
+		if (total <= 0) return -1;
+
+		float target = u * total;
+		int chosen = -1;
+		for (int i = node->first; i < node->first + node->count; i++)
+		{
+			const Light &light = lights[order[i]];
+			if (!reaches(light, p)) continue;
+			chosen = order[i];
+			if (target < light.intensity) break;
+			target -= light.intensity;
+		}
+		probability *= lights[chosen].intensity / total;
+		return chosen;
+	}
+};
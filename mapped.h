@@ -0,0 +1,190 @@
+#pragma once
+#include "simd.h"
+#include <vector>
+#include <string>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file; the mapping lives as long as the object
+class MappedFile
+{
+private:
+	const uint8_t *bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+public:
+	MappedFile() {}
+	~MappedFile() { close(); }
+
+	// Returns false (with a message) if the file can't be opened or mapped
+	bool open(const std::string &path, std::string &error)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		LARGE_INTEGER size;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+		{
+			error = "can't open " + path;
+			close();
+			return false;
+		}
+		length = (size_t)size.QuadPart;
+		if (length > 0)
+		{
+			mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			bytes = mapping ? (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		}
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd < 0 || fstat(fd, &info) != 0)
+		{
+			if (fd >= 0) ::close(fd);
+			error = "can't open " + path;
+			return false;
+		}
+		length = (size_t)info.st_size;
+		if (length > 0)
+		{
+			void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			bytes = p == MAP_FAILED ? nullptr : (const uint8_t*)p;
+		}
+		::close(fd);		// the mapping keeps the file alive
+#endif
+		if (length > 0 && !bytes)
+		{
+			error = "can't map " + path;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (bytes) UnmapViewOfFile(bytes);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (bytes) munmap((void*)bytes, length);
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+
+	const uint8_t* data() const { return bytes; }
+	size_t size() const { return length; }
+};
+
+// Array that either owns its (SIMD aligned) elements or views elements it doesn't own, such
+// as a section of a mapped scene file.  Views are read in place; the first change to a view
+// copies it into owned storage.
+template <typename T>
+class MappedArray
+{
+private:
+	std::vector<T, AlignedAllocator<T> > owned;
+	const T *items = nullptr;
+	size_t count = 0;
+	bool viewing = false;
+
+	void rebind()
+	{
+		items = owned.data();
+		count = owned.size();
+	}
+
+	void detach()
+	{
+		if (!viewing) return;
+		owned.assign(items, items + count);
+		viewing = false;
+		rebind();
+	}
+
+public:
+	MappedArray() {}
+	MappedArray(const MappedArray &other) { *this = other; }
+	MappedArray(MappedArray &&other) { *this = std::move(other); }
+
+	MappedArray& operator=(const MappedArray &other)
+	{
+		if (this == &other) return *this;
+		viewing = other.viewing;
+		if (viewing)
+		{
+			owned.clear();
+			items = other.items;
+			count = other.count;
+		}
+		else
+		{
+			owned = other.owned;
+			rebind();
+		}
+		return *this;
+	}
+
+	MappedArray& operator=(MappedArray &&other)
+	{
+		if (this == &other) return *this;
+		viewing = other.viewing;
+		owned = std::move(other.owned);
+		items = viewing ? other.items : owned.data();
+		count = other.count;
+		other.owned.clear();
+		other.viewing = false;
+		other.rebind();
+		return *this;
+	}
+
+	// Point at n elements owned by someone else, who has to keep them alive
+	void view(const T *data, size_t n)
+	{
+		owned.clear();
+		owned.shrink_to_fit();
+		items = data;
+		count = n;
+		viewing = true;
+	}
+
+	bool isView() const { return viewing; }
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const T* data() const { return items; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+
+	const T& operator[](size_t i) const { assert(i < count); return items[i]; }
+	T& operator[](size_t i) { detach(); assert(i < count); return owned[i]; }
+
+	void assign(size_t n, const T &value) { viewing = false; owned.assign(n, value); rebind(); }
+	void push_back(const T &value) { detach(); owned.push_back(value); rebind(); }
+	void reserve(size_t n) { detach(); owned.reserve(n); rebind(); }
+	void resize(size_t n) { if (n == count) return; detach(); owned.resize(n); rebind(); }
+	void clear() { viewing = false; owned.clear(); rebind(); }
+};
@@ -0,0 +1,540 @@
+#pragma once
+#include "geometry.h"
+#include "raytracing.h"
+#include "simd.h"
+#include "bvh.h"
+#include "spheres.h"
+#include "profile.h"
+#include <vector>
+#include <map>
+#include <string>
+#include <istream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <utility>
+
+// Triangle meshes: Wavefront OBJ loading, a watertight ray/triangle test that runs on blocks of
+// 4 triangles, and a BVH per mesh.
+
+// Indexed triangle mesh; normals is either empty (flat shading) or has one entry per position
+struct Mesh
+{
+	std::vector<vec3> positions;
+	std::vector<vec3> normals;
+	std::vector<int> indices;		// 3 per triangle
+	Material material;
+
+	size_t triangleCount() const { return indices.size() / 3; }
+};
+
+// Parses one face corner ("v", "v/vt", "v//vn" or "v/vt/vn"); OBJ indices start at 1 and
+// negative ones count back from the latest element
+inline bool parseObjCorner(const std::string &token, int positionCount, int normalCount, int &position, int &normal)
+{
+	const char *p = token.c_str();
+	char *end;
+
+	long v = std::strtol(p, &end, 10);
+	if (end == p) return false;
+	position = v < 0 ? positionCount + (int)v : (int)v - 1;
+	normal = -1;
+
+	if (*end == '/')
+	{
+		p = end + 1;
+		std::strtol(p, &end, 10);		// texture coordinates aren't used
+		if (*end == '/')
+		{
+			p = end + 1;
+			long n = std::strtol(p, &end, 10);
+			if (end == p) return false;
+			normal = n < 0 ? normalCount + (int)n : (int)n - 1;
+			if (normal < 0 || normal >= normalCount) return false;
+		}
+	}
+
+	return position >= 0 && position < positionCount;
+}
+
+// Reads the vertices and faces of a Wavefront OBJ file into mesh, splitting polygons into
+// triangle fans.  Corners that share a position and normal share a vertex.  Texture
+// coordinates, groups and materials are skipped.  Returns false with a message on bad input.
+bool loadObj(std::istream &in, Mesh &mesh, std::string &error)
+{
+	std::vector<vec3> filePositions;
+	std::vector<vec3> fileNormals;
+	std::map<std::pair<int, int>, int> vertexIndex;
+	bool everyCornerHasNormal = true;
+
+	mesh.positions.clear();
+	mesh.normals.clear();
+	mesh.indices.clear();
+
+	std::string line;
+	std::vector<int> face;
+	for (int lineNumber = 1; std::getline(in, line); lineNumber++)
+	{
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword) || keyword[0] == '#') continue;
+
+		if (keyword == "v" || keyword == "vn")
+		{
+			vec3 value;
+			if (!(fields >> value.x >> value.y >> value.z))
+			{
+				error = "line " + std::to_string(lineNumber) + ": expected three coordinates";
+				return false;
+			}
+			(keyword == "v" ? filePositions : fileNormals).push_back(value);
+		}
+		else if (keyword == "f")
+		{
+			face.clear();
+			std::string token;
+			while (fields >> token)
+			{
+				int position, normal;
+				if (!parseObjCorner(token, (int)filePositions.size(), (int)fileNormals.size(), position, normal))
+				{
+					error = "line " + std::to_string(lineNumber) + ": bad face corner '" + token + "'";
+					return false;
+				}
+				if (normal < 0) everyCornerHasNormal = false;
+
+				std::pair<int, int> key(position, normal);
+				std::map<std::pair<int, int>, int>::iterator found = vertexIndex.find(key);
+				if (found == vertexIndex.end())
+				{
+					found = vertexIndex.insert(std::make_pair(key, (int)mesh.positions.size())).first;
+					mesh.positions.push_back(filePositions[position]);
+					mesh.normals.push_back(normal >= 0 ? fileNormals[normal] : vec3());
+				}
+				face.push_back(found->second);
+			}
+
+			if (face.size() < 3)
+			{
+				error = "line " + std::to_string(lineNumber) + ": face with fewer than three corners";
+				return false;
+			}
+			for (size_t i = 2; i < face.size(); i++)
+			{
+				mesh.indices.push_back(face[0]);
+				mesh.indices.push_back(face[i - 1]);
+				mesh.indices.push_back(face[i]);
+			}
+		}
+	}
+
+	// smooth shading needs a normal at every corner
+	if (!everyCornerHasNormal) mesh.normals.clear();
+	return true;
+}
+
+bool loadObj(const std::string &path, Mesh &mesh, std::string &error)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+	{
+		error = "can't open " + path;
+		return false;
+	}
+	if (!loadObj(file, mesh, error))
+	{
+		error = path + ": " + error;
+		return false;
+	}
+	return true;
+}
+
+// Scale and move the mesh so its bounding box is centered on center with the longest side size
+void fitMesh(Mesh &mesh, const vec3 &center, float size)
+{
+	AABB box;
+	for (size_t i = 0; i < mesh.positions.size(); i++) box.grow(mesh.positions[i]);
+	if (box.empty()) return;
+
+	vec3 extent = box.hi - box.lo;
+	float longest = std::max(extent.x, std::max(extent.y, extent.z));
+	float scale = longest > 0 ? size / longest : 1.f;
+	vec3 middle = box.centroid();
+	for (size_t i = 0; i < mesh.positions.size(); i++) mesh.positions[i] = center + (mesh.positions[i] - middle) * scale;
+}
+
+// Torus around the y axis, for meshes of any size without shipping model files
+Mesh makeTorusMesh(int rings, int sides, float radius, float tube, const Material &material)
+{
+	const float twoPi = 6.2831853f;
+
+	Mesh mesh;
+	mesh.material = material;
+	for (int r = 0; r < rings; r++)
+	{
+		float u = twoPi * r / rings;
+		for (int s = 0; s < sides; s++)
+		{
+			float v = twoPi * s / sides;
+			vec3 normal(cosf(v) * cosf(u), sinf(v), cosf(v) * sinf(u));
+			mesh.positions.push_back(vec3(radius * cosf(u), 0, radius * sinf(u)) + normal * tube);
+			mesh.normals.push_back(normal);
+		}
+	}
+	for (int r = 0; r < rings; r++)
+	{
+		for (int s = 0; s < sides; s++)
+		{
+			int a = r * sides + s;
+			int b = ((r + 1) % rings) * sides + s;
+			int c = ((r + 1) % rings) * sides + (s + 1) % sides;
+			int d = r * sides + (s + 1) % sides;
+			int quad[] = { a, d, c, a, c, b };
+			mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+		}
+	}
+	return mesh;
+}
+
+// Triangles packed for the block kernels: coord[corner][axis] holds one coordinate of one
+// corner for every triangle.  Padding triangles are NaN, which every test rejects.
+struct TriangleSoA
+{
+	static const size_t blockSize = 4;
+
+	std::vector<float, AlignedAllocator<float> > coord[3][3];
+	std::vector<int> triangle;		// index into the mesh's triangles, -1 for padding
+
+	size_t paddedCount() const { return triangle.size(); }
+
+	vec3 corner(size_t i, int c) const { return vec3(coord[c][0][i], coord[c][1][i], coord[c][2][i]); }
+
+	void resize(size_t slots)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			for (int axis = 0; axis < 3; axis++) coord[c][axis].assign(slots, std::numeric_limits<float>::quiet_NaN());
+		}
+		triangle.assign(slots, -1);
+	}
+
+	void set(size_t i, const vec3 &a, const vec3 &b, const vec3 &c, int index)
+	{
+		const vec3 *corners[] = { &a, &b, &c };
+		for (int k = 0; k < 3; k++)
+		{
+			coord[k][0][i] = corners[k]->x;
+			coord[k][1][i] = corners[k]->y;
+			coord[k][2][i] = corners[k]->z;
+		}
+		triangle[i] = index;
+	}
+};
+
+// Per-ray setup of the watertight test (Woop, Benthin and Wald 2013): the axes are permuted so
+// the ray runs along kz, and triangles are sheared so it becomes the +z axis.  Edge functions
+// are then 2D and evaluated identically for triangles sharing an edge, so rays can't slip
+// through the cracks between them.
+struct TriangleRay
+{
+	float o[3];
+	int kx, ky, kz;
+	float Sx, Sy, Sz;
+
+	TriangleRay(const vec3 &orig, const vec3 &dir)
+	{
+		o[0] = orig.x; o[1] = orig.y; o[2] = orig.z;
+
+		float ax = fabsf(dir.x), ay = fabsf(dir.y), az = fabsf(dir.z);
+		kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (dir[kz] < 0) std::swap(kx, ky);		// keep the winding
+
+		Sx = dir[kx] / dir[kz];
+		Sy = dir[ky] / dir[kz];
+		Sz = 1.f / dir[kz];
+	}
+};
+
+// Edge functions that came out exactly zero may just have rounded to zero; they decide which
+// of two neighbouring triangles is hit, so they are redone in double precision
+inline void exactEdges(float Ax, float Ay, float Bx, float By, float Cx, float Cy, float &U, float &V, float &W)
+{
+	U = (float)((double)Cx * By - (double)Cy * Bx);
+	V = (float)((double)Ax * Cy - (double)Ay * Cx);
+	W = (float)((double)Bx * Ay - (double)By * Ax);
+}
+
+// Distance to triangle i along the ray and its edge functions (the barycentric weights of the
+// corners, times det); returns false if the ray misses it
+inline bool intersectTriangle(const TriangleSoA &triangles, size_t i, const TriangleRay &ray, float &t, float &U, float &V, float &W, float &det)
+{
+	float Akz = triangles.coord[0][ray.kz][i] - ray.o[ray.kz];
+	float Bkz = triangles.coord[1][ray.kz][i] - ray.o[ray.kz];
+	float Ckz = triangles.coord[2][ray.kz][i] - ray.o[ray.kz];
+	float Ax = (triangles.coord[0][ray.kx][i] - ray.o[ray.kx]) - ray.Sx * Akz;
+	float Ay = (triangles.coord[0][ray.ky][i] - ray.o[ray.ky]) - ray.Sy * Akz;
+	float Bx = (triangles.coord[1][ray.kx][i] - ray.o[ray.kx]) - ray.Sx * Bkz;
+	float By = (triangles.coord[1][ray.ky][i] - ray.o[ray.ky]) - ray.Sy * Bkz;
+	float Cx = (triangles.coord[2][ray.kx][i] - ray.o[ray.kx]) - ray.Sx * Ckz;
+	float Cy = (triangles.coord[2][ray.ky][i] - ray.o[ray.ky]) - ray.Sy * Ckz;
+
+	U = Cx * By - Cy * Bx;
+	V = Ax * Cy - Ay * Cx;
+	W = Bx * Ay - By * Ax;
+	if (U == 0 || V == 0 || W == 0) exactEdges(Ax, Ay, Bx, By, Cx, Cy, U, V, W);
+
+	// the ray has to be on the same side of all three edges (either side, no backface culling)
+	if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+
+	det = U + V + W;
+	if (det == 0) return false;
+
+	float T = U * (ray.Sz * Akz) + V * (ray.Sz * Bkz) + W * (ray.Sz * Ckz);
+	t = T / det;
+	return true;
+}
+
+// Finds the triangle in [begin, end) (whole blocks) that the ray hits closest, if it is nearer
+// than tNearest.  Returns its slot and updates tNearest, or returns -1.  As with the sphere
+// kernels, the SIMD kernel does the scalar arithmetic in the same order and breaks ties towards
+// the lowest slot, so both give identical results.
+typedef int (*ClosestTriangleKernel)(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float &tNearest);
+
+// Returns true as soon as any triangle in [begin, end) is hit at a distance in (0, tMax)
+typedef bool (*AnyTriangleKernel)(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float tMax);
+
+int closestTriangleScalar(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float &tNearest)
+{
+	int nearest = -1;
+	for (size_t i = begin; i < end; i++)
+	{
+		float t, U, V, W, det;
+		if (!intersectTriangle(triangles, i, ray, t, U, V, W, det)) continue;
+		if (t > 0 && t < tNearest)
+		{
+			tNearest = t;
+			nearest = (int)i;
+		}
+	}
+	return nearest;
+}
+
+bool anyTriangleScalar(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float tMax)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		float t, U, V, W, det;
+		if (intersectTriangle(triangles, i, ray, t, U, V, W, det) && t > 0 && t < tMax) return true;
+	}
+	return false;
+}
+
+#if WT_X86
+
+// Distances to the 4 triangles at i; lanes that miss are NaN or have hit cleared
+WT_TARGET_SSE2 inline __m128 intersectTriangles4(const TriangleSoA &triangles, size_t i, const TriangleRay &ray, __m128 &hit)
+{
+	const __m128 okx = _mm_set1_ps(ray.o[ray.kx]), oky = _mm_set1_ps(ray.o[ray.ky]), okz = _mm_set1_ps(ray.o[ray.kz]);
+	const __m128 Sx = _mm_set1_ps(ray.Sx), Sy = _mm_set1_ps(ray.Sy), Sz = _mm_set1_ps(ray.Sz);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 Akz = _mm_sub_ps(_mm_load_ps(&triangles.coord[0][ray.kz][i]), okz);
+	__m128 Bkz = _mm_sub_ps(_mm_load_ps(&triangles.coord[1][ray.kz][i]), okz);
+	__m128 Ckz = _mm_sub_ps(_mm_load_ps(&triangles.coord[2][ray.kz][i]), okz);
+	__m128 Ax = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[0][ray.kx][i]), okx), _mm_mul_ps(Sx, Akz));
+	__m128 Ay = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[0][ray.ky][i]), oky), _mm_mul_ps(Sy, Akz));
+	__m128 Bx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[1][ray.kx][i]), okx), _mm_mul_ps(Sx, Bkz));
+	__m128 By = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[1][ray.ky][i]), oky), _mm_mul_ps(Sy, Bkz));
+	__m128 Cx = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[2][ray.kx][i]), okx), _mm_mul_ps(Sx, Ckz));
+	__m128 Cy = _mm_sub_ps(_mm_sub_ps(_mm_load_ps(&triangles.coord[2][ray.ky][i]), oky), _mm_mul_ps(Sy, Ckz));
+
+	__m128 U = _mm_sub_ps(_mm_mul_ps(Cx, By), _mm_mul_ps(Cy, Bx));
+	__m128 V = _mm_sub_ps(_mm_mul_ps(Ax, Cy), _mm_mul_ps(Ay, Cx));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(Bx, Ay), _mm_mul_ps(By, Ax));
+
+	__m128 anyZero = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(U, zero), _mm_cmpeq_ps(V, zero)), _mm_cmpeq_ps(W, zero));
+	if (_mm_movemask_ps(anyZero))
+	{
+		float ax[4], ay[4], bx[4], by[4], cx[4], cy[4], u[4], v[4], w[4];
+		_mm_storeu_ps(ax, Ax); _mm_storeu_ps(ay, Ay);
+		_mm_storeu_ps(bx, Bx); _mm_storeu_ps(by, By);
+		_mm_storeu_ps(cx, Cx); _mm_storeu_ps(cy, Cy);
+		_mm_storeu_ps(u, U); _mm_storeu_ps(v, V); _mm_storeu_ps(w, W);
+		int lanes = _mm_movemask_ps(anyZero);
+		for (int lane = 0; lane < 4; lane++)
+		{
+			if (lanes & (1 << lane)) exactEdges(ax[lane], ay[lane], bx[lane], by[lane], cx[lane], cy[lane], u[lane], v[lane], w[lane]);
+		}
+		U = _mm_loadu_ps(u); V = _mm_loadu_ps(v); W = _mm_loadu_ps(w);
+	}
+
+	__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(U, zero), _mm_cmplt_ps(V, zero)), _mm_cmplt_ps(W, zero));
+	__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(U, zero), _mm_cmpgt_ps(V, zero)), _mm_cmpgt_ps(W, zero));
+
+	__m128 det = _mm_add_ps(_mm_add_ps(U, V), W);
+	__m128 T = _mm_add_ps(_mm_add_ps(_mm_mul_ps(U, _mm_mul_ps(Sz, Akz)), _mm_mul_ps(V, _mm_mul_ps(Sz, Bkz))), _mm_mul_ps(W, _mm_mul_ps(Sz, Ckz)));
+
+	hit = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+	return _mm_div_ps(T, det);
+}
+
+WT_TARGET_SSE2 int closestTriangleSSE2(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float &tNearest)
+{
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 bestT = _mm_set1_ps(tNearest);
+	__m128i bestIndex = _mm_set1_epi32(-1);
+	__m128i index = _mm_setr_epi32((int)begin, (int)begin + 1, (int)begin + 2, (int)begin + 3);
+	const __m128i step = _mm_set1_epi32(4);
+
+	for (size_t i = begin; i < end; i += 4)
+	{
+		__m128 hit;
+		__m128 t = intersectTriangles4(triangles, i, ray, hit);
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, zero));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t, bestT));
+
+		bestT = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, bestT));
+		__m128i hitMask = _mm_castps_si128(hit);
+		bestIndex = _mm_or_si128(_mm_and_si128(hitMask, index), _mm_andnot_si128(hitMask, bestIndex));
+
+		index = _mm_add_epi32(index, step);
+	}
+
+	float laneT[4];
+	int laneIndex[4];
+	_mm_storeu_ps(laneT, bestT);
+	_mm_storeu_si128((__m128i*)laneIndex, bestIndex);
+	return reduceNearest(laneT, laneIndex, 4, tNearest);
+}
+
+WT_TARGET_SSE2 bool anyTriangleSSE2(const TriangleSoA &triangles, size_t begin, size_t end, const TriangleRay &ray, float tMax)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 limit = _mm_set1_ps(tMax);
+
+	for (size_t i = begin; i < end; i += 4)
+	{
+		__m128 hit;
+		__m128 t = intersectTriangles4(triangles, i, ray, hit);
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(t, zero));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t, limit));
+		if (_mm_movemask_ps(hit)) return true;
+	}
+	return false;
+}
+
+#endif
+
+// The kernels in use, chosen once at startup
+struct TriangleKernels
+{
+	SimdLevel level;
+	ClosestTriangleKernel closest;
+	AnyTriangleKernel any;
+};
+
+// Blocks are 4 triangles wide, so AVX2 uses the SSE2 kernels
+TriangleKernels selectTriangleKernels(SimdLevel requested)
+{
+	SimdLevel supported = detectSimdLevel();
+	SimdLevel level = requested < supported ? requested : supported;
+
+	TriangleKernels kernels;
+	kernels.level = SimdLevel::Scalar;
+	kernels.closest = closestTriangleScalar;
+	kernels.any = anyTriangleScalar;
+
+#if WT_X86
+	if (level != SimdLevel::Scalar)
+	{
+		kernels.level = SimdLevel::SSE2;
+		kernels.closest = closestTriangleSSE2;
+		kernels.any = anyTriangleSSE2;
+	}
+#endif
+
+	return kernels;
+}
+
+TriangleKernels triangleKernels = selectTriangleKernels(SimdLevel::AVX2);
+
+// A mesh ready for intersection: its triangles in BVH leaf order
+struct MeshData
+{
+	TriangleSoA triangles;
+	BVH bvh;
+	int material = 0;		// index into Scene::materials
+
+	// Closest triangle hit nearer than tMax; returns its slot and lowers tMax, or returns -1
+	int intersect(const vec3 &orig, const vec3 &dir, float &tMax) const
+	{
+		TriangleRay ray(orig, dir);
+		int nearest = -1;
+		bvh.traverse(orig, dir, tMax, [&](int first, int count, float &limit)
+		{
+			WT_PROFILE_COUNT(TriangleTests, count);
+			int leafNearest = triangleKernels.closest(triangles, first, first + count, ray, limit);
+			if (leafNearest >= 0) nearest = leafNearest;
+			return false;
+		});
+		return nearest;
+	}
+
+	// Is any triangle hit nearer than tMax?
+	bool occluded(const vec3 &orig, const vec3 &dir, float tMax) const
+	{
+		TriangleRay ray(orig, dir);
+		bool occluded = false;
+		bvh.traverse(orig, dir, tMax, [&](int first, int count, float &limit)
+		{
+			WT_PROFILE_COUNT(TriangleTests, count);
+			occluded = triangleKernels.any(triangles, first, first + count, ray, limit);
+			return occluded;
+		});
+		return occluded;
+	}
+
+	// Shading normal at the point where the ray hit the triangle in slot; interpolated from the
+	// vertex normals when the mesh has them.  Triangles are two-sided: the normal is turned to
+	// face the ray, so the back faces of open meshes and faces wound the wrong way are lit.
+	vec3 normal(const Mesh &mesh, int slot, const vec3 &orig, const vec3 &dir) const
+	{
+		vec3 a = triangles.corner(slot, 0), b = triangles.corner(slot, 1), c = triangles.corner(slot, 2);
+		vec3 N = cross(b - a, c - a).normalize();
+
+		float t, U, V, W, det;
+		TriangleRay ray(orig, dir);
+		if (!mesh.normals.empty() && intersectTriangle(triangles, slot, ray, t, U, V, W, det))
+		{
+			const int *corners = &mesh.indices[3 * triangles.triangle[slot]];
+			N = (mesh.normals[corners[0]] * (U / det) + mesh.normals[corners[1]] * (V / det) + mesh.normals[corners[2]] * (W / det)).normalize();
+		}
+		return N * dir > 0 ? -N : N;
+	}
+};
+
+// Builds the BVH over the mesh's triangles and packs them in its leaf order
+void buildMeshData(const Mesh &mesh, MeshData &data)
+{
+	std::vector<AABB> bounds(mesh.triangleCount());
+	for (size_t i = 0; i < bounds.size(); i++)
+	{
+		for (int k = 0; k < 3; k++) bounds[i].grow(mesh.positions[mesh.indices[3 * i + k]]);
+	}
+
+	std::vector<int> order;
+	data.bvh.build(bounds, TriangleSoA::blockSize, 2, order);
+
+	data.triangles.resize(order.size());
+	for (size_t slot = 0; slot < order.size(); slot++)
+	{
+		if (order[slot] < 0) continue;
+		const int *corners = &mesh.indices[3 * order[slot]];
+		data.triangles.set(slot, mesh.positions[corners[0]], mesh.positions[corners[1]], mesh.positions[corners[2]], order[slot]);
+	}
+}
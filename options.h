@@ -0,0 +1,558 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "simd.h"
+#include "renderer.h"
+#include "profile.h"
+#include "precision.h"
+#include "color.h"
+
+// Command line settings
+struct Options
+{
+	// console window size (in characters)
+	int width = 120;
+	int height = 40;
+
+	// render a scripted camera/light path without a console and report throughput
+	bool headless = false;
+	int frames = 300;
+
+	// render threads, including the main thread; 0 uses every hardware thread
+	int threads = 0;
+
+	// widest instruction set the intersection kernels may use
+	SimdLevel simd = SimdLevel::AVX2;
+
+	// built-in scene ("default" or "reflections") or a scene file
+	std::string scene = "default";
+
+	// render this many randomly placed spheres instead of the scene
+	int spheres = 0;
+
+	// Wavefront OBJ model added to the scene
+	std::string mesh;
+
+	// rays followed along each path; more than 1 adds reflections and refractions (see wavefront.h)
+	int bounces = 1;
+
+	// acceleration structure for sphere intersection
+	Accel accel = Accel::Auto;
+
+	// percentage of the spheres moved every frame (see animateSpheres)
+	float animate = 0;
+
+	// time updating and rendering with a grid and a BVH while 1%, 10% and 100% of spheres move
+	bool benchGrid = false;
+
+	// replace the scene's lights with this many lights of limited range (see makeRandomLights)
+	int lights = 0;
+
+	// shadow rays per shading point; above 0 lights are sampled rather than all shaded (see lights.h)
+	int lightSamples = 0;
+
+	// compare shading every light, only those in range and a few sampled at 1 to 1000 lights
+	bool benchLights = false;
+
+	// math used for shading and intersection (see precision.h)
+	Precision precision = Precision::Exact;
+
+	// colours sent to the terminal (see color.h)
+	ColorMode color = ColorMode::Mono;
+
+	// compare the bytes sent per frame in mono, 256-colour and 24-bit colour
+	bool benchColor = false;
+
+	// render the scripted path for viewers connecting to this UNIX domain socket (see server.h)
+	std::string serve;
+	int serveFps = 30;
+
+	// show the frames of the server at this socket
+	std::string view;
+
+	// measure what serving frames costs with 0 to 64 viewers, one of them stalled
+	bool benchServer = false;
+
+	// render frames firstFrame to firstFrame + frames - 1 of the scripted path into this file (see recording.h)
+	std::string record;
+	int firstFrame = 0;
+	int recordMb = 64;				// the file never grows past this
+	int keyframeInterval = 60;
+
+	// play a recording, starting from seek (its first frame when negative)
+	std::string play;
+	int seek = -1;
+	int playFps = 30;
+
+	// measure BVH build time and traversal speed at 1k, 10k and 100k spheres
+	bool benchBvh = false;
+
+	// write frames to the console on the render thread instead of a presenter thread
+	bool syncDraw = false;
+
+	// frame time budget in ms; above 0 the internal resolution drops to keep to it (see governor.h)
+	double targetMs = 0;
+
+	// compare frame times with and without the governor while the CPU is contended
+	bool benchGovernor = false;
+
+	// keep primary hits between frames and only redo what changed (see gbuffer.h)
+	bool gbuffer = false;
+
+	// compare forward and deferred rendering on a path where only the light moves
+	bool benchGBuffer = false;
+
+	// trace half the cells each frame and reproject the rest (see checkerboard.h)
+	bool checkerboard = false;
+
+	// compare checkerboard and full rendering: speed and cells that end up with another glyph
+	bool benchCheckerboard = false;
+
+	// bin spheres into screen tiles for primary rays (see binning.h)
+	bool binning = false;
+
+	// compare sphere tests and speed with and without --binning
+	bool benchBinning = false;
+
+	// trace primary rays in packets of this many cells square, 4 or 8; 0 traces them one by one (see packet.h)
+	int packets = 0;
+
+	// compare single rays with 4x4 and 8x8 packets: sphere tests, speed and output
+	bool benchPackets = false;
+
+	// trace edge cells at 2x3 subcells and pick glyphs by shape (see subcell.h)
+	bool subcells = false;
+
+	// shading table --subcells picks glyphs from
+	GlyphTable glyphs = GlyphTable::Basic;
+
+	// compare --subcells with one ray per cell: rays per cell, speed and cells changed
+	bool benchSubcells = false;
+
+	// measure wavefront rendering at 1 to 8 bounces
+	bool benchBounces = false;
+
+	// measure OBJ loading, BVH build and rendering for meshes of 1k to 1M triangles
+	bool benchMesh = false;
+
+	// check the vector math implementations against each other and time them
+	bool benchMath = false;
+
+	// count the cells whose glyph changes with --precision fast
+	bool benchPrecision = false;
+
+	// compile the --scene file into compileOutput and exit
+	std::string compileOutput;
+
+	// compare loading a text scene and a compiled one (of --spheres spheres, default 1M)
+	bool benchSceneLoad = false;
+
+	// record stage timings and counters for every frame and write them here (see profile.h)
+	std::string profileOutput;
+};
+
+void printUsage(const char *program)
+{
+	std::printf(
+		"usage: %s [options]\n"
+		"  --size WxH        console size in characters (default 120x40)\n"
+		"  --headless        render a scripted path off-screen and report throughput\n"
+		"  --frames N        number of frames rendered by --headless and --record (default 300)\n"
+		"  --threads N       render threads (default: one per hardware thread)\n"
+		"  --simd LEVEL      limit intersection kernels to scalar, sse2 or avx2 (default: best supported)\n"
+		"  --scene NAME      scene to render: default, reflections or a scene file (default: default)\n"
+		"  --compile FILE    compile the --scene file into FILE for fast loading, then exit\n"
+		"  --spheres N       render N random spheres instead of the scene\n"
+		"  --mesh FILE       add a Wavefront OBJ model to the scene\n"
+		"  --bounces N       follow reflected and refracted rays up to N bounces (default 1)\n"
+		"  --accel TYPE      sphere acceleration structure: auto, linear, bvh or grid (default auto)\n"
+		"  --animate PCT     move PCT percent of the spheres up and down every frame\n"
+		"  --precision MODE  shading math: exact or fast (default exact)\n"
+		"  --color MODE      terminal colours: mono, 256 or truecolor (default mono)\n"
+		"  --bench-color     compare bytes per frame with and without colour\n"
+		"  --serve SOCKET    render the scripted path once for any number of --view clients\n"
+		"  --serve-fps N     frames per second rendered by --serve (default 30)\n"
+		"  --view SOCKET     show the frames of a --serve server\n"
+		"  --bench-server    measure the cost of serving 0 to 64 viewers, one of them stalled\n"
+		"  --record FILE     render --frames frames of the scripted path in parallel into a recording\n"
+		"  --first-frame N   first frame --record renders (default 0)\n"
+		"  --record-mb N     most disk space a recording takes; the oldest frames are overwritten (default 64)\n"
+		"  --keyframe-interval N  frames between keyframes in a recording (default 60)\n"
+		"  --play FILE       play a recording; left and right arrows jump between keyframes\n"
+		"  --seek N          frame --play starts from (default: the first)\n"
+		"  --play-fps N      frames per second shown by --play (default 30)\n"
+		"  --bench-bvh       compare BVH and linear intersection at 1k, 10k and 100k spheres\n"
+		"  --bench-grid      time grid and BVH updates and frames while 1%%, 10%% and 100%% of spheres move\n"
+		"  --lights N        replace the scene's lights with N lights of limited range\n"
+		"  --light-samples N shade N lights per point, picked at random by power, instead of all in range\n"
+		"  --bench-lights    compare all, in-range and sampled lights at 1 to 1000 lights\n"
+		"  --sync-draw       write each frame before starting the next instead of overlapping them\n"
+		"  --target-ms MS    lower the internal resolution as needed to keep frames within MS\n"
+		"  --bench-governor  compare frame times with and without --target-ms under CPU contention\n"
+		"  --gbuffer         reuse primary hits while the camera and spheres stay put\n"
+		"  --bench-gbuffer   compare rendering with and without --gbuffer when only the light moves\n"
+		"  --checkerboard    trace alternate cells each frame and reproject the others from the last frame\n"
+		"  --bench-checkerboard compare --checkerboard with full rendering: speed and glyph error\n"
+		"  --binning         test primary rays only against the spheres binned to their screen tile\n"
+		"  --bench-binning   compare sphere tests and speed of linear, BVH and binned primary rays\n"
+		"  --packets N       trace primary rays in NxN packets culled against their frustum (4 or 8)\n"
+		"  --bench-packets   compare single rays with 4x4 and 8x8 packets at 1k to 100k spheres\n"
+		"  --subcells        sample edge cells at 2x3 subcells and pick glyphs that match their shape\n"
+		"  --glyphs TABLE    glyphs for --subcells: basic or extended, which has edge shapes like _ / ) (default basic)\n"
+		"  --bench-subcells  compare --subcells with one ray per cell: rays, speed and cells changed\n"
+		"  (--bounces above 1, --gbuffer, --checkerboard, --binning, --packets and --subcells can't be combined)\n"
+		"  --bench-bounces   measure throughput at 1 to 8 bounces\n"
+		"  --bench-mesh      measure triangle meshes of 1k to 1M triangles\n"
+		"  --bench-precision compare exact and fast shading math: speed and cells that change glyph\n"
+		"  --bench-math      check the SIMD vector math against the scalar templates and time both\n"
+		"  --bench-load      compare loading a text scene and a compiled one\n"
+		"  --profile FILE    time each render stage and write per-frame figures to FILE (.json or .csv)\n"
+		"  --help            show this message\n",
+		program);
+}
+
+// Returns false (after printing usage) if the arguments could not be understood
+bool parseOptions(int argc, char **argv, Options &options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (std::strcmp(arg, "--headless") == 0)
+		{
+			options.headless = true;
+		}
+		else if (std::strcmp(arg, "--frames") == 0 && value)
+		{
+			options.frames = std::atoi(value);
+			i++;
+		}
+		else if (std::strcmp(arg, "--threads") == 0 && value)
+		{
+			options.threads = std::atoi(value);
+			i++;
+		}
+		else if (std::strcmp(arg, "--simd") == 0 && value)
+		{
+			if (!parseSimdLevel(value, options.simd))
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--accel") == 0 && value)
+		{
+			if (!parseAccel(value, options.accel))
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-bvh") == 0)
+		{
+			options.benchBvh = true;
+		}
+		else if (std::strcmp(arg, "--animate") == 0 && value)
+		{
+			options.animate = (float)std::atof(value);
+			if (options.animate <= 0 || options.animate > 100)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-grid") == 0)
+		{
+			options.benchGrid = true;
+		}
+		else if (std::strcmp(arg, "--lights") == 0 && value)
+		{
+			options.lights = std::atoi(value);
+			if (options.lights <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--light-samples") == 0 && value)
+		{
+			options.lightSamples = std::atoi(value);
+			if (options.lightSamples <= 0 || options.lightSamples > maxShadowBatch)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-lights") == 0)
+		{
+			options.benchLights = true;
+		}
+		else if (std::strcmp(arg, "--sync-draw") == 0)
+		{
+			options.syncDraw = true;
+		}
+		else if (std::strcmp(arg, "--target-ms") == 0 && value)
+		{
+			options.targetMs = std::atof(value);
+			if (options.targetMs <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-governor") == 0)
+		{
+			options.benchGovernor = true;
+		}
+		else if (std::strcmp(arg, "--gbuffer") == 0)
+		{
+			options.gbuffer = true;
+		}
+		else if (std::strcmp(arg, "--bench-gbuffer") == 0)
+		{
+			options.benchGBuffer = true;
+		}
+		else if (std::strcmp(arg, "--checkerboard") == 0)
+		{
+			options.checkerboard = true;
+		}
+		else if (std::strcmp(arg, "--bench-checkerboard") == 0)
+		{
+			options.benchCheckerboard = true;
+		}
+		else if (std::strcmp(arg, "--binning") == 0)
+		{
+			options.binning = true;
+		}
+		else if (std::strcmp(arg, "--bench-binning") == 0)
+		{
+			options.benchBinning = true;
+		}
+		else if (std::strcmp(arg, "--packets") == 0 && value)
+		{
+			options.packets = std::atoi(value);
+			if (options.packets != 4 && options.packets != 8)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-packets") == 0)
+		{
+			options.benchPackets = true;
+		}
+		else if (std::strcmp(arg, "--subcells") == 0)
+		{
+			options.subcells = true;
+		}
+		else if (std::strcmp(arg, "--glyphs") == 0 && value)
+		{
+			if (!parseGlyphTable(value, options.glyphs))
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-subcells") == 0)
+		{
+			options.benchSubcells = true;
+		}
+		else if (std::strcmp(arg, "--bench-bounces") == 0)
+		{
+			options.benchBounces = true;
+		}
+		else if (std::strcmp(arg, "--bench-mesh") == 0)
+		{
+			options.benchMesh = true;
+		}
+		else if (std::strcmp(arg, "--precision") == 0 && value)
+		{
+			if (!parsePrecision(value, options.precision))
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--color") == 0 && value)
+		{
+			if (!parseColorMode(value, options.color))
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-color") == 0)
+		{
+			options.benchColor = true;
+		}
+		else if (std::strcmp(arg, "--serve") == 0 && value)
+		{
+			options.serve = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--serve-fps") == 0 && value)
+		{
+			options.serveFps = std::atoi(value);
+			if (options.serveFps <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--view") == 0 && value)
+		{
+			options.view = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-server") == 0)
+		{
+			options.benchServer = true;
+		}
+		else if (std::strcmp(arg, "--record") == 0 && value)
+		{
+			options.record = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--first-frame") == 0 && value)
+		{
+			options.firstFrame = std::atoi(value);
+			if (options.firstFrame < 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--record-mb") == 0 && value)
+		{
+			options.recordMb = std::atoi(value);
+			if (options.recordMb <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--keyframe-interval") == 0 && value)
+		{
+			options.keyframeInterval = std::atoi(value);
+			if (options.keyframeInterval <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--play") == 0 && value)
+		{
+			options.play = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--seek") == 0 && value)
+		{
+			options.seek = std::atoi(value);
+			i++;
+		}
+		else if (std::strcmp(arg, "--play-fps") == 0 && value)
+		{
+			options.playFps = std::atoi(value);
+			if (options.playFps <= 0)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-precision") == 0)
+		{
+			options.benchPrecision = true;
+		}
+		else if (std::strcmp(arg, "--bench-math") == 0)
+		{
+			options.benchMath = true;
+		}
+		else if (std::strcmp(arg, "--mesh") == 0 && value)
+		{
+			options.mesh = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--scene") == 0 && value)
+		{
+			options.scene = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--compile") == 0 && value)
+		{
+			options.compileOutput = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--profile") == 0 && value)
+		{
+			if (!WT_PROFILE)
+			{
+				std::fprintf(stderr, "profiling was left out of this build (WT_PROFILE=0)\n");
+				return false;
+			}
+			options.profileOutput = value;
+			i++;
+		}
+		else if (std::strcmp(arg, "--bench-load") == 0)
+		{
+			options.benchSceneLoad = true;
+		}
+		else if (std::strcmp(arg, "--bounces") == 0 && value)
+		{
+			options.bounces = std::atoi(value);
+			i++;
+		}
+		else if (std::strcmp(arg, "--spheres") == 0 && value)
+		{
+			options.spheres = std::atoi(value);
+			i++;
+		}
+		else if (std::strcmp(arg, "--size") == 0 && value)
+		{
+			if (std::sscanf(value, "%dx%d", &options.width, &options.height) != 2)
+			{
+				printUsage(argv[0]);
+				return false;
+			}
+			i++;
+		}
+		else
+		{
+			printUsage(argv[0]);
+			return false;
+		}
+	}
+
+	if (options.width <= 0 || options.height <= 0 || options.frames <= 0 || options.threads < 0 || options.spheres < 0 || options.bounces <= 0)
+	{
+		printUsage(argv[0]);
+		return false;
+	}
+
+	// each of these renders the primary rays its own way, so only one can be used at a time
+	int renderModes = (options.bounces > 1) + options.checkerboard + options.gbuffer + options.binning + (options.packets > 0) + options.subcells;
+	if (renderModes > 1)
+	{
+		std::fprintf(stderr, "only one of --bounces (above 1), --checkerboard, --gbuffer, --binning, --packets and --subcells can be given\n");
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,477 @@
+#pragma once
+#include "renderer.h"
+#include "simd.h"
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+
+// Packet tracing for primary rays.  The primary rays of a square of cells (4x4 or 8x8) leave
+// the eye in nearly the same direction, so they are traced together: the four corner rays
+// bound a frustum, every sphere (or BVH node) wholly outside it is dropped for the whole packet
+// with one test, and the spheres left are tested against all the packet's rays at once, with the
+// rays in the SIMD lanes.
+//
+// A packet that sees many spheres after culling has lost coherence (it spans silhouettes of
+// many small spheres); with a BVH each ray on its own would test fewer, so an 8x8 packet is
+// split into 4x4 ones, which cull from the spheres it found, and a 4x4 packet is traced one ray
+// at a time.  An 8x8 packet that sees more than four times as many goes one ray at a time
+// straight away.  Without one, a packet
+// never tests more spheres than a single ray would.  Frustums aren't culled against a grid, so
+// with one every ray is traced on its own.
+//
+// Hits are computed with the same arithmetic as the sphere kernels and ties go to the lowest
+// slot, so frames are identical to a linear search.  Shading is done ray by ray as usual.
+
+// Spheres a packet may keep after culling before it is split or traced ray by ray, when the
+// scene has a BVH
+const int packetMaxCandidates = 48;
+
+// Spheres an 8x8 packet may see and still be split: past this its 4x4 quarters would mostly
+// overflow too, so its rays are traced one at a time straight away
+const int packetMaxSplitCandidates = 4 * packetMaxCandidates;
+
+// Slack on the frustum tests, relative to the size of the coordinates, for rounding
+const float packetSlack = 1e-4f;
+
+// Directions of up to 8x8 rays, padded to a whole number of 8 lane blocks
+struct RayPacket
+{
+	static const int maxRays = 64;
+
+	float dx[maxRays], dy[maxRays], dz[maxRays];
+	int count = 0;			// real rays
+	int padded = 0;			// rays including padding
+};
+
+// Nearest hit, if closer than tNearest[r], of each packet ray among the candidate spheres
+// (slots, in ascending order); the hit's slot goes in nearest[r]
+typedef void (*PacketSphereKernel)(const SphereSoA &spheres, const int *candidates, int candidateCount, const vec3 &orig, const RayPacket &packet, float *tNearest, int *nearest);
+
+void closestPacketScalar(const SphereSoA &spheres, const int *candidates, int candidateCount, const vec3 &orig, const RayPacket &packet, float *tNearest, int *nearest)
+{
+	for (int r = 0; r < packet.count; r++)
+	{
+		for (int k = 0; k < candidateCount; k++)
+		{
+			int i = candidates[k];
+			float Lx = spheres.cx[i] - orig.x;
+			float Ly = spheres.cy[i] - orig.y;
+			float Lz = spheres.cz[i] - orig.z;
+			float tca = Lz * packet.dz[r] + Ly * packet.dy[r] + Lx * packet.dx[r];
+			float d2 = (Lz * Lz + Ly * Ly + Lx * Lx) - tca * tca;
+			if (d2 > spheres.r2[i]) continue;
+			float thc = sqrtf(spheres.r2[i] - d2);
+			float t = tca - thc;
+			if (t < 0) t = tca + thc;
+			if (t < 0) continue;
+			if (t < tNearest[r])
+			{
+				tNearest[r] = t;
+				nearest[r] = i;
+			}
+		}
+	}
+}
+
+#if WT_X86
+WT_TARGET_SSE2 void closestPacketSSE2(const SphereSoA &spheres, const int *candidates, int candidateCount, const vec3 &orig, const RayPacket &packet, float *tNearest, int *nearest)
+{
+	const __m128 zero = _mm_setzero_ps();
+
+	for (int r = 0; r < packet.padded; r += 4)
+	{
+		const __m128 dx = _mm_loadu_ps(&packet.dx[r]), dy = _mm_loadu_ps(&packet.dy[r]), dz = _mm_loadu_ps(&packet.dz[r]);
+		__m128 bestT = _mm_loadu_ps(&tNearest[r]);
+		__m128i bestIndex = _mm_loadu_si128((const __m128i*)&nearest[r]);
+
+		for (int k = 0; k < candidateCount; k++)
+		{
+			// the sphere is the same for every lane, so this part is scalar
+			int i = candidates[k];
+			float Lx = spheres.cx[i] - orig.x;
+			float Ly = spheres.cy[i] - orig.y;
+			float Lz = spheres.cz[i] - orig.z;
+			const __m128 LL = _mm_set1_ps(Lz * Lz + Ly * Ly + Lx * Lx);
+			const __m128 r2 = _mm_set1_ps(spheres.r2[i]);
+
+			__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(Lz), dz), _mm_mul_ps(_mm_set1_ps(Ly), dy)), _mm_mul_ps(_mm_set1_ps(Lx), dx));
+			__m128 d2 = _mm_sub_ps(LL, _mm_mul_ps(tca, tca));
+
+			// misses produce NaN here, they are masked out below
+			__m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+			__m128 t0 = _mm_sub_ps(tca, thc);
+			__m128 t1 = _mm_add_ps(tca, thc);
+
+			__m128 inside = _mm_cmplt_ps(t0, zero);
+			__m128 t = _mm_or_ps(_mm_and_ps(inside, t1), _mm_andnot_ps(inside, t0));
+
+			__m128 hit = _mm_cmpngt_ps(d2, r2);
+			hit = _mm_and_ps(hit, _mm_cmpge_ps(t, zero));
+			hit = _mm_and_ps(hit, _mm_cmplt_ps(t, bestT));
+
+			bestT = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, bestT));
+			__m128i hitMask = _mm_castps_si128(hit);
+			bestIndex = _mm_or_si128(_mm_and_si128(hitMask, _mm_set1_epi32(i)), _mm_andnot_si128(hitMask, bestIndex));
+		}
+
+		_mm_storeu_ps(&tNearest[r], bestT);
+		_mm_storeu_si128((__m128i*)&nearest[r], bestIndex);
+	}
+}
+
+WT_TARGET_AVX2 void closestPacketAVX2(const SphereSoA &spheres, const int *candidates, int candidateCount, const vec3 &orig, const RayPacket &packet, float *tNearest, int *nearest)
+{
+	const __m256 zero = _mm256_setzero_ps();
+
+	for (int r = 0; r < packet.padded; r += 8)
+	{
+		const __m256 dx = _mm256_loadu_ps(&packet.dx[r]), dy = _mm256_loadu_ps(&packet.dy[r]), dz = _mm256_loadu_ps(&packet.dz[r]);
+		__m256 bestT = _mm256_loadu_ps(&tNearest[r]);
+		__m256i bestIndex = _mm256_loadu_si256((const __m256i*)&nearest[r]);
+
+		for (int k = 0; k < candidateCount; k++)
+		{
+			int i = candidates[k];
+			float Lx = spheres.cx[i] - orig.x;
+			float Ly = spheres.cy[i] - orig.y;
+			float Lz = spheres.cz[i] - orig.z;
+			const __m256 LL = _mm256_set1_ps(Lz * Lz + Ly * Ly + Lx * Lx);
+			const __m256 r2 = _mm256_set1_ps(spheres.r2[i]);
+
+			__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(Lz), dz), _mm256_mul_ps(_mm256_set1_ps(Ly), dy)), _mm256_mul_ps(_mm256_set1_ps(Lx), dx));
+			__m256 d2 = _mm256_sub_ps(LL, _mm256_mul_ps(tca, tca));
+
+			__m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+			__m256 t0 = _mm256_sub_ps(tca, thc);
+			__m256 t1 = _mm256_add_ps(tca, thc);
+			__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+			__m256 hit = _mm256_cmp_ps(d2, r2, _CMP_NGT_UQ);
+			hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+			hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+
+			bestT = _mm256_blendv_ps(bestT, t, hit);
+			bestIndex = _mm256_blendv_epi8(bestIndex, _mm256_set1_epi32(i), _mm256_castps_si256(hit));
+		}
+
+		_mm256_storeu_ps(&tNearest[r], bestT);
+		_mm256_storeu_si256((__m256i*)&nearest[r], bestIndex);
+	}
+}
+#endif
+
+// The packet kernel matching the sphere kernels in use
+PacketSphereKernel selectPacketKernel(SimdLevel level)
+{
+#if WT_X86
+	if (level == SimdLevel::AVX2) return closestPacketAVX2;
+	if (level == SimdLevel::SSE2) return closestPacketSSE2;
+#endif
+	(void)level;
+	return closestPacketScalar;
+}
+
+// Four planes through the eye bounding a packet's rays; normals point inwards
+struct PacketFrustum
+{
+	vec3 normals[4];
+
+	// from the directions of the corner rays, in order around the square
+	PacketFrustum(const vec3 corners[4])
+	{
+		vec3 middle = corners[0] + corners[1] + corners[2] + corners[3];
+		for (int p = 0; p < 4; p++)
+		{
+			vec3 n = cross(corners[p], corners[(p + 1) % 4]);
+			float length = n.norm();
+
+			// a packet one ray wide has no width to cull with on that side
+			if (length < 1e-12f)
+			{
+				normals[p] = vec3(0, 0, 0);
+				continue;
+			}
+			n = n * (1 / length);
+			normals[p] = n * middle < 0 ? -n : n;
+		}
+	}
+
+	// Is any part of the sphere at offset L from the eye inside?
+	bool overlaps(float Lx, float Ly, float Lz, float radius) const
+	{
+		float slack = radius + packetSlack * (std::fabs(Lx) + std::fabs(Ly) + std::fabs(Lz));
+		for (int p = 0; p < 4; p++)
+		{
+			if (normals[p].x * Lx + normals[p].y * Ly + normals[p].z * Lz < -slack) return false;
+		}
+		return true;
+	}
+
+	// Is any part of the box inside?  Tests the corner furthest along each normal.
+	bool overlaps(const BVHNode &node, const vec3 &orig) const
+	{
+		for (int p = 0; p < 4; p++)
+		{
+			const vec3 &n = normals[p];
+			float x = (n.x > 0 ? node.hi[0] : node.lo[0]) - orig.x;
+			float y = (n.y > 0 ? node.hi[1] : node.lo[1]) - orig.y;
+			float z = (n.z > 0 ? node.hi[2] : node.lo[2]) - orig.z;
+			float slack = packetSlack * (std::fabs(x) + std::fabs(y) + std::fabs(z));
+			if (n.x * x + n.y * y + n.z * z < -slack) return false;
+		}
+		return true;
+	}
+};
+
+class PacketRenderer
+{
+private:
+	// per worker: culled spheres of the packet being traced, and of the quarter of it being
+	// traced once it is split
+	std::vector<std::vector<int> > candidateLists;
+	std::vector<std::vector<int> > quarterCandidateLists;
+
+	// per worker: sphere tests and rays traced alone, for the benchmark
+	struct Counters
+	{
+		uint64_t sphereTests;
+		uint64_t singleRays;
+		char padding[64 - 2 * sizeof(uint64_t)];
+	};
+	std::vector<Counters> counters;
+
+	int size;
+
+	// The spheres the frustum holds, in ascending slot order; gives up, returning false, once
+	// there are more than limit
+	static bool cull(const Scene &scene, const vec3 &orig, const PacketFrustum &frustum, size_t limit, std::vector<int> &candidates)
+	{
+		const SphereSoA &spheres = scene.sphereData;
+		candidates.clear();
+
+		if (scene.bvh.empty())
+		{
+			for (size_t i = 0; i < spheres.paddedCount(); i++)
+			{
+				if (spheres.r2[i] < 0) continue;
+				if (frustum.overlaps(spheres.cx[i] - orig.x, spheres.cy[i] - orig.y, spheres.cz[i] - orig.z, std::sqrt(spheres.r2[i])))
+				{
+					candidates.push_back((int)i);
+					if (candidates.size() > limit) return false;
+				}
+			}
+			return true;
+		}
+
+		int stack[128];
+		int depth = 0;
+		stack[depth++] = 0;
+		while (depth > 0)
+		{
+			const BVHNode &node = scene.bvh.nodes[stack[--depth]];
+			if (!frustum.overlaps(node, orig)) continue;
+
+			if (node.isLeaf())
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+				{
+					if (spheres.r2[i] < 0) continue;
+					if (frustum.overlaps(spheres.cx[i] - orig.x, spheres.cy[i] - orig.y, spheres.cz[i] - orig.z, std::sqrt(spheres.r2[i])))
+						candidates.push_back(i);
+				}
+				if (candidates.size() > limit) return false;
+			}
+			else
+			{
+				stack[depth++] = node.first + 1;
+				stack[depth++] = node.first;
+			}
+		}
+		std::sort(candidates.begin(), candidates.end());
+		return true;
+	}
+
+	// The spheres of a split packet's list that its quarter's frustum holds, in the same order;
+	// false once there are more than limit
+	static bool cullFrom(const std::vector<int> &from, const Scene &scene, const vec3 &orig, const PacketFrustum &frustum, size_t limit, std::vector<int> &candidates)
+	{
+		const SphereSoA &spheres = scene.sphereData;
+		candidates.clear();
+		for (size_t k = 0; k < from.size(); k++)
+		{
+			int i = from[k];
+			if (frustum.overlaps(spheres.cx[i] - orig.x, spheres.cy[i] - orig.y, spheres.cz[i] - orig.z, std::sqrt(spheres.r2[i])))
+			{
+				candidates.push_back(i);
+				if (candidates.size() > limit) return false;
+			}
+		}
+		return true;
+	}
+
+	// Trace and shade the cells [x0, x1) x [y0, y1) one ray at a time
+	template <typename Math, typename Target>
+	void traceAlone(Target &target, int x0, int y0, int x1, int y1, const Scene &scene, const Camera &camera, RayStats &stats, int worker)
+	{
+		for (int j = y0; j < y1; j++)
+		{
+			for (int i = x0; i < x1; i++)
+			{
+				stats.primaryRays++;
+				target.setPixel(i, j, getShadingChar(cast_ray<Math>(camera.position, camera.rayDirection(i, j), scene, stats)));
+			}
+		}
+		counters[worker].singleRays += (x1 - x0) * (y1 - y0);
+	}
+
+	// Trace and shade the cells [x0, x1) x [y0, y1); a quarter of a split packet culls from the
+	// spheres the whole packet kept rather than from the BVH
+	template <typename Math, typename Target>
+	void tracePacket(Target &target, int x0, int y0, int x1, int y1, const Scene &scene, const Camera &camera, PacketSphereKernel kernel, RayStats &stats, int worker,
+		const std::vector<int> *splitFrom = nullptr)
+	{
+		// the grid isn't culled against the frustum: scanning every sphere for each packet would
+		// cost far more than walking the grid for each ray
+		if (scene.bvh.empty() && !scene.grid.empty())
+		{
+			traceAlone<Math>(target, x0, y0, x1, y1, scene, camera, stats, worker);
+			return;
+		}
+
+		const vec3 &orig = camera.position;
+		vec3 corners[4] = { camera.rayDirection(x0, y0), camera.rayDirection(x1 - 1, y0), camera.rayDirection(x1 - 1, y1 - 1), camera.rayDirection(x0, y1 - 1) };
+		PacketFrustum frustum(corners);
+
+		// a packet that sees too many spheres is split once, into 4x4 quarters, if it isn't far
+		// over; otherwise, or if a quarter sees too many, its rays go one at a time
+		size_t limit = scene.bvh.empty() ? SIZE_MAX : packetMaxCandidates;
+		bool splittable = x1 - x0 > 4 || y1 - y0 > 4;
+		std::vector<int> &candidates = splitFrom ? quarterCandidateLists[worker] : candidateLists[worker];
+		bool culled = splitFrom ? cullFrom(*splitFrom, scene, orig, frustum, limit, candidates)
+			: cull(scene, orig, frustum, splittable ? std::max(limit, (size_t)packetMaxSplitCandidates) : limit, candidates);
+		if (!culled)
+		{
+			traceAlone<Math>(target, x0, y0, x1, y1, scene, camera, stats, worker);
+			return;
+		}
+		if (candidates.size() > limit)
+		{
+			for (int y = y0; y < y1; y += 4)
+			{
+				for (int x = x0; x < x1; x += 4)
+					tracePacket<Math>(target, x, y, std::min(x + 4, x1), std::min(y + 4, y1), scene, camera, kernel, stats, worker, &candidates);
+			}
+			return;
+		}
+
+		RayPacket packet;
+		for (int j = y0; j < y1; j++)
+		{
+			for (int i = x0; i < x1; i++)
+			{
+				vec3 dir = camera.rayDirection(i, j);
+				packet.dx[packet.count] = dir.x;
+				packet.dy[packet.count] = dir.y;
+				packet.dz[packet.count] = dir.z;
+				packet.count++;
+			}
+		}
+		packet.padded = (packet.count + 7) / 8 * 8;
+		for (int r = packet.count; r < packet.padded; r++)
+		{
+			packet.dx[r] = packet.dx[0];
+			packet.dy[r] = packet.dy[0];
+			packet.dz[r] = packet.dz[0];
+		}
+
+		// hits beyond 1000 don't count, as in scene_intersect
+		float tNearest[RayPacket::maxRays];
+		int nearest[RayPacket::maxRays];
+		std::fill(tNearest, tNearest + packet.padded, 1000.f);
+		std::fill(nearest, nearest + packet.padded, -1);
+		{
+			WT_PROFILE_SCOPE(Intersect);
+			WT_PROFILE_COUNT(Rays, packet.count);
+			WT_PROFILE_COUNT(SphereTests, candidates.size() * packet.count);
+			kernel(scene.sphereData, candidates.data(), (int)candidates.size(), orig, packet, tNearest, nearest);
+		}
+		counters[worker].sphereTests += candidates.size() * packet.count;
+
+		int r = 0;
+		for (int j = y0; j < y1; j++)
+		{
+			for (int i = x0; i < x1; i++, r++)
+			{
+				vec3 dir(packet.dx[r], packet.dy[r], packet.dz[r]);
+				stats.primaryRays++;
+
+				vec3 point, N;
+				const Material *material;
+				float val = 0;
+				if (finish_intersect<Math>(orig, dir, scene, nearest[r], tNearest[r], point, N, material))
+					val = shade<Math>(point, N, material, dir, scene, stats);
+
+				target.setPixel(i, j, getShadingChar(val));
+			}
+		}
+	}
+
+public:
+	// packets of size x size cells, 4 or 8
+	explicit PacketRenderer(int size = 8) : size(size) {}
+
+	void setSize(int cells) { size = cells; }
+
+	// Sphere tests and rays traced alone since the last resetCounters()
+	uint64_t sphereTests() const
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < counters.size(); i++) total += counters[i].sphereTests;
+		return total;
+	}
+
+	uint64_t singleRays() const
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < counters.size(); i++) total += counters[i].singleRays;
+		return total;
+	}
+
+	void resetCounters()
+	{
+		for (size_t i = 0; i < counters.size(); i++) counters[i].sphereTests = counters[i].singleRays = 0;
+	}
+
+	// Same output as renderFrame.  Math is the precision policy (see precision.h).
+	template <typename Math = ExactMath, typename Target>
+	void render(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+	{
+		camera.prepare(width, height);
+		if ((int)candidateLists.size() < pool.size())
+		{
+			candidateLists.resize(pool.size());
+			quarterCandidateLists.resize(pool.size());
+			Counters zero = {};
+			counters.resize(pool.size(), zero);
+		}
+
+		PacketSphereKernel kernel = selectPacketKernel(sphereKernels.level);
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			for (int y = rect.y0; y < rect.y1; y += size)
+			{
+				for (int x = rect.x0; x < rect.x1; x += size)
+				{
+					tracePacket<Math>(target, x, y, std::min(x + size, rect.x1), std::min(y + size, rect.y1), scene, camera, kernel,
+						workerStats[worker].stats, worker);
+				}
+			}
+		});
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+	}
+};
@@ -0,0 +1,126 @@
+#pragma once
+#include "geometry.h"
+#include "simd.h"
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Precision policies for the shading and intersection path.  The functions on that path take
+// the policy as a template argument (ExactMath unless told otherwise), so each is compiled once
+// per policy and there is no runtime switch inside the loops.
+//
+// ExactMath is the C library and plain division, which is what the renderer always did: frames
+// are bit-identical.  FastMath uses approximations with relative errors around 1e-4, far finer
+// than the ten glyphs a cell is shaded with.
+
+enum class Precision
+{
+	Exact,
+	Fast
+};
+
+const char* precisionName(Precision precision)
+{
+	return precision == Precision::Fast ? "fast" : "exact";
+}
+
+// Parses "exact" or "fast"; returns false for anything else
+bool parsePrecision(const char *name, Precision &precision)
+{
+	std::string value(name);
+	if (value == "exact") precision = Precision::Exact;
+	else if (value == "fast") precision = Precision::Fast;
+	else return false;
+	return true;
+}
+
+struct ExactMath
+{
+	static float pow(float x, float y) { return powf(x, y); }
+	static float exp(float x) { return expf(x); }
+	static float rsqrt(float x) { return 1 / std::sqrt(x); }
+
+	// v scaled to unit length, with the original length in length; the same results as
+	// vec3::normalize() and vec3::norm()
+	static vec3 normalize(const vec3 &v, float &length)
+	{
+		length = v.norm();
+		return v * (1 / length);
+	}
+
+	static vec3 normalize(const vec3 &v)
+	{
+		float length;
+		return normalize(v, length);
+	}
+};
+
+struct FastMath
+{
+	// polynomial fits on [0, 1) at Chebyshev nodes: log2(1 + t) = t * P(t) to 5e-5, 2^t to 4e-6
+	static float log2(float x)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		float exponent = (float)((int)(bits >> 23) - 127);
+
+		bits = (bits & 0x007fffffu) | 0x3f800000u;
+		float mantissa;
+		std::memcpy(&mantissa, &bits, sizeof(mantissa));
+
+		float t = mantissa - 1;
+		return exponent + t * (1.44260389f + t * (-.716714663f + t * (.440599033f + t * (-.225103025f + t * .0586649397f))));
+	}
+
+	// results below 2^-126 come out as 2^-126
+	static float exp2(float x)
+	{
+		x = std::min(std::max(x, -126.f), 127.f);
+
+		// truncating a positive number rounds it down
+		int whole = (int)(x + 128) - 128;
+		float t = x - whole;
+
+		uint32_t bits = (uint32_t)(whole + 127) << 23;
+		float scale;
+		std::memcpy(&scale, &bits, sizeof(scale));
+
+		return scale * (1.00000349f + t * (.692972922f + t * (.241604357f + t * (.0517449978f + t * .0136703095f))));
+	}
+
+	// for x >= 0 and y > 0, which is how shading uses it
+	static float pow(float x, float y) { return exp2(y * log2(std::max(x, 1e-30f))); }
+	static float exp(float x) { return exp2(x * 1.44269504f); }
+
+	// hardware estimate (or the bit trick) refined by Newton-Raphson
+	static float rsqrt(float x)
+	{
+#if WT_BASELINE_SSE2
+		float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+		return r * (1.5f - .5f * x * r * r);
+#else
+		uint32_t bits;
+		std::memcpy(&bits, &x, sizeof(bits));
+		bits = 0x5f3759dfu - (bits >> 1);
+		float r;
+		std::memcpy(&r, &bits, sizeof(r));
+		r = r * (1.5f - .5f * x * r * r);
+		return r * (1.5f - .5f * x * r * r);
+#endif
+	}
+
+	static vec3 normalize(const vec3 &v, float &length)
+	{
+		float squared = v * v;
+		float inverse = rsqrt(squared);
+		length = squared * inverse;
+		return v * inverse;
+	}
+
+	static vec3 normalize(const vec3 &v)
+	{
+		return v * rsqrt(v * v);
+	}
+};
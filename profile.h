@@ -0,0 +1,314 @@
+#pragma once
+#include "simd.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#if WT_X86 && !defined(_MSC_VER)
+#include <x86intrin.h>
+#endif
+
+// Per-frame stage timers and counters.
+//
+// WT_PROFILE_SCOPE(Stage) times the rest of the enclosing block and WT_PROFILE_COUNT(Counter, n)
+// adds to a counter.  Each thread adds into its own slot, so workers never share a cache line;
+// endFrame() sums the slots and keeps the frame in a ring buffer that can be written out as JSON
+// or CSV.  Nothing is recorded until profiling is switched on (--profile), and building with
+// WT_PROFILE=0 removes the macros altogether.
+
+#ifndef WT_PROFILE
+#define WT_PROFILE 1
+#endif
+
+enum class ProfileStage
+{
+	RayGeneration,	// camera set-up and, for the wavefront renderer, the primary ray queue
+	Intersect,		// scene_intersect
+	Shade,			// shade(), including its shadow tests
+	Shadow,			// shadow ray batches
+	Draw,			// writing a frame to the console
+	Count
+};
+
+enum class ProfileCounter
+{
+	Rays,			// closest-hit and shadow rays
+	SphereTests,	// ray/sphere tests, counted per SIMD block
+	TriangleTests,	// ray/triangle tests, counted per SIMD block
+	Hits,			// closest-hit rays that hit something
+	Occluded,		// shadow rays that found a blocker
+	Count
+};
+
+const int profileStageCount = (int)ProfileStage::Count;
+const int profileCounterCount = (int)ProfileCounter::Count;
+
+const char* profileStageName(int stage)
+{
+	static const char *names[profileStageCount] = { "generate", "intersect", "shade", "shadow", "draw" };
+	return names[stage];
+}
+
+const char* profileCounterName(int counter)
+{
+	static const char *names[profileCounterCount] = { "rays", "sphere_tests", "triangle_tests", "hits", "occluded" };
+	return names[counter];
+}
+
+// Frames kept by the profiler; older frames are overwritten
+const size_t profileHistory = 1024;
+
+// Set while profiling; the macros do nothing else when it isn't
+bool profiling = false;
+
+// Cheap timestamp; x86 uses the time stamp counter, which Profiler calibrates against steady_clock
+inline uint64_t profileTicks()
+{
+#if WT_X86
+	return __rdtsc();
+#else
+	return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// One thread's running totals.  Only the owning thread writes them; endFrame reads them from
+// another thread, hence the (relaxed) atomics.  Padded so slots don't share cache lines.
+struct ProfileSlot
+{
+	std::atomic<uint64_t> ticks[profileStageCount];
+	std::atomic<uint64_t> counts[profileCounterCount];
+	char padding[64];
+
+	ProfileSlot()
+	{
+		for (int i = 0; i < profileStageCount; i++) ticks[i].store(0, std::memory_order_relaxed);
+		for (int i = 0; i < profileCounterCount; i++) counts[i].store(0, std::memory_order_relaxed);
+	}
+
+	static void add(std::atomic<uint64_t> &total, uint64_t value)
+	{
+		total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+};
+
+// What one frame cost
+struct ProfileFrame
+{
+	uint64_t frame = 0;
+	double frameMs = 0;
+	double stageMs[profileStageCount] = {};		// summed over threads
+	uint64_t counts[profileCounterCount] = {};
+};
+
+class Profiler
+{
+private:
+	std::mutex mutex;
+	std::deque<std::unique_ptr<ProfileSlot> > slots;
+
+	// totals at the end of the last frame
+	uint64_t lastTicks[profileStageCount] = {};
+	uint64_t lastCounts[profileCounterCount] = {};
+
+	std::vector<ProfileFrame> history;
+	size_t next = 0;				// ring buffer slot for the next frame
+	uint64_t framesRecorded = 0;
+
+	// time stamp counter calibration
+	uint64_t startTicks = 0;
+	std::chrono::steady_clock::time_point startTime;
+	std::chrono::steady_clock::time_point frameStart;
+
+	double msPerTick() const
+	{
+#if WT_X86
+		uint64_t ticks = profileTicks() - startTicks;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+		return ticks > 0 ? ms / ticks : 0;
+#else
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::duration(1)).count();
+#endif
+	}
+
+public:
+	Profiler()
+	{
+		startTicks = profileTicks();
+		startTime = frameStart = std::chrono::steady_clock::now();
+	}
+
+	// A slot for the calling thread; slots live as long as the profiler
+	ProfileSlot* registerThread()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slots.emplace_back(new ProfileSlot());
+		return slots.back().get();
+	}
+
+	void beginFrame()
+	{
+		frameStart = std::chrono::steady_clock::now();
+	}
+
+	// Record everything counted since the last endFrame() as one frame
+	void endFrame()
+	{
+		ProfileFrame frame;
+		frame.frame = framesRecorded++;
+		frame.frameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+
+		uint64_t ticks[profileStageCount] = {};
+		uint64_t counts[profileCounterCount] = {};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t s = 0; s < slots.size(); s++)
+			{
+				for (int i = 0; i < profileStageCount; i++) ticks[i] += slots[s]->ticks[i].load(std::memory_order_relaxed);
+				for (int i = 0; i < profileCounterCount; i++) counts[i] += slots[s]->counts[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		double scale = msPerTick();
+		for (int i = 0; i < profileStageCount; i++)
+		{
+			frame.stageMs[i] = (ticks[i] - lastTicks[i]) * scale;
+			lastTicks[i] = ticks[i];
+		}
+		for (int i = 0; i < profileCounterCount; i++)
+		{
+			frame.counts[i] = counts[i] - lastCounts[i];
+			lastCounts[i] = counts[i];
+		}
+
+		if (history.size() < profileHistory) history.push_back(frame);
+		else history[next] = frame;
+		next = (next + 1) % profileHistory;
+	}
+
+	// Frames in the ring buffer, oldest first
+	size_t frameCount() const { return history.size(); }
+	const ProfileFrame& frame(size_t i) const
+	{
+		return history.size() < profileHistory ? history[i] : history[(next + i) % profileHistory];
+	}
+
+	const ProfileFrame* lastFrame() const { return history.empty() ? nullptr : &frame(history.size() - 1); }
+
+	// Mean of the frames in the ring buffer
+	ProfileFrame average() const
+	{
+		ProfileFrame mean;
+		if (history.empty()) return mean;
+		for (size_t f = 0; f < history.size(); f++)
+		{
+			mean.frameMs += history[f].frameMs;
+			for (int i = 0; i < profileStageCount; i++) mean.stageMs[i] += history[f].stageMs[i];
+			for (int i = 0; i < profileCounterCount; i++) mean.counts[i] += history[f].counts[i];
+		}
+		mean.frame = history.size();
+		mean.frameMs /= history.size();
+		for (int i = 0; i < profileStageCount; i++) mean.stageMs[i] /= history.size();
+		for (int i = 0; i < profileCounterCount; i++) mean.counts[i] /= history.size();
+		return mean;
+	}
+
+	void writeCsv(std::ostream &out) const
+	{
+		out << "frame,frame_ms";
+		for (int i = 0; i < profileStageCount; i++) out << "," << profileStageName(i) << "_ms";
+		for (int i = 0; i < profileCounterCount; i++) out << "," << profileCounterName(i);
+		out << "\n";
+
+		for (size_t f = 0; f < frameCount(); f++)
+		{
+			const ProfileFrame &entry = frame(f);
+			out << entry.frame << "," << entry.frameMs;
+			for (int i = 0; i < profileStageCount; i++) out << "," << entry.stageMs[i];
+			for (int i = 0; i < profileCounterCount; i++) out << "," << entry.counts[i];
+			out << "\n";
+		}
+	}
+
+	void writeJson(std::ostream &out) const
+	{
+		out << "{\"frames\": [\n";
+		for (size_t f = 0; f < frameCount(); f++)
+		{
+			const ProfileFrame &entry = frame(f);
+			out << "  {\"frame\": " << entry.frame << ", \"frame_ms\": " << entry.frameMs;
+			for (int i = 0; i < profileStageCount; i++) out << ", \"" << profileStageName(i) << "_ms\": " << entry.stageMs[i];
+			for (int i = 0; i < profileCounterCount; i++) out << ", \"" << profileCounterName(i) << "\": " << entry.counts[i];
+			out << (f + 1 < frameCount() ? "},\n" : "}\n");
+		}
+		out << "]}\n";
+	}
+
+	// CSV if the path ends in .csv, JSON otherwise
+	void write(std::ostream &out, const std::string &path) const
+	{
+		if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".csv") == 0) writeCsv(out);
+		else writeJson(out);
+	}
+
+	// Returns false if the file can't be written
+	bool save(const std::string &path) const
+	{
+		std::ofstream out(path.c_str());
+		if (!out) return false;
+		write(out, path);
+		return (bool)out;
+	}
+};
+
+Profiler& profiler()
+{
+	static Profiler instance;
+	return instance;
+}
+
+// The calling thread's slot, registered on first use
+inline ProfileSlot& profileSlot()
+{
+	static thread_local ProfileSlot *slot = nullptr;
+	if (!slot) slot = profiler().registerThread();
+	return *slot;
+}
+
+// Adds the time until the end of the enclosing block to a stage
+class ProfileScope
+{
+private:
+	ProfileStage stage;
+	uint64_t start;
+	bool active;
+
+public:
+	explicit ProfileScope(ProfileStage s) : stage(s), start(0), active(profiling)
+	{
+		if (active) start = profileTicks();
+	}
+
+	~ProfileScope()
+	{
+		if (active) ProfileSlot::add(profileSlot().ticks[(int)stage], profileTicks() - start);
+	}
+};
+
+inline void profileCount(ProfileCounter counter, uint64_t n)
+{
+	if (profiling) ProfileSlot::add(profileSlot().counts[(int)counter], n);
+}
+
+#if WT_PROFILE
+#define WT_PROFILE_SCOPE(stage) ProfileScope profileScope(ProfileStage::stage)
+#define WT_PROFILE_COUNT(counter, n) profileCount(ProfileCounter::counter, (n))
+#else
+#define WT_PROFILE_SCOPE(stage) ((void)0)
+#define WT_PROFILE_COUNT(counter, n) ((void)0)
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 #include "geometry.h"
+#include <cfloat>
 
 // Adapted from https://github.com/ssloy/tinyraytracer
 
@@ -13,15 +14,18 @@ struct Ray
 };
 
 struct Light {
-	Light(const vec3 &p, const float &i) : position(p), intensity(i) {}
+	Light(const vec3 &p, const float &i, const float &r = FLT_MAX) : position(p), intensity(i), range(r) {}
 	vec3 position;
 	float intensity;
+	float range;		// distance at which the light has faded out (see lights.h); FLT_MAX for no limit
 };
 
 struct Material {
-	Material(const vec2 &a, const vec3 &color, const float &spec) : albedo(a), diffuse_color(color), specular_exponent(spec) {}
-	Material() : albedo(1, 0), diffuse_color(), specular_exponent() {}
-	vec2 albedo;
+	Material(const float &r, const vec4 &a, const vec3 &color, const float &spec) : refractive_index(r), albedo(a), diffuse_color(color), specular_exponent(spec) {}
+	Material(const vec2 &a, const vec3 &color, const float &spec) : refractive_index(1), albedo(a[0], a[1], 0, 0), diffuse_color(color), specular_exponent(spec) {}
+	Material() : refractive_index(1), albedo(1, 0, 0, 0), diffuse_color(), specular_exponent() {}
+	float refractive_index;
+	vec4 albedo;		// weights of the diffuse, specular, reflected and refracted light
 	vec3 diffuse_color;
 	float specular_exponent;
 };
@@ -47,7 +51,7 @@ struct Sphere {
 		return true;
 	}
 
-	bool ray_intersect(Ray ray, float &outDistance) const {
+	bool ray_intersect(const Ray &ray, float &outDistance) const {
 		vec3 L = center - ray.origin;
 		float tca = L * ray.direction;
 		float d2 = L * L - tca * tca;
@@ -0,0 +1,466 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+// Recorded frames.
+//
+// A recording holds the glyphs of a run of frames, one byte per cell, as segments: a keyframe
+// followed by deltas, each frame run-length encoded.  A keyframe is the cells themselves and a
+// delta is the cells XORed with the frame before, which is zero wherever nothing changed.  A
+// segment ends after keyframeInterval frames, or when the next frame would take it past an
+// eighth of the space for frames, and is then written out whole.
+//
+// The file is a header, an index with an entry per segment, and a fixed amount of space for
+// segments that is used as a ring: segments are written one after the other, and once the end
+// is reached the next starts over at the beginning, overwriting the oldest.  So the file never
+// grows past the size it was opened with and a long recording keeps its latest frames.  The
+// index entry of a segment is written after it, and those of the segments it overwrites are
+// cleared before, so the file can be played while it is still being written.  The writer only
+// keeps the segment it is filling and the last frame, and the reader the segment it is playing.
+
+const char recordingMagic[8] = { 'W', 'T', 'F', 'R', 'A', 'M', 'E', 'S' };
+
+// Bumped whenever the layout of a recording changes; older files are refused
+const uint32_t recordingVersion = 1;
+
+// Written as 0x01020304 so files from a machine with a different byte order are refused
+const uint32_t recordingByteOrder = 0x01020304;
+
+// Entries in the index: the most segments a recording keeps
+const uint32_t recordingIndexSize = 4096;
+
+struct RecordingHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t headerSize;
+	uint32_t width;
+	uint32_t height;
+	uint32_t keyframeInterval;
+	uint32_t indexSize;			// entries
+	uint32_t reserved;
+	uint64_t dataOffset;		// of the space for segments, after the index
+	uint64_t capacity;			// bytes of it
+};
+
+struct RecordingSegment
+{
+	uint64_t sequence;			// order the segments were written in, from 1; 0 for an unused entry
+	uint64_t offset;			// in the space for segments
+	uint64_t bytes;				// frames: a 32 bit length and the encoded frame each
+	uint32_t firstFrame;
+	uint32_t frameCount;
+};
+
+// PackBits run-length encoding: a control byte n below 128 is followed by n + 1 bytes to copy,
+// and one of 128 or above by a byte to repeat n - 125 times.  Never more than count / 128 + 1
+// bytes longer than the input.
+void packRuns(const uint8_t *data, size_t count, std::vector<uint8_t> &out)
+{
+	out.clear();
+	size_t i = 0;
+	while (i < count)
+	{
+		size_t run = 1;
+		while (i + run < count && run < 130 && data[i + run] == data[i]) run++;
+		if (run >= 3)
+		{
+			out.push_back((uint8_t)(run + 125));
+			out.push_back(data[i]);
+			i += run;
+			continue;
+		}
+
+		// copy up to the next run of three
+		size_t start = i;
+		while (i < count && i - start < 128)
+		{
+			if (i + 2 < count && data[i] == data[i + 1] && data[i] == data[i + 2]) break;
+			i++;
+		}
+		out.push_back((uint8_t)(i - start - 1));
+		out.insert(out.end(), data + start, data + i);
+	}
+}
+
+// Decodes exactly count bytes into out; false if the data is damaged
+bool unpackRuns(const uint8_t *data, size_t bytes, uint8_t *out, size_t count)
+{
+	size_t read = 0, written = 0;
+	while (read < bytes)
+	{
+		int control = data[read++];
+		if (control < 128)
+		{
+			size_t length = control + 1;
+			if (read + length > bytes || written + length > count) return false;
+			std::memcpy(out + written, data + read, length);
+			read += length;
+			written += length;
+		}
+		else
+		{
+			size_t length = control - 125;
+			if (read >= bytes || written + length > count) return false;
+			std::memset(out + written, data[read++], length);
+			written += length;
+		}
+	}
+	return written == count;
+}
+
+class RecordingWriter
+{
+private:
+	std::ofstream out;
+	std::string path;
+	RecordingHeader header;
+	uint64_t maxSegment = 0;				// bytes of frames a segment ends before
+
+	RecordingSegment segment;				// the segment being filled
+	std::vector<uint8_t> payload;
+	std::vector<RecordingSegment> live;		// segments in the file, oldest first
+	uint64_t writeOffset = 0;				// where the next segment goes
+	uint64_t dataEnd = 0;					// furthest any segment reached
+
+	std::vector<uint8_t> previous;			// the last frame's cells
+	std::vector<uint8_t> current;
+	std::vector<uint8_t> packed;
+
+	uint64_t frames = 0;
+	uint64_t keyframes = 0;
+	uint64_t encodedBytes = 0;
+
+	void writeEntry(const RecordingSegment &entry, uint64_t sequence)
+	{
+		out.seekp((std::streamoff)(header.headerSize + (sequence - 1) % header.indexSize * sizeof(RecordingSegment)));
+		out.write((const char*)&entry, sizeof(entry));
+	}
+
+	bool writeSegment(std::string &error)
+	{
+		if (segment.frameCount == 0) return true;
+
+		// start over at the beginning when it doesn't fit before the end
+		uint64_t skipped = header.capacity;
+		if (writeOffset + payload.size() > header.capacity)
+		{
+			skipped = writeOffset;
+			writeOffset = 0;
+		}
+		segment.offset = writeOffset;
+		segment.bytes = payload.size();
+
+		// drop the segments this one overwrites, those in the end part skipped when starting
+		// over, and the one whose index entry it takes; oldest first, which is also the order
+		// they come up in after the last segment written
+		while (!live.empty())
+		{
+			const RecordingSegment &oldest = live.front();
+			bool overwritten = oldest.offset < segment.offset + segment.bytes && segment.offset < oldest.offset + oldest.bytes;
+			if (!overwritten && oldest.offset < skipped && oldest.sequence + header.indexSize > segment.sequence) break;
+
+			RecordingSegment cleared;
+			std::memset(&cleared, 0, sizeof(cleared));
+			writeEntry(cleared, oldest.sequence);
+			live.erase(live.begin());
+		}
+
+		out.seekp((std::streamoff)(header.dataOffset + segment.offset));
+		out.write((const char*)payload.data(), payload.size());
+		writeEntry(segment, segment.sequence);
+		out.flush();
+		if (!out)
+		{
+			error = "can't write " + path;
+			return false;
+		}
+
+		live.push_back(segment);
+		writeOffset = segment.offset + segment.bytes;
+		dataEnd = std::max(dataEnd, writeOffset);
+		segment.sequence++;
+		segment.frameCount = 0;
+		payload.clear();
+		return true;
+	}
+
+public:
+	// Largest segment that holds a keyframe of width x height and a delta after it
+	static uint64_t minimumSegment(int width, int height)
+	{
+		uint64_t cells = (uint64_t)width * height;
+		return 2 * (sizeof(uint32_t) + cells + cells / 128 + 1);
+	}
+
+	// Start a recording of width x height frames at path that never takes up more than
+	// maxBytes, with a keyframe at least every keyframeInterval frames
+	bool open(const std::string &file, int width, int height, int keyframeInterval, uint64_t maxBytes, std::string &error)
+	{
+		uint64_t dataOffset = sizeof(RecordingHeader) + recordingIndexSize * sizeof(RecordingSegment);
+		uint64_t capacity = maxBytes > dataOffset ? maxBytes - dataOffset : 0;
+		maxSegment = std::max(capacity / 8, minimumSegment(width, height));
+		if (capacity < 2 * maxSegment)
+		{
+			error = "not enough room for a recording of this size; allow at least " + std::to_string((dataOffset + 2 * maxSegment + (1 << 20) - 1) >> 20) + " MB";
+			return false;
+		}
+
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, recordingMagic, sizeof(header.magic));
+		header.version = recordingVersion;
+		header.byteOrder = recordingByteOrder;
+		header.headerSize = sizeof(RecordingHeader);
+		header.width = width;
+		header.height = height;
+		header.keyframeInterval = keyframeInterval;
+		header.indexSize = recordingIndexSize;
+		header.dataOffset = dataOffset;
+		header.capacity = capacity;
+
+		// an empty index
+		path = file;
+		out.open(path.c_str(), std::ios::binary | std::ios::trunc);
+		out.write((const char*)&header, sizeof(header));
+		std::vector<char> index(recordingIndexSize * sizeof(RecordingSegment), 0);
+		out.write(index.data(), index.size());
+		if (!out)
+		{
+			error = "can't write " + path;
+			return false;
+		}
+
+		std::memset(&segment, 0, sizeof(segment));
+		segment.sequence = 1;
+		payload.reserve(maxSegment);
+		previous.assign((size_t)width * height, 0);
+		current.resize(previous.size());
+		return true;
+	}
+
+	// Add the frame after the last one; frames are numbered on from the first one's number
+	bool append(const wchar_t *cells, uint32_t frameNumber, std::string &error)
+	{
+		for (size_t i = 0; i < current.size(); i++) current[i] = (uint8_t)cells[i];
+
+		bool keyframe = segment.frameCount == 0;
+		if (!keyframe)
+		{
+			for (size_t i = 0; i < current.size(); i++) previous[i] ^= current[i];
+			packRuns(previous.data(), previous.size(), packed);
+
+			// start the next segment instead, with this frame as its keyframe
+			if (segment.frameCount >= header.keyframeInterval || payload.size() + sizeof(uint32_t) + packed.size() > maxSegment)
+			{
+				if (!writeSegment(error)) return false;
+				keyframe = true;
+			}
+		}
+		if (keyframe)
+		{
+			packRuns(current.data(), current.size(), packed);
+			segment.firstFrame = frameNumber;
+			keyframes++;
+		}
+
+		uint32_t length = (uint32_t)packed.size();
+		payload.insert(payload.end(), (const uint8_t*)&length, (const uint8_t*)&length + sizeof(length));
+		payload.insert(payload.end(), packed.begin(), packed.end());
+		segment.frameCount++;
+
+		previous.swap(current);
+		frames++;
+		encodedBytes += sizeof(uint32_t) + packed.size();
+		return true;
+	}
+
+	// Write out the last segment
+	bool close(std::string &error)
+	{
+		if (!writeSegment(error)) return false;
+		out.close();
+		return true;
+	}
+
+	uint64_t getFrames() const { return frames; }
+	uint64_t getKeyframes() const { return keyframes; }
+	uint64_t getEncodedBytes() const { return encodedBytes; }
+
+	// Bytes the file takes up so far
+	uint64_t fileSize() const { return header.dataOffset + dataEnd; }
+};
+
+class RecordingReader
+{
+private:
+	std::ifstream in;
+	RecordingHeader header;
+	std::vector<RecordingSegment> segments;		// by sequence, which is also by frame
+
+	size_t position = 0;						// segment playing
+	std::vector<uint8_t> payload;
+	size_t offset = 0;							// of its next frame
+	uint32_t frameNumber = 0;
+	std::vector<uint8_t> cells;
+	std::vector<uint8_t> unpacked;
+
+	bool load(size_t segmentPosition, std::string &error)
+	{
+		const RecordingSegment &segment = segments[segmentPosition];
+		payload.resize(segment.bytes);
+		in.clear();
+		in.seekg((std::streamoff)(header.dataOffset + segment.offset));
+		in.read((char*)payload.data(), payload.size());
+		if (!in)
+		{
+			error = "truncated recording";
+			return false;
+		}
+
+		position = segmentPosition;
+		offset = 0;
+		frameNumber = segment.firstFrame;
+		return decode(true, error);
+	}
+
+	// Decode the frame at offset over the last one
+	bool decode(bool keyframe, std::string &error)
+	{
+		uint32_t length;
+		if (offset + sizeof(length) > payload.size())
+		{
+			error = "damaged recording";
+			return false;
+		}
+		std::memcpy(&length, &payload[offset], sizeof(length));
+		offset += sizeof(length);
+		if (length > payload.size() - offset || !unpackRuns(&payload[offset], length, unpacked.data(), unpacked.size()))
+		{
+			error = "damaged recording";
+			return false;
+		}
+		offset += length;
+
+		if (keyframe) cells.swap(unpacked);
+		else
+		{
+			for (size_t i = 0; i < cells.size(); i++) cells[i] ^= unpacked[i];
+		}
+		return true;
+	}
+
+public:
+	// Read the header and the index, and decode the first frame
+	bool open(const std::string &path, std::string &error)
+	{
+		in.open(path.c_str(), std::ios::binary);
+		if (!in)
+		{
+			error = "can't read " + path;
+			return false;
+		}
+
+		in.read((char*)&header, sizeof(header));
+		if (!in || std::memcmp(header.magic, recordingMagic, sizeof(header.magic)) != 0)
+		{
+			error = path + " isn't a recording";
+			return false;
+		}
+		if (header.version != recordingVersion || header.byteOrder != recordingByteOrder || header.headerSize != sizeof(header))
+		{
+			error = path + " was recorded by a different version or on a different kind of machine";
+			return false;
+		}
+		uint64_t cellCount = (uint64_t)header.width * header.height;
+		if (header.width == 0 || header.height == 0 || cellCount > (1u << 26) || header.indexSize == 0 || header.indexSize > (1u << 20) ||
+			header.dataOffset != header.headerSize + (uint64_t)header.indexSize * sizeof(RecordingSegment))
+		{
+			error = "damaged recording";
+			return false;
+		}
+
+		std::vector<RecordingSegment> index(header.indexSize);
+		in.read((char*)index.data(), index.size() * sizeof(RecordingSegment));
+		if (!in)
+		{
+			error = "truncated recording";
+			return false;
+		}
+		for (size_t i = 0; i < index.size(); i++)
+		{
+			const RecordingSegment &segment = index[i];
+			if (segment.sequence == 0) continue;
+			if (segment.frameCount == 0 || segment.offset > header.capacity || segment.bytes > header.capacity - segment.offset)
+			{
+				error = "damaged recording";
+				return false;
+			}
+			segments.push_back(segment);
+		}
+		if (segments.empty())
+		{
+			error = path + " has no frames";
+			return false;
+		}
+		std::sort(segments.begin(), segments.end(), [](const RecordingSegment &a, const RecordingSegment &b) { return a.sequence < b.sequence; });
+
+		cells.resize(cellCount);
+		unpacked.resize(cellCount);
+		return load(0, error);
+	}
+
+	int getWidth() const { return (int)header.width; }
+	int getHeight() const { return (int)header.height; }
+
+	// First and last frame still in the recording (older ones are overwritten once it wraps)
+	uint32_t firstFrame() const { return segments.front().firstFrame; }
+	uint32_t lastFrame() const { return segments.back().firstFrame + segments.back().frameCount - 1; }
+	size_t keyframeCount() const { return segments.size(); }
+
+	// The frame decoded last and its number
+	const uint8_t* getCells() const { return cells.data(); }
+	uint32_t getFrameNumber() const { return frameNumber; }
+
+	// Decode the next frame; false at the end (error empty) or on a damaged file
+	bool next(std::string &error)
+	{
+		error.clear();
+		const RecordingSegment &segment = segments[position];
+		if (frameNumber + 1 < segment.firstFrame + segment.frameCount)
+		{
+			frameNumber++;
+			return decode(false, error);
+		}
+		if (position + 1 >= segments.size()) return false;
+		return load(position + 1, error);
+	}
+
+	// Go to a frame: to the keyframe before it, then forward; frames outside the recording go
+	// to its first or last frame
+	bool seek(uint32_t frame, std::string &error)
+	{
+		frame = std::min(std::max(frame, firstFrame()), lastFrame());
+
+		size_t found = segments.size() - 1;
+		while (found > 0 && segments[found].firstFrame > frame) found--;
+		if (!load(found, error)) return false;
+		while (frameNumber < frame)
+		{
+			if (!next(error)) return false;
+		}
+		return true;
+	}
+
+	// Go to the keyframe steps segments on (or back, for a negative step) from the current one
+	bool seekKeyframe(int steps, std::string &error)
+	{
+		long long target = (long long)position + steps;
+		target = std::min(std::max(target, 0ll), (long long)segments.size() - 1);
+		return load((size_t)target, error);
+	}
+};
@@ -0,0 +1,817 @@
+#pragma once
+#include "geometry.h"
+#include "raytracing.h"
+#include "threadpool.h"
+#include "spheres.h"
+#include "mesh.h"
+#include "grid.h"
+#include "lights.h"
+#include "color.h"
+#include "camera.h"
+#include "profile.h"
+#include "precision.h"
+#include <vector>
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <memory>
+#include <cstring>
+
+// Character shading
+char shadingTable[] =
+{ ' ', '.', ':', '-', '=', '+', '*', '#', '%', '@' };
+
+// Doesn't work well for the standard console window size but might work better if you make the
+// window huge
+char extendedShadingTable[] =
+{
+	' ', '\'', '`', '^', '\"', ',', ':', ';', 'I', 'l', '!', 'i', '>',
+	'<', '~', '+', '_', '-', '?', ']', '[', '}', '{', '1', ')', '(', '|',
+	'\\', '/', 't', 'f', 'j', 'r', 'x', 'n', 'u', 'v', 'c', 'z',
+	'X', 'Y', 'U', 'J', 'C', 'L', 'Q', '0', 'O', 'Z', 'm', 'w',
+	'q', 'p', 'd', 'b', 'k', 'h', 'a', 'o', '*', '#', 'M', 'W', '&', '8',
+	'%', 'B', '@', '$'
+};
+
+// Lookup shading character by 0-1 float value
+char getShadingChar(float value)
+{
+	size_t n = sizeof(shadingTable) / sizeof(shadingTable[0]);
+
+	// value remap to index
+	int i = value * n;
+	// correct for outside of 0-1 range
+	if (i < 0) i = 0;
+	if (i >= (int)n) i = n - 1;
+
+	return shadingTable[i];
+}
+
+// Which of the tables above glyphs are picked from (only --subcells uses the extended table)
+enum class GlyphTable
+{
+	Basic,
+	Extended
+};
+
+const char* glyphTableName(GlyphTable table)
+{
+	return table == GlyphTable::Extended ? "extended" : "basic";
+}
+
+// Parses "basic" or "extended"; returns false for anything else
+bool parseGlyphTable(const char *name, GlyphTable &table)
+{
+	std::string value(name);
+	if (value == "basic") table = GlyphTable::Basic;
+	else if (value == "extended") table = GlyphTable::Extended;
+	else return false;
+	return true;
+}
+
+// How rays find the spheres they hit
+enum class Accel
+{
+	Auto,		// BVH once there are enough spheres for it to pay off
+	Linear,		// test every sphere
+	BVH,
+	Grid		// uniform grid that is cheap to update as spheres move (see grid.h)
+};
+
+// Scenes with more spheres than this get a BVH when the acceleration structure is Auto
+const size_t autoBvhThreshold = 32;
+
+const char* accelName(Accel accel)
+{
+	switch (accel)
+	{
+	case Accel::Linear: return "linear";
+	case Accel::BVH: return "bvh";
+	case Accel::Grid: return "grid";
+	default: return "auto";
+	}
+}
+
+// Parses "auto", "linear", "bvh" or "grid"; returns false for anything else
+bool parseAccel(const char *name, Accel &accel)
+{
+	std::string value(name);
+	if (value == "auto") accel = Accel::Auto;
+	else if (value == "linear") accel = Accel::Linear;
+	else if (value == "bvh") accel = Accel::BVH;
+	else if (value == "grid") accel = Accel::Grid;
+	else return false;
+	return true;
+}
+
+// Everything that gets rendered
+struct Scene
+{
+	std::vector<Sphere> spheres;
+	std::vector<Mesh> meshes;
+	std::vector<Light> lights;
+	Accel accel = Accel::Auto;
+
+	// Packed copies of spheres for the intersection kernels, built by commit(); with a BVH the
+	// spheres are stored in leaf order
+	SphereSoA sphereData;
+	MappedArray<Material> materials;
+	BVH bvh;
+	SphereGrid grid;
+
+	// Culling structure over the lights, built by commit() and commitLights()
+	LightTree lightTree;
+
+	// Shadow rays per shading point when sampling lights at random; 0 shades every light that
+	// reaches the point
+	int lightSamples = 0;
+	std::vector<MeshData> meshData;		// one per mesh
+
+	// Set for scenes loaded from a compiled scene file: spheres is empty and the packed data,
+	// materials and BVH above view the mapped file
+	bool compiled = false;
+	std::shared_ptr<MappedFile> file;
+	size_t sphereMaterialCount = 0;
+
+	// bumped by commit(), so anything derived from the spheres can tell when it is out of date
+	uint64_t version = 0;
+
+	bool usesBvh() const { return accel == Accel::BVH || (accel == Accel::Auto && spheres.size() > autoBvhThreshold); }
+
+	// Call after changing spheres or meshes
+	void commit()
+	{
+		if (!compiled)
+		{
+			std::vector<int> order;
+			bvh = BVH();
+			if (usesBvh())
+			{
+				bvh.build(sphereBounds(spheres), SphereSoA::blockSize, 1, order);
+			}
+			else
+			{
+				for (size_t i = 0; i < spheres.size(); i++) order.push_back((int)i);
+			}
+
+			packSpheres(spheres, order, sphereData, materials);
+			sphereMaterialCount = materials.size();
+		}
+		else
+		{
+			// drop the materials of meshes from before
+			materials.resize(sphereMaterialCount);
+		}
+
+		grid = SphereGrid();
+		if (accel == Accel::Grid) grid.build(sphereData);
+		lightTree.build(lights);
+
+		meshData.assign(meshes.size(), MeshData());
+		for (size_t i = 0; i < meshes.size(); i++)
+		{
+			buildMeshData(meshes[i], meshData[i]);
+			meshData[i].material = (int)materials.size();
+			materials.push_back(meshes[i].material);
+		}
+
+		version++;
+	}
+
+	// Call after changing lights
+	void commitLights()
+	{
+		lightTree.build(lights);
+	}
+
+	// Move sphere i.  Without a BVH its packed copy and grid cells are updated on the spot;
+	// call commitMoves() once everything has moved.  Not for compiled scenes.
+	void moveSphere(size_t i, const vec3 &center)
+	{
+		spheres[i].center = center;
+		if (usesBvh()) return;
+
+		sphereData.cx[i] = center.x;
+		sphereData.cy[i] = center.y;
+		sphereData.cz[i] = center.z;
+		if (!grid.empty()) grid.move(sphereData, (int)i);
+	}
+
+	// Finish a round of moveSphere() calls; a BVH is rebuilt from scratch
+	void commitMoves()
+	{
+		if (usesBvh()) commit();
+		else version++;
+	}
+};
+
+// The scene the application has always shown
+Scene makeDefaultScene()
+{
+	Scene scene;
+
+	// Create some materials
+	Material shiny(vec2(0.6, 0.3), vec3(0.4, 0.4, 0.3), 50.);
+	Material dull(vec2(0.9, 0.1), vec3(0.3, 0.1, 0.1), 10.);
+
+	// Create some spheres to render
+	scene.spheres.push_back(Sphere(vec3(1.5, 0.5, -18), 3, dull));
+	scene.spheres.push_back(Sphere(vec3(-6, 0, -16), 2, shiny));
+	scene.spheres.push_back(Sphere(vec3(-2.5, 2.5, -12), 2, dull));
+	scene.spheres.push_back(Sphere(vec3(7, 5, -18), 4, shiny));
+
+	// Add a light
+	scene.lights.push_back(Light(vec3(-20, 20, 20), 1.5));
+
+	scene.commit();
+	return scene;
+}
+
+// The tinyraytracer scene: reflective and refractive spheres, for rendering with more than one bounce
+Scene makeReflectionScene()
+{
+	Scene scene;
+
+	Material ivory(1.0, vec4(0.6, 0.3, 0.1, 0.0), vec3(0.4, 0.4, 0.3), 50.);
+	Material glass(1.5, vec4(0.0, 0.5, 0.1, 0.8), vec3(0.6, 0.7, 0.8), 125.);
+	Material red_rubber(1.0, vec4(0.9, 0.1, 0.0, 0.0), vec3(0.3, 0.1, 0.1), 10.);
+	Material mirror(1.0, vec4(0.0, 10.0, 0.8, 0.0), vec3(1.0, 1.0, 1.0), 1425.);
+
+	scene.spheres.push_back(Sphere(vec3(-3, 0, -16), 2, ivory));
+	scene.spheres.push_back(Sphere(vec3(-1.0, -1.5, -12), 2, glass));
+	scene.spheres.push_back(Sphere(vec3(1.5, -0.5, -18), 3, red_rubber));
+	scene.spheres.push_back(Sphere(vec3(7, 5, -18), 4, mirror));
+
+	scene.lights.push_back(Light(vec3(-20, 20, 20), 1.5));
+	scene.lights.push_back(Light(vec3(30, 50, -25), 1.8));
+	scene.lights.push_back(Light(vec3(30, 20, 30), 1.7));
+
+	scene.commit();
+	return scene;
+}
+
+// Scenes that can be picked by name on the command line
+bool isBuiltinScene(const std::string &name)
+{
+	return name == "default" || name == "reflections";
+}
+
+Scene makeBuiltinScene(const std::string &name)
+{
+	return name == "reflections" ? makeReflectionScene() : makeDefaultScene();
+}
+
+// Small deterministic random number generator (xorshift32), so generated scenes are the
+// same on every platform
+struct Random
+{
+	uint32_t state;
+
+	explicit Random(uint32_t seed) : state(seed ? seed : 1) {}
+
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	// uniform in [lo, hi)
+	float range(float lo, float hi) { return lo + (hi - lo) * (next() >> 8) * (1.f / 16777216.f); }
+};
+
+// count small spheres scattered in front of the camera, for measuring larger scenes
+Scene makeRandomScene(int count, uint32_t seed = 1)
+{
+	Scene scene;
+	Random random(seed);
+
+	Material shiny(vec2(0.6, 0.3), vec3(0.4, 0.4, 0.3), 50.);
+	Material dull(vec2(0.9, 0.1), vec3(0.3, 0.1, 0.1), 10.);
+
+	// keep the density roughly constant as the count grows
+	float extent = 10.f * std::cbrt(std::max(count, 1) / 100.f);
+	for (int i = 0; i < count; i++)
+	{
+		vec3 center(random.range(-2.f * extent, 2.f * extent), random.range(-extent, extent), random.range(-10.f - 3.f * extent, -10.f));
+		float radius = random.range(.2f, 1.f);
+		scene.spheres.push_back(Sphere(center, radius, (random.next() & 1) ? shiny : dull));
+	}
+
+	scene.lights.push_back(Light(vec3(-20, 20, 20), 1.5));
+
+	scene.commit();
+	return scene;
+}
+
+// Replace the scene's lights with count lights of limited range scattered through the space in
+// front of the camera.  Ranges shrink as the count grows, so a point is reached by about the
+// same number of lights whatever the count.
+void makeRandomLights(Scene &scene, int count, uint32_t seed = 7)
+{
+	Random random(seed);
+	const vec3 lo(-20, -5, -40), hi(20, 15, 0);
+	const float reachingEachPoint = 8;
+
+	vec3 size = hi - lo;
+	float range = std::cbrt(reachingEachPoint * size.x * size.y * size.z * 3 / (4 * 3.14159265f * count));
+
+	scene.lights.clear();
+	for (int i = 0; i < count; i++)
+	{
+		vec3 position(random.range(lo.x, hi.x), random.range(lo.y, hi.y), random.range(lo.z, hi.z));
+		scene.lights.push_back(Light(position, .5f, range));
+	}
+	scene.commitLights();
+}
+
+// Number of rays traced, for throughput reporting
+struct RayStats
+{
+	uint64_t primaryRays = 0;
+	uint64_t secondaryRays = 0;		// reflected and refracted
+	uint64_t shadowRays = 0;
+
+	uint64_t total() const { return primaryRays + secondaryRays + shadowRays; }
+
+	RayStats& operator+=(const RayStats &rhs)
+	{
+		primaryRays += rhs.primaryRays;
+		secondaryRays += rhs.secondaryRays;
+		shadowRays += rhs.shadowRays;
+		return *this;
+	}
+};
+
+// the rest of scene_intersect once the nearest sphere (or -1) and its distance are known:
+// meshes in front of it, then the hit point, normal and material
+template <typename Math = ExactMath>
+bool finish_intersect(const vec3 &orig, const vec3 &dir, const Scene &scene, int nearest, float spheres_dist, vec3 &hit, vec3 &N, const Material *&material) {
+	const SphereSoA &spheres = scene.sphereData;
+
+	// any mesh triangle in front of that sphere
+	int nearestMesh = -1, nearestTriangle = -1;
+	for (size_t m = 0; m < scene.meshData.size(); m++)
+	{
+		int triangle = scene.meshData[m].intersect(orig, dir, spheres_dist);
+		if (triangle >= 0)
+		{
+			nearestMesh = (int)m;
+			nearestTriangle = triangle;
+		}
+	}
+
+	if (nearestMesh >= 0)
+	{
+		const MeshData &mesh = scene.meshData[nearestMesh];
+		hit = orig + dir * spheres_dist;
+		N = mesh.normal(scene.meshes[nearestMesh], nearestTriangle, orig, dir);
+		material = &scene.materials[mesh.material];
+		WT_PROFILE_COUNT(Hits, 1);
+		return true;
+	}
+
+	if (nearest < 0) return false;
+
+	hit = orig + dir * spheres_dist;
+	N = Math::normalize(hit - spheres.center(nearest));
+	material = &scene.materials[spheres.material[nearest]];
+	WT_PROFILE_COUNT(Hits, 1);
+	return true;
+}
+
+// check scene objects for intersections; bin, if given, holds every sphere the ray can hit
+// (see binning.h) and is searched instead of the whole scene
+template <typename Math = ExactMath>
+bool scene_intersect(const vec3 &orig, const vec3 &dir, const Scene &scene, const SphereBin *bin, vec3 &hit, vec3 &N, const Material *&material) {
+	WT_PROFILE_SCOPE(Intersect);
+	WT_PROFILE_COUNT(Rays, 1);
+	const SphereSoA &spheres = scene.sphereData;
+
+	// find the closest sphere first, then do the hit point/normal/material work once; hits
+	// beyond 1000 don't count, so nothing further away needs to be looked at
+	float spheres_dist = 1000;
+	int nearest = -1;
+	if (bin)
+	{
+		WT_PROFILE_COUNT(SphereTests, bin->spheres.paddedCount());
+		nearest = bin->closest(orig, dir, spheres_dist);
+	}
+	else if (!scene.grid.empty())
+	{
+		nearest = scene.grid.closest(spheres, orig, dir, spheres_dist);
+	}
+	else if (scene.bvh.empty())
+	{
+		WT_PROFILE_COUNT(SphereTests, spheres.paddedCount());
+		nearest = sphereKernels.closest(spheres, 0, spheres.paddedCount(), orig, dir, spheres_dist);
+	}
+	else
+	{
+		scene.bvh.traverse(orig, dir, spheres_dist, [&](int first, int count, float &tMax)
+		{
+			WT_PROFILE_COUNT(SphereTests, count);
+			int leafNearest = sphereKernels.closest(spheres, first, first + count, orig, dir, tMax);
+			if (leafNearest >= 0) nearest = leafNearest;
+			return false;
+		});
+	}
+
+	return finish_intersect<Math>(orig, dir, scene, nearest, spheres_dist, hit, N, material);
+}
+
+// check all scene objects for intersections
+template <typename Math = ExactMath>
+bool scene_intersect(const vec3 &orig, const vec3 &dir, const Scene &scene, vec3 &hit, vec3 &N, const Material *&material) {
+	return scene_intersect<Math>(orig, dir, scene, nullptr, hit, N, material);
+}
+
+// Is any mesh triangle hit nearer than maxDistance?
+bool meshes_occluded(const vec3 &orig, const vec3 &dir, float maxDistance, const Scene &scene)
+{
+	for (size_t m = 0; m < scene.meshData.size(); m++)
+	{
+		if (scene.meshData[m].occluded(orig, dir, maxDistance)) return true;
+	}
+	return false;
+}
+
+// Shadow ray for an occlusion query: is anything between orig and orig + dir * maxDistance?
+struct ShadowRay
+{
+	vec3 orig;
+	vec3 dir;
+	float maxDistance;
+};
+
+// Rays answered together by scene_occluded_batch
+const int maxShadowBatch = 32;
+
+// Any-hit query: stops at the first blocker found and does no hit point, normal or material work
+bool scene_occluded(const vec3 &orig, const vec3 &dir, float maxDistance, const Scene &scene)
+{
+	const SphereSoA &spheres = scene.sphereData;
+
+	if (!scene.grid.empty())
+		return scene.grid.any(spheres, orig, dir, maxDistance) || meshes_occluded(orig, dir, maxDistance, scene);
+
+	if (scene.bvh.empty())
+	{
+		WT_PROFILE_COUNT(SphereTests, spheres.paddedCount());
+		return sphereKernels.any(spheres, 0, spheres.paddedCount(), orig, dir, maxDistance) || meshes_occluded(orig, dir, maxDistance, scene);
+	}
+
+	bool occluded = false;
+	float tMax = maxDistance;
+	scene.bvh.traverse(orig, dir, tMax, [&](int first, int count, float &limit)
+	{
+		WT_PROFILE_COUNT(SphereTests, count);
+		occluded = sphereKernels.any(spheres, first, first + count, orig, dir, limit);
+		return occluded;
+	});
+	return occluded || meshes_occluded(orig, dir, maxDistance, scene);
+}
+
+// Occlusion for up to maxShadowBatch rays at once, e.g. all of a hit point's shadow rays.  With a
+// BVH the rays walk the tree together, so each node they have in common is fetched and each leaf
+// is visited once.
+void scene_occluded_batch(const ShadowRay *rays, int count, const Scene &scene, bool *occluded)
+{
+	assert(count <= maxShadowBatch);
+	WT_PROFILE_SCOPE(Shadow);
+	WT_PROFILE_COUNT(Rays, count);
+	const SphereSoA &spheres = scene.sphereData;
+
+	if (scene.bvh.empty() || count == 1)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			occluded[i] = scene_occluded(rays[i].orig, rays[i].dir, rays[i].maxDistance, scene);
+			WT_PROFILE_COUNT(Occluded, occluded[i]);
+		}
+		return;
+	}
+
+	BVHRay boxRays[maxShadowBatch];
+	float tMax[maxShadowBatch];
+	for (int i = 0; i < count; i++)
+	{
+		boxRays[i] = BVHRay(rays[i].orig, rays[i].dir);
+		tMax[i] = rays[i].maxDistance;
+		occluded[i] = false;
+	}
+
+	uint32_t active = count == 32 ? 0xffffffffu : (1u << count) - 1;
+	scene.bvh.traverseBatch(boxRays, tMax, active, [&](int first, int leafCount, uint32_t mask)
+	{
+		uint32_t done = 0;
+		for (uint32_t remaining = mask; remaining; remaining &= remaining - 1)
+		{
+			int r = BVH::lowestBit(remaining);
+			WT_PROFILE_COUNT(SphereTests, leafCount);
+			if (sphereKernels.any(spheres, first, first + leafCount, rays[r].orig, rays[r].dir, rays[r].maxDistance))
+			{
+				occluded[r] = true;
+				done |= 1u << r;
+			}
+		}
+		return done;
+	});
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!occluded[i]) occluded[i] = meshes_occluded(rays[i].orig, rays[i].dir, rays[i].maxDistance, scene);
+		WT_PROFILE_COUNT(Occluded, occluded[i]);
+	}
+}
+
+// Diffuse and specular light from count lights (lights[0, count) if indices is null), each
+// scaled by its weight (1 if weights is null) and its falloff
+template <typename Math = ExactMath>
+void gather_lights(const vec3 &point, const vec3 &N, const Material *material, const vec3 &dir, const Scene &scene, RayStats &stats,
+	const int *indices, const float *weights, size_t count, float &diffuse_light_intensity, float &specular_light_intensity) {
+	const std::vector<Light> &lights = scene.lights;
+
+	for (size_t batchStart = 0; batchStart < count; batchStart += maxShadowBatch)
+	{
+		int batchSize = (int)std::min(count - batchStart, (size_t)maxShadowBatch);
+
+		// trace the shadow rays for every light in the batch together
+		ShadowRay shadowRays[maxShadowBatch];
+		bool inShadow[maxShadowBatch];
+		float scale[maxShadowBatch];
+		for (int b = 0; b < batchSize; b++)
+		{
+			size_t k = batchStart + b;
+			const Light &light = lights[indices ? indices[k] : k];
+			float light_distance;
+			vec3 light_dir = Math::normalize(light.position - point, light_distance);
+			scale[b] = lightFalloff(light_distance, light.range) * (weights ? weights[k] : 1.f);
+
+			// checking if the point lies in the shadow of the light; hits beyond 1000 never count
+			shadowRays[b].orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+			shadowRays[b].dir = light_dir;
+			shadowRays[b].maxDistance = std::min(light_distance, 1000.f);
+		}
+		stats.shadowRays += batchSize;
+		scene_occluded_batch(shadowRays, batchSize, scene, inShadow);
+
+		for (int b = 0; b < batchSize; b++)
+		{
+			// apply shadows
+			if (inShadow[b])
+				continue;
+
+			size_t k = batchStart + b;
+			float intensity = lights[indices ? indices[k] : k].intensity * scale[b];
+			const vec3 &light_dir = shadowRays[b].dir;
+
+			// add values for different lighting types
+			diffuse_light_intensity += intensity * std::max(0.f, (light_dir * N));
+			specular_light_intensity += Math::pow(std::max(0.f, -reflect(-light_dir, N)*dir), material->specular_exponent)*intensity;
+		}
+	}
+}
+
+// Uniform number in [0, 1) from a shading point and a sample number, so frames are repeatable
+inline float light_sample_number(const vec3 &point, int sample) {
+	uint32_t bits[3];
+	std::memcpy(bits, &point.x, sizeof(float));
+	std::memcpy(bits + 1, &point.y, sizeof(float));
+	std::memcpy(bits + 2, &point.z, sizeof(float));
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < 3; i++) h = (h ^ bits[i]) * 16777619u;
+	h = (h ^ (uint32_t)sample) * 16777619u;
+	h ^= h >> 15; h *= 0x2c1b3c6du; h ^= h >> 12;
+	return (h >> 8) * (1.f / 16777216.f);
+}
+
+// light reaching the eye from a surface point seen along dir: shadow rays and Phong terms, in
+// colour (shade() keeps the red channel)
+template <typename Math = ExactMath>
+vec3 shade_color(const vec3 &point, const vec3 &N, const Material *material, const vec3 &dir, const Scene &scene, RayStats &stats) {
+	WT_PROFILE_SCOPE(Shade);
+
+	// calculate lighting
+	float diffuse_light_intensity = 0, specular_light_intensity = 0;
+	if (scene.lightSamples > 0)
+	{
+		// a fixed budget of lights picked at random, each weighted by how unlikely it was; a
+		// sample that finds no light reaching the point still counts, as a light of zero, and
+		// there are none to take outside every light's reach
+		int samples = scene.lightTree.covers(point) ? std::min(scene.lightSamples, maxShadowBatch) : 0;
+		int indices[maxShadowBatch];
+		float weights[maxShadowBatch];
+		int count = 0;
+		for (int s = 0; s < samples; s++)
+		{
+			float probability;
+			int light = scene.lightTree.sample(scene.lights, point, light_sample_number(point, s), probability);
+			if (light < 0) continue;
+
+			// a light picked again adds to its weight rather than tracing the same shadow ray
+			int k = 0;
+			while (k < count && indices[k] != light) k++;
+			if (k == count) {
+				indices[count] = light;
+				weights[count++] = 0;
+			}
+			weights[k] += 1 / (probability * samples);
+		}
+		gather_lights<Math>(point, N, material, dir, scene, stats, indices, weights, count, diffuse_light_intensity, specular_light_intensity);
+	}
+	else if (scene.lightTree.hasRanges())
+	{
+		// only the lights that reach this point
+		static thread_local std::vector<int> reaching;
+		scene.lightTree.lightsAt(scene.lights, point, reaching);
+		gather_lights<Math>(point, N, material, dir, scene, stats, reaching.data(), nullptr, reaching.size(), diffuse_light_intensity, specular_light_intensity);
+	}
+	else
+	{
+		gather_lights<Math>(point, N, material, dir, scene, stats, nullptr, nullptr, scene.lights.size(), diffuse_light_intensity, specular_light_intensity);
+	}
+
+	// calculate final output color value
+	return material->diffuse_color * diffuse_light_intensity * material->albedo[0] + vec3(1., 1., 1.)*specular_light_intensity * material->albedo[1];
+}
+
+template <typename Math = ExactMath>
+float shade(const vec3 &point, const vec3 &N, const Material *material, const vec3 &dir, const Scene &scene, RayStats &stats) {
+	float out = shade_color<Math>(point, N, material, dir, scene, stats).x;
+
+	// todo: change
+	return std::max(out, .01f);
+}
+
+// do ray tracing
+template <typename Math = ExactMath>
+float cast_ray(const vec3 &orig, const vec3 &dir, const Scene &scene, RayStats &stats) {
+	vec3 point, N;
+	const Material *material;
+
+	// if the ray doesn't intersect any scene objects, return 0 for no light
+	if (!scene_intersect<Math>(orig, dir, scene, point, N, material)) {
+		return 0;
+	}
+
+	return shade<Math>(point, N, material, dir, scene, stats);
+}
+
+// cast_ray in colour: the colour in color and, for the glyph, its brightest channel
+template <typename Math = ExactMath>
+float cast_ray_color(const vec3 &orig, const vec3 &dir, const Scene &scene, RayStats &stats, vec3 &color) {
+	vec3 point, N;
+	const Material *material;
+
+	if (!scene_intersect<Math>(orig, dir, scene, point, N, material)) {
+		color = vec3(0, 0, 0);
+		return 0;
+	}
+
+	color = shade_color<Math>(point, N, material, dir, scene, stats);
+	return std::max(std::max(color.x, std::max(color.y, color.z)), .01f);
+}
+
+// Frames are split into tiles that are handed out to the thread pool.  Tiles are wide rather
+// than square since a row of cells is contiguous in the render targets.
+const int tileWidth = 16;
+const int tileHeight = 8;
+
+// Screen rectangle covered by a tile, [x0, x1) x [y0, y1)
+struct TileRect
+{
+	int x0, y0, x1, y1;
+};
+
+int tileCount(int width, int height)
+{
+	return ((width + tileWidth - 1) / tileWidth) * ((height + tileHeight - 1) / tileHeight);
+}
+
+// Tiles are numbered in row-major order
+TileRect tileRect(int tile, int width, int height)
+{
+	int tilesPerRow = (width + tileWidth - 1) / tileWidth;
+
+	TileRect rect;
+	rect.x0 = (tile % tilesPerRow) * tileWidth;
+	rect.y0 = (tile / tilesPerRow) * tileHeight;
+	rect.x1 = std::min(rect.x0 + tileWidth, width);
+	rect.y1 = std::min(rect.y0 + tileHeight, height);
+	return rect;
+}
+
+// Per-worker ray counters, padded so that workers don't share cache lines
+struct WorkerRayStats
+{
+	RayStats stats;
+	char padding[64 - sizeof(RayStats)];
+};
+
+// Trace one primary ray per cell and write the shading characters to target (anything with
+// setPixel).  Tiles are traced in parallel; each tile is walked row by row to match the
+// row-major layout of the target.  Math is the precision policy (see precision.h).
+template <typename Math = ExactMath, typename Target>
+void renderFrame(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+{
+	camera.prepare(width, height);
+	std::vector<WorkerRayStats> workerStats(pool.size());
+	bool color = target.getColors() != nullptr;
+
+	pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+	{
+		TileRect rect = tileRect(tile, width, height);
+		RayStats &tileStats = workerStats[worker].stats;
+
+		for (int j = rect.y0; j < rect.y1; j++)
+		{
+			for (int i = rect.x0; i < rect.x1; i++)
+			{
+				vec3 dir = camera.rayDirection(i, j);
+
+				// with colour output the glyph follows the brightest channel (see color.h)
+				if (color)
+				{
+					tileStats.primaryRays++;
+					vec3 rgb;
+					float val = cast_ray_color<Math>(camera.position, dir, scene, tileStats, rgb);
+					target.setPixel(i, j, getShadingChar(val));
+					target.setColor(i, j, cellColor(rgb));
+					continue;
+				}
+
+				// get monochrome color result of cast
+				tileStats.primaryRays++;
+				float val = cast_ray<Math>(camera.position, dir, scene, tileStats);
+
+				// set console window character by color value
+				target.setPixel(i, j, getShadingChar(val));
+			}
+		}
+	});
+
+	for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+}
+
+// In-memory render target with the same setPixel/getBuffer interface as ConsoleWindow
+class FrameBuffer
+{
+private:
+	int bufferWidth;
+	int bufferHeight;
+	std::vector<wchar_t> cells;
+	std::vector<uint32_t> colors;		// empty without colour
+
+public:
+	FrameBuffer(int width, int height) : bufferWidth(width), bufferHeight(height), cells(width * height, L' ') {}
+
+	// Change the size; the contents are undefined until the next frame is drawn
+	void resize(int width, int height)
+	{
+		bufferWidth = width;
+		bufferHeight = height;
+		cells.resize(width * height, L' ');
+		if (!colors.empty()) colors.resize(width * height, textColor);
+	}
+
+	// Keep a colour per cell from now on (see color.h)
+	void enableColor() { colors.assign(cells.size(), textColor); }
+
+	void setColor(int x, int y, uint32_t color)
+	{
+		assert(!colors.empty() && x >= 0 && x < bufferWidth && y >= 0 && y < bufferHeight);
+		colors[y * bufferWidth + x] = color;
+	}
+
+	// Cell colours, or null without colour
+	uint32_t* getColors() { return colors.empty() ? nullptr : colors.data(); }
+	const uint32_t* getColors() const { return colors.empty() ? nullptr : colors.data(); }
+
+	void setPixel(int x, int y, char c)
+	{
+		assert(x >= 0 && x < bufferWidth && y >= 0 && y < bufferHeight);
+
+		cells[y * bufferWidth + x] = c;
+	}
+
+	wchar_t* getBuffer() { return cells.data(); }
+	const wchar_t* getBuffer() const { return cells.data(); }
+	int getWidth() const { return bufferWidth; }
+	int getHeight() const { return bufferHeight; }
+
+	// FNV-1a over the cells; wchar_t differs in size between platforms so each cell is hashed as 16 bits
+	uint64_t checksum() const
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (size_t i = 0; i < cells.size(); i++)
+		{
+			uint16_t c = (uint16_t)cells[i];
+			hash = (hash ^ (c & 0xff)) * 1099511628211ull;
+			hash = (hash ^ (c >> 8)) * 1099511628211ull;
+		}
+		return hash;
+	}
+};
@@ -0,0 +1,387 @@
+#pragma once
+#include "renderer.h"
+#include "mapped.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <cstring>
+#include <cstdint>
+
+// Scene files.
+//
+// Scenes are written as text, one object per line:
+//
+//   # comment
+//   material NAME REFRACTIVE_INDEX DIFFUSE SPECULAR REFLECT REFRACT R G B SPECULAR_EXPONENT
+//   sphere X Y Z RADIUS MATERIAL
+//   light X Y Z INTENSITY [RANGE]
+//
+// and can be compiled into a binary file holding the arrays the renderer uses: the packed
+// sphere blocks, the materials, the lights and the BVH.  A compiled file is memory mapped and
+// used where it lies, so loading it costs a few page faults rather than parsing and building.
+
+const char sceneFileMagic[8] = { 'W', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+
+// Bumped whenever the layout of a compiled scene changes; older files are refused
+const uint32_t sceneFileVersion = 2;
+
+// Written as 0x01020304 so files from a machine with a different byte order are refused
+const uint32_t sceneFileByteOrder = 0x01020304;
+
+// Floats stored per light
+const int lightFloats = 5;
+
+// Sections of a compiled scene, each starting on a 64 byte boundary
+enum SceneSection
+{
+	SectionCX, SectionCY, SectionCZ, SectionR2,	// SphereSoA arrays, BVH leaf order
+	SectionSphereMaterial,
+	SectionMaterials,							// Material structs
+	SectionLights,								// x, y, z, intensity, range
+	SectionNodes,								// BVHNode structs; empty without a BVH
+	SectionCount
+};
+
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t headerSize;
+	uint32_t accel;				// Accel the scene was compiled with
+	uint64_t sphereCount;
+	uint64_t slotCount;			// sphere slots including padding
+	uint64_t materialCount;
+	uint64_t lightCount;
+	uint64_t nodeCount;
+	struct { uint64_t offset, bytes; } sections[SectionCount];
+};
+
+// Materials and BVH nodes are used straight from the file, so their layout is part of the format
+static_assert(sizeof(Material) == 9 * sizeof(float), "Material layout changed; bump sceneFileVersion");
+static_assert(sizeof(BVHNode) == 32, "BVHNode layout changed; bump sceneFileVersion");
+
+// Reads the text format into scene (not committed); returns false with a message on bad input
+bool parseSceneText(std::istream &in, Scene &scene, std::string &error)
+{
+	std::map<std::string, Material> materials;
+
+	std::string line;
+	for (int lineNumber = 1; std::getline(in, line); lineNumber++)
+	{
+		std::istringstream fields(line);
+		std::string keyword;
+		if (!(fields >> keyword) || keyword[0] == '#') continue;
+
+		bool ok;
+		if (keyword == "material")
+		{
+			std::string name;
+			Material m;
+			ok = (bool)(fields >> name >> m.refractive_index >> m.albedo[0] >> m.albedo[1] >> m.albedo[2] >> m.albedo[3]
+				>> m.diffuse_color.x >> m.diffuse_color.y >> m.diffuse_color.z >> m.specular_exponent);
+			if (ok) materials[name] = m;
+		}
+		else if (keyword == "sphere")
+		{
+			vec3 center;
+			float radius;
+			std::string name;
+			ok = (bool)(fields >> center.x >> center.y >> center.z >> radius >> name);
+			if (ok && materials.find(name) == materials.end())
+			{
+				error = "line " + std::to_string(lineNumber) + ": unknown material '" + name + "'";
+				return false;
+			}
+			if (ok) scene.spheres.push_back(Sphere(center, radius, materials[name]));
+		}
+		else if (keyword == "light")
+		{
+			vec3 position;
+			float intensity;
+			ok = (bool)(fields >> position.x >> position.y >> position.z >> intensity);
+
+			// the range is optional
+			float range = FLT_MAX;
+			if (ok && !(fields >> range)) range = FLT_MAX;
+			if (ok) scene.lights.push_back(Light(position, intensity, range));
+		}
+		else
+		{
+			error = "line " + std::to_string(lineNumber) + ": unknown keyword '" + keyword + "'";
+			return false;
+		}
+
+		if (!ok)
+		{
+			error = "line " + std::to_string(lineNumber) + ": missing or bad values for " + keyword;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Writes the scene's spheres and lights in the text format, with enough digits that reading
+// them back gives exactly the same scene
+void writeSceneText(const Scene &scene, std::ostream &out)
+{
+	std::map<Material, std::string, MaterialLess> names;
+	out.precision(std::numeric_limits<float>::max_digits10);
+
+	for (size_t i = 0; i < scene.spheres.size(); i++)
+	{
+		const Material &m = scene.spheres[i].material;
+		if (names.find(m) != names.end()) continue;
+
+		std::string name = "m" + std::to_string(names.size());
+		names[m] = name;
+		out << "material " << name << ' ' << m.refractive_index << ' ' << m.albedo[0] << ' ' << m.albedo[1] << ' ' << m.albedo[2] << ' ' << m.albedo[3]
+			<< ' ' << m.diffuse_color.x << ' ' << m.diffuse_color.y << ' ' << m.diffuse_color.z << ' ' << m.specular_exponent << '\n';
+	}
+
+	for (size_t i = 0; i < scene.spheres.size(); i++)
+	{
+		const Sphere &s = scene.spheres[i];
+		out << "sphere " << s.center.x << ' ' << s.center.y << ' ' << s.center.z << ' ' << s.radius << ' ' << names[s.material] << '\n';
+	}
+
+	for (size_t i = 0; i < scene.lights.size(); i++)
+	{
+		const Light &l = scene.lights[i];
+		out << "light " << l.position.x << ' ' << l.position.y << ' ' << l.position.z << ' ' << l.intensity;
+		if (l.range != FLT_MAX) out << ' ' << l.range;
+		out << '\n';
+	}
+}
+
+// Writes the committed scene in the compiled format
+bool compileScene(const Scene &scene, const std::string &path, std::string &error)
+{
+	if (!scene.meshes.empty())
+	{
+		error = "meshes can't be stored in compiled scenes";
+		return false;
+	}
+
+	std::vector<float> lights;
+	for (size_t i = 0; i < scene.lights.size(); i++)
+	{
+		const Light &l = scene.lights[i];
+		float values[] = { l.position.x, l.position.y, l.position.z, l.intensity, l.range };
+		lights.insert(lights.end(), values, values + lightFloats);
+	}
+
+	const SphereSoA &spheres = scene.sphereData;
+	const void *data[SectionCount] =
+	{
+		spheres.cx.data(), spheres.cy.data(), spheres.cz.data(), spheres.r2.data(),
+		spheres.material.data(), scene.materials.data(), lights.data(), scene.bvh.nodes.data()
+	};
+
+	SceneFileHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, sceneFileMagic, sizeof(header.magic));
+	header.version = sceneFileVersion;
+	header.byteOrder = sceneFileByteOrder;
+	header.headerSize = sizeof(SceneFileHeader);
+	header.accel = (uint32_t)scene.accel;
+	header.sphereCount = spheres.count;
+	header.slotCount = spheres.paddedCount();
+	header.materialCount = scene.materials.size();
+	header.lightCount = scene.lights.size();
+	header.nodeCount = scene.bvh.nodes.size();
+
+	uint64_t bytes[SectionCount] =
+	{
+		header.slotCount * sizeof(float), header.slotCount * sizeof(float), header.slotCount * sizeof(float), header.slotCount * sizeof(float),
+		header.slotCount * sizeof(int), header.materialCount * sizeof(Material), lights.size() * sizeof(float), header.nodeCount * sizeof(BVHNode)
+	};
+
+	uint64_t offset = sizeof(SceneFileHeader);
+	for (int s = 0; s < SectionCount; s++)
+	{
+		offset = (offset + 63) / 64 * 64;
+		header.sections[s].offset = offset;
+		header.sections[s].bytes = bytes[s];
+		offset += bytes[s];
+	}
+
+	std::ofstream out(path.c_str(), std::ios::binary);
+	if (!out)
+	{
+		error = "can't write " + path;
+		return false;
+	}
+
+	out.write((const char*)&header, sizeof(header));
+	uint64_t written = sizeof(header);
+	for (int s = 0; s < SectionCount; s++)
+	{
+		static const char padding[64] = {};
+		out.write(padding, header.sections[s].offset - written);
+		if (header.sections[s].bytes) out.write((const char*)data[s], header.sections[s].bytes);
+		written = header.sections[s].offset + header.sections[s].bytes;
+	}
+
+	if (!out)
+	{
+		error = "can't write " + path;
+		return false;
+	}
+	return true;
+}
+
+// Points the scene at the arrays of a mapped compiled scene after checking that they are all
+// there and consistent, so that a damaged file can't send the renderer out of bounds
+bool viewCompiledScene(const std::shared_ptr<MappedFile> &file, Scene &scene, std::string &error)
+{
+	const uint8_t *bytes = file->data();
+	SceneFileHeader header;
+	if (file->size() < sizeof(header))
+	{
+		error = "truncated scene file";
+		return false;
+	}
+	std::memcpy(&header, bytes, sizeof(header));
+
+	if (header.version != sceneFileVersion || header.byteOrder != sceneFileByteOrder || header.headerSize != sizeof(header))
+	{
+		error = "scene file was compiled by a different version or on a different kind of machine; compile it again";
+		return false;
+	}
+
+	uint64_t elementSize[SectionCount] = { sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(int), sizeof(Material), sizeof(float), sizeof(BVHNode) };
+	uint64_t elements[SectionCount] = { header.slotCount, header.slotCount, header.slotCount, header.slotCount, header.slotCount, header.materialCount, header.lightCount * lightFloats, header.nodeCount };
+	for (int s = 0; s < SectionCount; s++)
+	{
+		uint64_t offset = header.sections[s].offset;
+		if (offset % 64 != 0 || header.sections[s].bytes != elements[s] * elementSize[s] || offset > file->size() || header.sections[s].bytes > file->size() - offset)
+		{
+			error = "damaged scene file";
+			return false;
+		}
+	}
+	if (header.slotCount % SphereSoA::blockSize != 0 || header.sphereCount > header.slotCount || header.accel > (uint32_t)Accel::Grid ||
+		(header.slotCount > 0 && header.materialCount == 0))
+	{
+		error = "damaged scene file";
+		return false;
+	}
+
+	const int *sphereMaterial = (const int*)(bytes + header.sections[SectionSphereMaterial].offset);
+	for (uint64_t i = 0; i < header.slotCount; i++)
+	{
+		if (sphereMaterial[i] < 0 || (uint64_t)sphereMaterial[i] >= header.materialCount)
+		{
+			error = "damaged scene file";
+			return false;
+		}
+	}
+
+	const BVHNode *nodes = (const BVHNode*)(bytes + header.sections[SectionNodes].offset);
+	for (uint64_t i = 0; i < header.nodeCount; i++)
+	{
+		bool leaf = nodes[i].count > 0;
+		uint64_t first = (uint64_t)nodes[i].first;
+		bool valid = leaf
+			? first % SphereSoA::blockSize == 0 && nodes[i].count % SphereSoA::blockSize == 0 && first + nodes[i].count <= header.slotCount
+			: first > i && first + 1 < header.nodeCount;
+		if (nodes[i].first < 0 || !valid)
+		{
+			error = "damaged scene file";
+			return false;
+		}
+	}
+
+	// the traversal stacks only hold BVH::maxDepth levels, so walk the tree from the root and
+	// check that every node is reached once and no deeper than that
+	if (header.nodeCount > 0)
+	{
+		std::vector<uint8_t> reached(header.nodeCount, 0);
+		std::vector<std::pair<uint64_t, int> > pending(1, std::make_pair((uint64_t)0, 0));
+		uint64_t reachedCount = 0;
+		while (!pending.empty())
+		{
+			uint64_t i = pending.back().first;
+			int depth = pending.back().second;
+			pending.pop_back();
+			if (reached[i] || depth > BVH::maxDepth)
+			{
+				error = "damaged scene file";
+				return false;
+			}
+			reached[i] = 1;
+			reachedCount++;
+
+			if (nodes[i].count == 0)
+			{
+				pending.push_back(std::make_pair((uint64_t)nodes[i].first, depth + 1));
+				pending.push_back(std::make_pair((uint64_t)nodes[i].first + 1, depth + 1));
+			}
+		}
+		if (reachedCount != header.nodeCount)
+		{
+			error = "damaged scene file";
+			return false;
+		}
+	}
+
+	scene = Scene();
+	scene.file = file;
+	scene.compiled = true;
+	scene.accel = (Accel)header.accel;
+	scene.sphereMaterialCount = header.materialCount;
+
+	SphereSoA &spheres = scene.sphereData;
+	spheres.count = header.sphereCount;
+	spheres.cx.view((const float*)(bytes + header.sections[SectionCX].offset), header.slotCount);
+	spheres.cy.view((const float*)(bytes + header.sections[SectionCY].offset), header.slotCount);
+	spheres.cz.view((const float*)(bytes + header.sections[SectionCZ].offset), header.slotCount);
+	spheres.r2.view((const float*)(bytes + header.sections[SectionR2].offset), header.slotCount);
+	spheres.material.view(sphereMaterial, header.slotCount);
+	scene.materials.view((const Material*)(bytes + header.sections[SectionMaterials].offset), header.materialCount);
+	scene.bvh.nodes.view(nodes, header.nodeCount);
+
+	// lights are few and get moved around, so they are copied
+	const float *lights = (const float*)(bytes + header.sections[SectionLights].offset);
+	for (uint64_t i = 0; i < header.lightCount; i++)
+	{
+		const float *l = lights + lightFloats * i;
+		scene.lights.push_back(Light(vec3(l[0], l[1], l[2]), l[3], l[4]));
+	}
+
+	return true;
+}
+
+// Loads a compiled or text scene file.  Compiled scenes are ready to render; text scenes still
+// need commit().
+bool loadSceneFile(const std::string &path, Scene &scene, std::string &error)
+{
+	std::shared_ptr<MappedFile> file(new MappedFile());
+	if (!file->open(path, error))
+		return false;
+
+	if (file->size() >= sizeof(sceneFileMagic) && std::memcmp(file->data(), sceneFileMagic, sizeof(sceneFileMagic)) == 0)
+	{
+		if (viewCompiledScene(file, scene, error)) return true;
+		error = path + ": " + error;
+		return false;
+	}
+
+	file.reset();
+	std::ifstream text(path.c_str());
+	scene = Scene();
+	if (!parseSceneText(text, scene, error))
+	{
+		error = path + ": " + error;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,299 @@
+#pragma once
+#include "ConsoleWindow.h"
+#include "color.h"
+#include <memory>
+#include <string>
+#include <vector>
+#include <csignal>
+#include <cstdint>
+
+// Render server: frames are rendered and encoded once and sent to any number of local viewers
+// over a UNIX domain socket.  What is sent is the same ANSI stream ConsoleWindow writes to a
+// terminal, so a viewer only copies bytes to its terminal.
+//
+// Each frame is encoded once as a delta from the last frame, and, only when some viewer needs
+// one, once more as a keyframe that redraws the whole screen.  Every viewer is handed a pointer
+// to the shared encoding and written to without blocking; a viewer that hasn't taken all of
+// the last frame yet skips the new one and gets a keyframe once it has caught up, so a slow or
+// stalled viewer never holds up the renderer or the others.
+
+#ifndef _WIN32
+#define WT_SERVER 1
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#else
+#define WT_SERVER 0
+#endif
+
+// Set by Ctrl-C once stopOnInterrupt() is called, for loops that run until interrupted
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+void stopOnInterrupt()
+{
+	std::signal(SIGINT, requestStop);
+#if WT_SERVER
+	std::signal(SIGTERM, requestStop);
+#endif
+}
+
+#if WT_SERVER
+
+// Kernel buffer per viewer: a few frames, so a viewer that falls behind skips frames rather
+// than watching old ones
+const int serverSendBuffer = 64 * 1024;
+
+class FrameServer
+{
+private:
+	struct Client
+	{
+		int fd;
+		std::shared_ptr<const std::string> sending;		// frame being written, null when idle
+		size_t sent;
+		bool needsKeyframe;
+	};
+
+	int listener = -1;
+	std::string socketPath;
+	std::vector<Client> clients;
+
+	AnsiFrameEncoder deltaEncoder;
+	AnsiFrameEncoder keyEncoder;
+
+	uint64_t frames = 0;
+	uint64_t keyframes = 0;
+	uint64_t deltaBytes = 0;
+	uint64_t bytesSent = 0;
+	uint64_t framesSkipped = 0;
+	uint64_t clientsServed = 0;
+
+	// Write what the client has left of its frame without blocking; false if it hung up
+	bool flush(Client &client)
+	{
+		if (!client.sending) return true;
+
+		const std::string &data = *client.sending;
+		while (client.sent < data.size())
+		{
+			ssize_t written = send(client.fd, data.data() + client.sent, data.size() - client.sent, 0);
+			if (written > 0)
+			{
+				client.sent += (size_t)written;
+				bytesSent += (uint64_t)written;
+				continue;
+			}
+			if (written < 0 && errno == EINTR) continue;
+			return written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+		}
+		client.sending.reset();
+		return true;
+	}
+
+	void disconnect(size_t index)
+	{
+		close(clients[index].fd);
+		clients[index] = clients.back();
+		clients.pop_back();
+	}
+
+public:
+	FrameServer(int width, int height, ColorMode colorMode) : deltaEncoder(width, height), keyEncoder(width, height)
+	{
+		deltaEncoder.setColorMode(colorMode);
+		keyEncoder.setColorMode(colorMode);
+
+		// a viewer hanging up shows up as an error from send(), not a signal
+		std::signal(SIGPIPE, SIG_IGN);
+	}
+
+	~FrameServer()
+	{
+		for (size_t i = 0; i < clients.size(); i++) close(clients[i].fd);
+		if (listener >= 0)
+		{
+			close(listener);
+			unlink(socketPath.c_str());
+		}
+	}
+
+	// Listen for viewers at path, replacing a socket left there by an earlier server
+	bool listen(const std::string &path, std::string &error)
+	{
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path))
+		{
+			error = path + ": socket path too long";
+			return false;
+		}
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+		{
+			error = std::string("can't create socket: ") + std::strerror(errno);
+			return false;
+		}
+
+		unlink(path.c_str());
+		if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 16) != 0)
+		{
+			error = path + ": " + std::strerror(errno);
+			close(listener);
+			listener = -1;
+			return false;
+		}
+		fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+		socketPath = path;
+		return true;
+	}
+
+	// Take on the viewers waiting to connect
+	void acceptClients()
+	{
+		if (listener < 0) return;
+
+		int fd;
+		while ((fd = accept(listener, nullptr, nullptr)) >= 0) addClient(fd);
+	}
+
+	// Send frames to an already connected socket, starting with a keyframe
+	void addClient(int fd)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &serverSendBuffer, sizeof(serverSendBuffer));
+
+		Client client = { fd, nullptr, 0, true };
+		clients.push_back(client);
+		clientsServed++;
+	}
+
+	// Encode a frame and hand it to every viewer that is ready for it
+	void broadcast(const wchar_t *frame, const uint32_t *colors)
+	{
+		std::shared_ptr<std::string> delta = std::make_shared<std::string>();
+		deltaEncoder.encode(frame, colors, *delta);
+
+		// the colour in effect on a viewer's terminal depends on which frames it got, so each
+		// frame sets its own
+		deltaEncoder.forgetColor();
+
+		deltaBytes += delta->size();
+		frames++;
+
+		std::shared_ptr<std::string> keyframe;
+		for (size_t i = 0; i < clients.size();)
+		{
+			Client &client = clients[i];
+			if (!flush(client))
+			{
+				disconnect(i);
+				continue;
+			}
+
+			// still busy with an earlier frame: skip this one and catch up with a keyframe
+			if (client.sending)
+			{
+				client.needsKeyframe = true;
+				framesSkipped++;
+				i++;
+				continue;
+			}
+
+			if (client.needsKeyframe)
+			{
+				if (!keyframe)
+				{
+					keyframe = std::make_shared<std::string>();
+					keyEncoder.invalidate();
+					keyEncoder.encode(frame, colors, *keyframe);
+					keyframes++;
+				}
+				client.sending = keyframe;
+				client.needsKeyframe = false;
+			}
+			else
+			{
+				client.sending = delta;
+			}
+			client.sent = 0;
+
+			if (!flush(client))
+			{
+				disconnect(i);
+				continue;
+			}
+			i++;
+		}
+	}
+
+	size_t clientCount() const { return clients.size(); }
+
+	uint64_t getFrames() const { return frames; }
+	uint64_t getKeyframes() const { return keyframes; }
+	uint64_t getDeltaBytes() const { return deltaBytes; }
+	uint64_t getBytesSent() const { return bytesSent; }
+	uint64_t getFramesSkipped() const { return framesSkipped; }
+	uint64_t getClientsServed() const { return clientsServed; }
+};
+
+// Copy the frames of the server at path to the terminal until it stops or keepGoing() returns
+// false; returns false (with error set) if the server can't be reached
+template <typename KeepGoingFn>
+bool viewFrames(const std::string &path, KeepGoingFn keepGoing, std::string &error)
+{
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		error = path + ": socket path too long";
+		return false;
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (const sockaddr*)&address, sizeof(address)) != 0)
+	{
+		error = path + ": " + std::strerror(errno);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+
+	// the same terminal setup as ConsoleWindow
+	std::string setup = "\x1b[?1049h\x1b[?25l\x1b[96m";
+	if (write(STDOUT_FILENO, setup.data(), setup.size()) < 0) {}
+
+	char buffer[64 * 1024];
+	while (keepGoing())
+	{
+		pollfd wait = { fd, POLLIN, 0 };
+		if (poll(&wait, 1, 50) <= 0) continue;
+
+		ssize_t count = read(fd, buffer, sizeof(buffer));
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) break;
+
+		for (ssize_t offset = 0; offset < count;)
+		{
+			ssize_t written = write(STDOUT_FILENO, buffer + offset, count - offset);
+			if (written < 0 && errno != EINTR) break;
+			if (written > 0) offset += written;
+		}
+	}
+
+	std::string restore = "\x1b[0m\x1b[?25h\x1b[?1049l";
+	if (write(STDOUT_FILENO, restore.data(), restore.size()) < 0) {}
+	close(fd);
+	return true;
+}
+
+#endif
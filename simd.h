@@ -0,0 +1,138 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <string>
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
+
+// Instruction set support: which SIMD kernels the CPU can run, and the plumbing needed to
+// compile kernels for instruction sets the rest of the program isn't built for.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define WT_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define WT_X86 0
+#endif
+
+// MSVC lets any function use any intrinsic; GCC and clang need the target spelled out
+#if defined(_MSC_VER) && !defined(__clang__)
+#define WT_TARGET_SSE2
+#define WT_TARGET_AVX2
+#else
+#define WT_TARGET_SSE2 __attribute__((target("sse2")))
+#define WT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Instruction set every function may use without checking the CPU first: SSE2 on x86-64 (and
+// 32-bit builds that target it), NEON on 64-bit ARM.  The aligned vectors in geometry.h use it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WT_BASELINE_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define WT_BASELINE_NEON 1
+#include <arm_neon.h>
+#endif
+
+enum class SimdLevel
+{
+	Scalar,
+	SSE2,		// 4 floats per instruction
+	AVX2		// 8 floats per instruction
+};
+
+const char* simdLevelName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SimdLevel::SSE2: return "sse2";
+	case SimdLevel::AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+// Widest instruction set both the CPU and the operating system support
+SimdLevel detectSimdLevel()
+{
+#if WT_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+
+	bool avx2 = false;
+	if (maxLeaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+
+	// the OS has to save the upper halves of the ymm registers on context switches
+	bool ymmEnabled = osxsave && avx && (_xgetbv(0) & 6) == 6;
+
+	if (avx2 && ymmEnabled) return SimdLevel::AVX2;
+	if (sse2) return SimdLevel::SSE2;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+	if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE2;
+#endif
+#endif
+	return SimdLevel::Scalar;
+}
+
+// Parses "scalar", "sse2" or "avx2"; returns false for anything else
+bool parseSimdLevel(const char *name, SimdLevel &level)
+{
+	std::string value(name);
+	if (value == "scalar") level = SimdLevel::Scalar;
+	else if (value == "sse2") level = SimdLevel::SSE2;
+	else if (value == "avx2") level = SimdLevel::AVX2;
+	else return false;
+	return true;
+}
+
+// Allocator for std::vector that aligns storage for full-width SIMD loads
+template <typename T, size_t Alignment = 32>
+struct AlignedAllocator
+{
+	typedef T value_type;
+
+	template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+	T* allocate(size_t n)
+	{
+#ifdef _MSC_VER
+		void *p = _aligned_malloc(n * sizeof(T), Alignment);
+#else
+		void *p = nullptr;
+		if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) p = nullptr;
+#endif
+		if (!p) throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T *p, size_t)
+	{
+#ifdef _MSC_VER
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	template <typename U> bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
@@ -0,0 +1,384 @@
+#pragma once
+#include "geometry.h"
+#include "raytracing.h"
+#include "simd.h"
+#include "bvh.h"
+#include "mapped.h"
+#include <vector>
+#include <map>
+#include <cfloat>
+
+// Spheres packed as a structure of arrays so that one ray can be tested against a block of 8
+// spheres at once.  The arrays are padded to a whole number of blocks with spheres that can
+// never be hit (a hugely negative radius squared).  They may also view a mapped scene file.
+struct SphereSoA
+{
+	static const size_t blockSize = 8;
+
+	MappedArray<float> cx, cy, cz;		// centers
+	MappedArray<float> r2;				// radius squared
+	MappedArray<int> material;			// index into Scene::materials
+	size_t count = 0;					// real spheres, without padding
+
+	size_t paddedCount() const { return cx.size(); }
+
+	vec3 center(size_t i) const { return vec3(cx[i], cy[i], cz[i]); }
+
+	void resize(size_t sphereCount)
+	{
+		count = sphereCount;
+		size_t padded = (sphereCount + blockSize - 1) / blockSize * blockSize;
+		cx.assign(padded, 0.f);
+		cy.assign(padded, 0.f);
+		cz.assign(padded, 0.f);
+		r2.assign(padded, -FLT_MAX);
+		material.assign(padded, 0);
+	}
+
+	void set(size_t i, const vec3 &center, float radius, int materialIndex)
+	{
+		cx[i] = center.x;
+		cy[i] = center.y;
+		cz[i] = center.z;
+		r2[i] = radius * radius;
+		material[i] = materialIndex;
+	}
+};
+
+// Finds the sphere in [begin, end) (whole blocks) that the ray hits closest, if it is nearer
+// than tNearest.  Returns its index and updates tNearest, or returns -1.
+//
+// Every kernel gives exactly the same result as Sphere::ray_intersect applied to each sphere
+// in order: the arithmetic is done in the same order (so results are bit-identical without
+// FMA contraction) and ties go to the lowest index.
+typedef int (*ClosestSphereKernel)(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float &tNearest);
+
+int closestSphereScalar(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float &tNearest)
+{
+	int nearest = -1;
+	for (size_t i = begin; i < end; i++)
+	{
+		float Lx = spheres.cx[i] - orig.x;
+		float Ly = spheres.cy[i] - orig.y;
+		float Lz = spheres.cz[i] - orig.z;
+		float tca = Lz * dir.z + Ly * dir.y + Lx * dir.x;
+		float d2 = (Lz * Lz + Ly * Ly + Lx * Lx) - tca * tca;
+		if (d2 > spheres.r2[i]) continue;
+		float thc = sqrtf(spheres.r2[i] - d2);
+		float t = tca - thc;
+		if (t < 0) t = tca + thc;
+		if (t < 0) continue;
+		if (t < tNearest)
+		{
+			tNearest = t;
+			nearest = (int)i;
+		}
+	}
+	return nearest;
+}
+
+// Returns true as soon as any sphere in [begin, end) is hit at a distance in [0, tMax)
+typedef bool (*AnySphereKernel)(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float tMax);
+
+bool anySphereScalar(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float tMax)
+{
+	for (size_t i = begin; i < end; i++)
+	{
+		float Lx = spheres.cx[i] - orig.x;
+		float Ly = spheres.cy[i] - orig.y;
+		float Lz = spheres.cz[i] - orig.z;
+		float tca = Lz * dir.z + Ly * dir.y + Lx * dir.x;
+		float d2 = (Lz * Lz + Ly * Ly + Lx * Lx) - tca * tca;
+		if (d2 > spheres.r2[i]) continue;
+		float thc = sqrtf(spheres.r2[i] - d2);
+		float t = tca - thc;
+		if (t < 0) t = tca + thc;
+		if (t >= 0 && t < tMax) return true;
+	}
+	return false;
+}
+
+#if WT_X86
+
+// Picks the nearest of the per-lane candidates, lowest index on ties
+inline int reduceNearest(const float *laneT, const int *laneIndex, int lanes, float &tNearest)
+{
+	int nearest = -1;
+	for (int lane = 0; lane < lanes; lane++)
+	{
+		if (laneIndex[lane] < 0) continue;
+		if (nearest < 0 || laneT[lane] < tNearest || (laneT[lane] == tNearest && laneIndex[lane] < nearest))
+		{
+			tNearest = laneT[lane];
+			nearest = laneIndex[lane];
+		}
+	}
+	return nearest;
+}
+
+WT_TARGET_SSE2 int closestSphereSSE2(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float &tNearest)
+{
+	const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+	const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+	const __m128 zero = _mm_setzero_ps();
+
+	__m128 bestT = _mm_set1_ps(tNearest);
+	__m128i bestIndex = _mm_set1_epi32(-1);
+	__m128i index = _mm_setr_epi32((int)begin, (int)begin + 1, (int)begin + 2, (int)begin + 3);
+	const __m128i step = _mm_set1_epi32(4);
+
+	for (size_t i = begin; i < end; i += 4)
+	{
+		__m128 Lx = _mm_sub_ps(_mm_load_ps(&spheres.cx[i]), ox);
+		__m128 Ly = _mm_sub_ps(_mm_load_ps(&spheres.cy[i]), oy);
+		__m128 Lz = _mm_sub_ps(_mm_load_ps(&spheres.cz[i]), oz);
+		__m128 r2 = _mm_load_ps(&spheres.r2[i]);
+
+		__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Lz, dz), _mm_mul_ps(Ly, dy)), _mm_mul_ps(Lx, dx));
+		__m128 LL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Lz, Lz), _mm_mul_ps(Ly, Ly)), _mm_mul_ps(Lx, Lx));
+		__m128 d2 = _mm_sub_ps(LL, _mm_mul_ps(tca, tca));
+
+		// misses produce NaN here, they are masked out below
+		__m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+		__m128 t0 = _mm_sub_ps(tca, thc);
+		__m128 t1 = _mm_add_ps(tca, thc);
+
+		// inside the sphere: use the far intersection
+		__m128 inside = _mm_cmplt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(inside, t1), _mm_andnot_ps(inside, t0));
+
+		__m128 hit = _mm_cmpngt_ps(d2, r2);
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(t, zero));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t, bestT));
+
+		bestT = _mm_or_ps(_mm_and_ps(hit, t), _mm_andnot_ps(hit, bestT));
+		__m128i hitMask = _mm_castps_si128(hit);
+		bestIndex = _mm_or_si128(_mm_and_si128(hitMask, index), _mm_andnot_si128(hitMask, bestIndex));
+
+		index = _mm_add_epi32(index, step);
+	}
+
+	float laneT[4];
+	int laneIndex[4];
+	_mm_storeu_ps(laneT, bestT);
+	_mm_storeu_si128((__m128i*)laneIndex, bestIndex);
+	return reduceNearest(laneT, laneIndex, 4, tNearest);
+}
+
+WT_TARGET_SSE2 bool anySphereSSE2(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float tMax)
+{
+	const __m128 ox = _mm_set1_ps(orig.x), oy = _mm_set1_ps(orig.y), oz = _mm_set1_ps(orig.z);
+	const __m128 dx = _mm_set1_ps(dir.x), dy = _mm_set1_ps(dir.y), dz = _mm_set1_ps(dir.z);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 limit = _mm_set1_ps(tMax);
+
+	for (size_t i = begin; i < end; i += 4)
+	{
+		__m128 Lx = _mm_sub_ps(_mm_load_ps(&spheres.cx[i]), ox);
+		__m128 Ly = _mm_sub_ps(_mm_load_ps(&spheres.cy[i]), oy);
+		__m128 Lz = _mm_sub_ps(_mm_load_ps(&spheres.cz[i]), oz);
+		__m128 r2 = _mm_load_ps(&spheres.r2[i]);
+
+		__m128 tca = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Lz, dz), _mm_mul_ps(Ly, dy)), _mm_mul_ps(Lx, dx));
+		__m128 LL = _mm_add_ps(_mm_add_ps(_mm_mul_ps(Lz, Lz), _mm_mul_ps(Ly, Ly)), _mm_mul_ps(Lx, Lx));
+		__m128 d2 = _mm_sub_ps(LL, _mm_mul_ps(tca, tca));
+
+		__m128 thc = _mm_sqrt_ps(_mm_sub_ps(r2, d2));
+		__m128 t0 = _mm_sub_ps(tca, thc);
+		__m128 t1 = _mm_add_ps(tca, thc);
+		__m128 inside = _mm_cmplt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(inside, t1), _mm_andnot_ps(inside, t0));
+
+		__m128 hit = _mm_cmpngt_ps(d2, r2);
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(t, zero));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(t, limit));
+		if (_mm_movemask_ps(hit)) return true;
+	}
+	return false;
+}
+
+WT_TARGET_AVX2 int closestSphereAVX2(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float &tNearest)
+{
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 zero = _mm256_setzero_ps();
+
+	__m256 bestT = _mm256_set1_ps(tNearest);
+	__m256i bestIndex = _mm256_set1_epi32(-1);
+	__m256i index = _mm256_add_epi32(_mm256_set1_epi32((int)begin), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m256i step = _mm256_set1_epi32(8);
+
+	for (size_t i = begin; i < end; i += 8)
+	{
+		__m256 Lx = _mm256_sub_ps(_mm256_load_ps(&spheres.cx[i]), ox);
+		__m256 Ly = _mm256_sub_ps(_mm256_load_ps(&spheres.cy[i]), oy);
+		__m256 Lz = _mm256_sub_ps(_mm256_load_ps(&spheres.cz[i]), oz);
+		__m256 r2 = _mm256_load_ps(&spheres.r2[i]);
+
+		__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lz, dz), _mm256_mul_ps(Ly, dy)), _mm256_mul_ps(Lx, dx));
+		__m256 LL = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lz, Lz), _mm256_mul_ps(Ly, Ly)), _mm256_mul_ps(Lx, Lx));
+		__m256 d2 = _mm256_sub_ps(LL, _mm256_mul_ps(tca, tca));
+
+		// misses produce NaN here, they are masked out below
+		__m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+		__m256 t0 = _mm256_sub_ps(tca, thc);
+		__m256 t1 = _mm256_add_ps(tca, thc);
+
+		// inside the sphere: use the far intersection
+		__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+		__m256 hit = _mm256_cmp_ps(d2, r2, _CMP_NGT_UQ);
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, bestT, _CMP_LT_OQ));
+
+		bestT = _mm256_blendv_ps(bestT, t, hit);
+		bestIndex = _mm256_blendv_epi8(bestIndex, index, _mm256_castps_si256(hit));
+
+		index = _mm256_add_epi32(index, step);
+	}
+
+	float laneT[8];
+	int laneIndex[8];
+	_mm256_storeu_ps(laneT, bestT);
+	_mm256_storeu_si256((__m256i*)laneIndex, bestIndex);
+	return reduceNearest(laneT, laneIndex, 8, tNearest);
+}
+
+WT_TARGET_AVX2 bool anySphereAVX2(const SphereSoA &spheres, size_t begin, size_t end, const vec3 &orig, const vec3 &dir, float tMax)
+{
+	const __m256 ox = _mm256_set1_ps(orig.x), oy = _mm256_set1_ps(orig.y), oz = _mm256_set1_ps(orig.z);
+	const __m256 dx = _mm256_set1_ps(dir.x), dy = _mm256_set1_ps(dir.y), dz = _mm256_set1_ps(dir.z);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 limit = _mm256_set1_ps(tMax);
+
+	for (size_t i = begin; i < end; i += 8)
+	{
+		__m256 Lx = _mm256_sub_ps(_mm256_load_ps(&spheres.cx[i]), ox);
+		__m256 Ly = _mm256_sub_ps(_mm256_load_ps(&spheres.cy[i]), oy);
+		__m256 Lz = _mm256_sub_ps(_mm256_load_ps(&spheres.cz[i]), oz);
+		__m256 r2 = _mm256_load_ps(&spheres.r2[i]);
+
+		__m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lz, dz), _mm256_mul_ps(Ly, dy)), _mm256_mul_ps(Lx, dx));
+		__m256 LL = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(Lz, Lz), _mm256_mul_ps(Ly, Ly)), _mm256_mul_ps(Lx, Lx));
+		__m256 d2 = _mm256_sub_ps(LL, _mm256_mul_ps(tca, tca));
+
+		__m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(r2, d2));
+		__m256 t0 = _mm256_sub_ps(tca, thc);
+		__m256 t1 = _mm256_add_ps(tca, thc);
+		__m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+
+		__m256 hit = _mm256_cmp_ps(d2, r2, _CMP_NGT_UQ);
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, limit, _CMP_LT_OQ));
+		if (_mm256_movemask_ps(hit)) return true;
+	}
+	return false;
+}
+
+#endif
+
+// The kernels in use, chosen once at startup
+struct SphereKernels
+{
+	SimdLevel level;
+	ClosestSphereKernel closest;
+	AnySphereKernel any;
+};
+
+// Kernels for the requested instruction set, or the widest supported one below it
+SphereKernels selectSphereKernels(SimdLevel requested)
+{
+	SimdLevel supported = detectSimdLevel();
+	SimdLevel level = requested < supported ? requested : supported;
+
+	SphereKernels kernels;
+	kernels.level = SimdLevel::Scalar;
+	kernels.closest = closestSphereScalar;
+	kernels.any = anySphereScalar;
+
+#if WT_X86
+	if (level == SimdLevel::AVX2)
+	{
+		kernels.level = SimdLevel::AVX2;
+		kernels.closest = closestSphereAVX2;
+		kernels.any = anySphereAVX2;
+	}
+	else if (level == SimdLevel::SSE2)
+	{
+		kernels.level = SimdLevel::SSE2;
+		kernels.closest = closestSphereSSE2;
+		kernels.any = anySphereSSE2;
+	}
+#endif
+
+	return kernels;
+}
+
+SphereKernels sphereKernels = selectSphereKernels(SimdLevel::AVX2);
+
+// Some of a scene's spheres, packed for the kernels in their original order, so the closest hit
+// among them is the one a search of the whole scene would pick
+struct SphereBin
+{
+	SphereSoA spheres;
+	std::vector<int> index;		// scene index of each sphere
+
+	// Like sphereKernels.closest over these spheres; returns a scene index or -1
+	int closest(const vec3 &orig, const vec3 &dir, float &tNearest) const
+	{
+		int nearest = sphereKernels.closest(spheres, 0, spheres.paddedCount(), orig, dir, tNearest);
+		return nearest < 0 ? -1 : index[nearest];
+	}
+};
+
+// Orders materials so identical ones can share an index
+struct MaterialLess
+{
+	bool operator()(const Material &a, const Material &b) const
+	{
+		const float ka[] = { a.albedo[0], a.albedo[1], a.albedo[2], a.albedo[3], a.diffuse_color.x, a.diffuse_color.y, a.diffuse_color.z, a.specular_exponent, a.refractive_index };
+		const float kb[] = { b.albedo[0], b.albedo[1], b.albedo[2], b.albedo[3], b.diffuse_color.x, b.diffuse_color.y, b.diffuse_color.z, b.specular_exponent, b.refractive_index };
+		for (size_t i = 0; i < sizeof(ka) / sizeof(ka[0]); i++)
+		{
+			if (ka[i] != kb[i]) return ka[i] < kb[i];
+		}
+		return false;
+	}
+};
+
+// Pack spheres into soa in the given slot order (-1 marks a padding slot), collecting their
+// (deduplicated) materials into materials
+void packSpheres(const std::vector<Sphere> &spheres, const std::vector<int> &order, SphereSoA &soa, MappedArray<Material> &materials)
+{
+	std::map<Material, int, MaterialLess> materialIndex;
+	materials.clear();
+
+	soa.resize(order.size());
+	soa.count = spheres.size();
+	for (size_t slot = 0; slot < order.size(); slot++)
+	{
+		if (order[slot] < 0) continue;
+
+		const Sphere &sphere = spheres[order[slot]];
+		std::map<Material, int, MaterialLess>::iterator found = materialIndex.find(sphere.material);
+		if (found == materialIndex.end())
+		{
+			found = materialIndex.insert(std::make_pair(sphere.material, (int)materials.size())).first;
+			materials.push_back(sphere.material);
+		}
+
+		soa.set(slot, sphere.center, sphere.radius, found->second);
+	}
+}
+
+// Bounding boxes of the spheres, for building acceleration structures
+std::vector<AABB> sphereBounds(const std::vector<Sphere> &spheres)
+{
+	std::vector<AABB> bounds(spheres.size());
+	for (size_t i = 0; i < spheres.size(); i++)
+	{
+		vec3 extent(spheres[i].radius);
+		bounds[i] = AABB(spheres[i].center - extent, spheres[i].center + extent);
+	}
+	return bounds;
+}
@@ -0,0 +1,426 @@
+#pragma once
+#include "renderer.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <algorithm>
+
+// Subcell supersampling: glyphs picked by shape as well as brightness.
+//
+// Every cell first gets its centre ray, as in renderFrame.  A cell whose centre differs from a
+// neighbour's by more than subcellEdge lies on an edge (a silhouette or a shadow boundary); it is
+// traced again at the centres of a 2x3 grid of subcells and drawn with the glyph whose ink best
+// follows the samples.  With the extended table, '_' goes where only the bottom of the cell is
+// lit and '/' or ')' along a diagonal or curved edge; the basic table has only ten glyphs, so
+// there the shape can do no more than move a cell one tone up or down.  Every other cell is
+// drawn from its centre ray alone, exactly as renderFrame would draw it, so the extra rays are
+// only spent along edges.  Centre rays are traced for the whole frame first, since each cell's
+// test reads those of its neighbours.
+//
+// The centre rays are the only work neighbouring cells share.  Subcell samples lie inside their
+// cell, and the centre ray sits on the border between two subcells, so it isn't one of them.
+// Sampling subcell corners instead would let cells share the samples on their borders, but that
+// takes 12 rays for an edge cell on its own and about 8 a cell along a line of them, against 6.
+// Edges are seldom more than a cell or two thick, so sharing would cost more than it saves.
+//
+// Picking the glyph is a table lookup.  The six samples are reduced to their mean, which picks a
+// tone (an index into the shading table, as getShadingChar does), and a pattern saying whether
+// each subcell is darker than the mean, about the same or brighter.  For every tone and pattern
+// SubcellGlyphs holds the glyph, among those close to the tone, whose ink is spread most like the
+// pattern.  The ink comes from 5x7 bitmaps of the glyphs, for both shading tables.
+
+// Subcells per cell: 2 across and 3 down, about square for a console font
+const int subcellColumns = 2;
+const int subcellRows = 3;
+const int subcellCount = subcellColumns * subcellRows;
+
+// Darker, same or brighter for each subcell
+const int subcellPatterns = 729;
+
+// How far a sample must be from its cell's mean to count as darker or brighter
+const float subcellContrast = .1f;
+
+// How far the centre rays of neighbouring cells must be apart for a cell to be subsampled
+const float subcellEdge = .2f;
+
+// Cost of a glyph a whole tone window away from the cell's tone, against 1 - the correlation
+// of its shape with the pattern
+const float subcellToneWeight = .1f;
+
+// 5x7 bitmaps of every glyph in both shading tables, top row first
+struct GlyphBitmap
+{
+	char glyph;
+	const char *rows;		// 7 rows of 5 separated by spaces, '#' for ink
+};
+
+const GlyphBitmap glyphBitmaps[] =
+{
+	{ ' ', "..... ..... ..... ..... ..... ..... ....." },
+	{ '.', "..... ..... ..... ..... ..... .##.. .##.." },
+	{ '\'', "..#.. ..#.. ..... ..... ..... ..... ....." },
+	{ '`', ".#... ..#.. ..... ..... ..... ..... ....." },
+	{ '^', "..#.. .#.#. #...# ..... ..... ..... ....." },
+	{ '"', ".#.#. .#.#. ..... ..... ..... ..... ....." },
+	{ ',', "..... ..... ..... ..... .##.. ..#.. .#..." },
+	{ ':', "..... .##.. .##.. ..... .##.. .##.. ....." },
+	{ ';', "..... .##.. .##.. ..... .##.. ..#.. .#..." },
+	{ 'I', ".###. ..#.. ..#.. ..#.. ..#.. ..#.. .###." },
+	{ 'l', ".##.. ..#.. ..#.. ..#.. ..#.. ..#.. .###." },
+	{ '!', "..#.. ..#.. ..#.. ..#.. ..... ..... ..#.." },
+	{ 'i', "..#.. ..... .##.. ..#.. ..#.. ..#.. .###." },
+	{ '>', ".#... ..#.. ...#. ....# ...#. ..#.. .#..." },
+	{ '<', "...#. ..#.. .#... #.... .#... ..#.. ...#." },
+	{ '~', "..... ..... .#... #.#.# ...#. ..... ....." },
+	{ '+', "..... ..#.. ..#.. ##### ..#.. ..#.. ....." },
+	{ '_', "..... ..... ..... ..... ..... ..... #####" },
+	{ '-', "..... ..... ..... ##### ..... ..... ....." },
+	{ '=', "..... ..... ##### ..... ##### ..... ....." },
+	{ '?', ".###. #...# ....# ...#. ..#.. ..... ..#.." },
+	{ ']', ".###. ...#. ...#. ...#. ...#. ...#. .###." },
+	{ '[', ".###. .#... .#... .#... .#... .#... .###." },
+	{ '}', ".#... ..#.. ..#.. ...#. ..#.. ..#.. .#..." },
+	{ '{', "...#. ..#.. ..#.. .#... ..#.. ..#.. ...#." },
+	{ '1', "..#.. .##.. ..#.. ..#.. ..#.. ..#.. .###." },
+	{ ')', ".#... ..#.. ...#. ...#. ...#. ..#.. .#..." },
+	{ '(', "...#. ..#.. .#... .#... .#... ..#.. ...#." },
+	{ '|', "..#.. ..#.. ..#.. ..#.. ..#.. ..#.. ..#.." },
+	{ '\\', "#.... .#... .#... ..#.. ...#. ...#. ....#" },
+	{ '/', "....# ...#. ...#. ..#.. .#... .#... #...." },
+	{ 't', ".#... .#... ###.. .#... .#... .#..# ..##." },
+	{ 'f', "..##. .#..# .#... ###.. .#... .#... .#..." },
+	{ 'j', "...#. ..... ..##. ...#. ...#. #..#. .##.." },
+	{ 'r', "..... ..... #.##. ##..# #.... #.... #...." },
+	{ 'x', "..... ..... #...# .#.#. ..#.. .#.#. #...#" },
+	{ 'n', "..... ..... #.##. ##..# #...# #...# #...#" },
+	{ 'u', "..... ..... #...# #...# #...# #..## .##.#" },
+	{ 'v', "..... ..... #...# #...# #...# .#.#. ..#.." },
+	{ 'c', "..... ..... .###. #.... #.... #...# .###." },
+	{ 'z', "..... ..... ##### ...#. ..#.. .#... #####" },
+	{ 'X', "#...# #...# .#.#. ..#.. .#.#. #...# #...#" },
+	{ 'Y', "#...# #...# .#.#. ..#.. ..#.. ..#.. ..#.." },
+	{ 'U', "#...# #...# #...# #...# #...# #...# .###." },
+	{ 'J', "..### ...#. ...#. ...#. ...#. #..#. .##.." },
+	{ 'C', ".###. #...# #.... #.... #.... #...# .###." },
+	{ 'L', "#.... #.... #.... #.... #.... #.... #####" },
+	{ 'Q', ".###. #...# #...# #...# #.#.# #..#. .##.#" },
+	{ '0', ".###. #...# #..## #.#.# ##..# #...# .###." },
+	{ 'O', ".###. #...# #...# #...# #...# #...# .###." },
+	{ 'Z', "##### ....# ...#. ..#.. .#... #.... #####" },
+	{ 'm', "..... ..... ##.#. #.#.# #.#.# #...# #...#" },
+	{ 'w', "..... ..... #...# #...# #.#.# #.#.# .#.#." },
+	{ 'q', "..... ..... .##.# #..## .#### ....# ....#" },
+	{ 'p', "..... ..... ####. #...# ####. #.... #...." },
+	{ 'd', "....# ....# .##.# #..## #...# #...# .####" },
+	{ 'b', "#.... #.... #.##. ##..# #...# #...# ####." },
+	{ 'k', "#.... #.... #..#. #.#.. ##... #.#.. #..#." },
+	{ 'h', "#.... #.... #.##. ##..# #...# #...# #...#" },
+	{ 'a', "..... ..... .###. ....# .#### #...# .####" },
+	{ 'o', "..... ..... .###. #...# #...# #...# .###." },
+	{ '*', "..... ..#.. #.#.# .###. #.#.# ..#.. ....." },
+	{ '#', ".#.#. .#.#. ##### .#.#. ##### .#.#. .#.#." },
+	{ 'M', "#...# ##.## #.#.# #.#.# #...# #...# #...#" },
+	{ 'W', "#...# #...# #...# #.#.# #.#.# #.#.# .#.#." },
+	{ '&', ".##.. #..#. #.#.. .#... #.#.# #..#. .##.#" },
+	{ '8', ".###. #...# #...# .###. #...# #...# .###." },
+	{ '%', "##... ##..# ...#. ..#.. .#... #..## ...##" },
+	{ 'B', "####. #...# #...# ####. #...# #...# ####." },
+	{ '@', ".###. #...# ....# .##.# #.#.# #.#.# .###." },
+	{ '$', "..#.. .#### #.#.. .###. ..#.# ####. ..#.." }
+};
+
+// For every tone of both shading tables and every sample pattern, the glyph to draw, built on
+// first use
+class SubcellGlyphs
+{
+private:
+	struct Table
+	{
+		const char *glyphs;
+		int size;
+		std::vector<uint8_t> best;		// [tone * subcellPatterns + pattern], index into glyphs
+	};
+
+	Table tables[2];
+
+	// Ink over each subcell, 0 to 1; none for a glyph without a bitmap
+	static void inkOf(char glyph, float ink[subcellCount])
+	{
+		std::fill(ink, ink + subcellCount, 0.f);
+
+		const GlyphBitmap *bitmap = nullptr;
+		for (size_t i = 0; i < sizeof(glyphBitmaps) / sizeof(glyphBitmaps[0]); i++)
+		{
+			if (glyphBitmaps[i].glyph == glyph) bitmap = &glyphBitmaps[i];
+		}
+		if (!bitmap) return;
+
+		// subcells cover 2.5 by 2.33 pixels, so pixels on a boundary are shared by area
+		const float width = 5.f / subcellColumns, height = 7.f / subcellRows;
+		int x = 0, y = 0;
+		for (const char *c = bitmap->rows; *c; c++)
+		{
+			if (*c == ' ')
+			{
+				x = 0;
+				y++;
+				continue;
+			}
+			if (*c == '#')
+			{
+				for (int k = 0; k < subcellCount; k++)
+				{
+					float x0 = (k % subcellColumns) * width, y0 = (k / subcellColumns) * height;
+					float overlapX = std::min(x + 1.f, x0 + width) - std::max((float)x, x0);
+					float overlapY = std::min(y + 1.f, y0 + height) - std::max((float)y, y0);
+					if (overlapX > 0 && overlapY > 0) ink[k] += overlapX * overlapY / (width * height);
+				}
+			}
+			x++;
+		}
+	}
+
+	static void build(Table &table, const char *glyphs, int size)
+	{
+		table.glyphs = glyphs;
+		table.size = size;
+
+		// each glyph's ink less its mean, to unit length: its shape, whatever its brightness
+		// (all zero for a glyph whose ink is even)
+		std::vector<float> shapes(size * subcellCount);
+		for (int g = 0; g < size; g++)
+		{
+			float *shape = &shapes[g * subcellCount];
+			inkOf(glyphs[g], shape);
+			float mean = 0;
+			for (int k = 0; k < subcellCount; k++) mean += shape[k];
+			mean /= subcellCount;
+
+			float length = 0;
+			for (int k = 0; k < subcellCount; k++)
+			{
+				shape[k] -= mean;
+				length += shape[k] * shape[k];
+			}
+			length = std::sqrt(length);
+			for (int k = 0; k < subcellCount; k++) shape[k] = length > 1e-6f ? shape[k] / length : 0;
+		}
+
+		// only glyphs within an eighth of the table of the tone are considered, so the cell keeps
+		// its brightness
+		int window = std::max(size / 8, 1);
+		table.best.resize(size * subcellPatterns);
+		for (int tone = 0; tone < size; tone++)
+		{
+			// a flat pattern draws the tone's own glyph, as getShadingChar would
+			table.best[tone * subcellPatterns] = (uint8_t)tone;
+
+			for (int pattern = 1; pattern < subcellPatterns; pattern++)
+			{
+				// the pattern as +1 for brighter and -1 for darker, less its mean, to unit length
+				float wanted[subcellCount];
+				float mean = 0, length = 0;
+				for (int k = 0, p = pattern; k < subcellCount; k++, p /= 3)
+				{
+					wanted[k] = p % 3 == 1 ? 1.f : p % 3 == 2 ? -1.f : 0.f;
+					mean += wanted[k];
+				}
+				mean /= subcellCount;
+				for (int k = 0; k < subcellCount; k++)
+				{
+					wanted[k] -= mean;
+					length += wanted[k] * wanted[k];
+				}
+				length = std::sqrt(length);
+				if (length == 0)
+				{
+					// every subcell brighter, or every one darker: can't happen
+					table.best[tone * subcellPatterns + pattern] = (uint8_t)tone;
+					continue;
+				}
+				for (int k = 0; k < subcellCount; k++) wanted[k] /= length;
+
+				int best = tone;
+				float bestCost = FLT_MAX;
+				for (int g = std::max(tone - window, 0); g <= std::min(tone + window, size - 1); g++)
+				{
+					float away = (g - tone) / (float)window;
+					float correlation = 0;
+					for (int k = 0; k < subcellCount; k++) correlation += wanted[k] * shapes[g * subcellCount + k];
+
+					float cost = subcellToneWeight * away * away + 1 - correlation;
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						best = g;
+					}
+				}
+				table.best[tone * subcellPatterns + pattern] = (uint8_t)best;
+			}
+		}
+	}
+
+	SubcellGlyphs()
+	{
+		build(tables[(int)GlyphTable::Basic], shadingTable, (int)sizeof(shadingTable));
+		build(tables[(int)GlyphTable::Extended], extendedShadingTable, (int)sizeof(extendedShadingTable));
+	}
+
+public:
+	static const SubcellGlyphs& instance()
+	{
+		static const SubcellGlyphs glyphs;
+		return glyphs;
+	}
+
+	// Pattern of the samples of a cell (row-major) around their mean; 0 when they are all close
+	static int pattern(const float samples[subcellCount], float mean)
+	{
+		int result = 0;
+		for (int k = subcellCount - 1; k >= 0; k--)
+		{
+			int trit = samples[k] > mean + subcellContrast ? 1 : samples[k] < mean - subcellContrast ? 2 : 0;
+			result = result * 3 + trit;
+		}
+		return result;
+	}
+
+	// Glyph for a cell whose samples have this mean and pattern
+	char glyph(GlyphTable table, float mean, int pattern) const
+	{
+		const Table &glyphs = tables[(int)table];
+
+		// tone as getShadingChar finds it
+		int tone = mean * glyphs.size;
+		if (tone < 0) tone = 0;
+		if (tone >= glyphs.size) tone = glyphs.size - 1;
+
+		return glyphs.glyphs[glyphs.best[tone * subcellPatterns + pattern]];
+	}
+};
+
+// Renders with one ray per cell plus 2x3 subcell rays along edges (see above)
+class SubcellRenderer
+{
+private:
+	GlyphTable table = GlyphTable::Basic;
+	float edge = subcellEdge;
+	std::vector<float> centers;			// brightness of every cell's centre ray, row-major
+
+	struct Counters
+	{
+		uint64_t edgeCells;
+		char padding[56];
+	};
+	std::vector<Counters> counters;		// per worker
+
+	// Brightness along a primary ray: the brightest channel with colour, as renderFrame does
+	template <typename Math>
+	static float sample(const vec3 &orig, const vec3 &dir, const Scene &scene, bool color, vec3 &rgb, RayStats &stats)
+	{
+		stats.primaryRays++;
+		if (color) return cast_ray_color<Math>(orig, dir, scene, stats, rgb);
+		return cast_ray<Math>(orig, dir, scene, stats);
+	}
+
+	bool onEdge(int i, int j, int width, int height) const
+	{
+		float center = centers[j * width + i];
+		for (int y = std::max(j - 1, 0); y <= std::min(j + 1, height - 1); y++)
+		{
+			for (int x = std::max(i - 1, 0); x <= std::min(i + 1, width - 1); x++)
+			{
+				if (std::fabs(centers[y * width + x] - center) > edge) return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	void setTable(GlyphTable glyphs) { table = glyphs; }
+
+	// Contrast between neighbouring centre rays that marks an edge; FLT_MAX traces one ray per
+	// cell, for comparison
+	void setEdgeThreshold(float contrast) { edge = contrast; }
+
+	// Cells traced at subcell resolution since the last resetCounters()
+	uint64_t edgeCells() const
+	{
+		uint64_t total = 0;
+		for (size_t i = 0; i < counters.size(); i++) total += counters[i].edgeCells;
+		return total;
+	}
+
+	void resetCounters()
+	{
+		for (size_t i = 0; i < counters.size(); i++) counters[i].edgeCells = 0;
+	}
+
+	// Same output as renderFrame away from edges.  Math is the precision policy (see
+	// precision.h).
+	template <typename Math = ExactMath, typename Target>
+	void render(Target &target, int width, int height, const Scene &scene, Camera &camera, RayStats &stats, ThreadPool &pool)
+	{
+		camera.prepare(width, height);
+		centers.resize(width * height);
+		if ((int)counters.size() < pool.size())
+		{
+			Counters zero = {};
+			counters.resize(pool.size(), zero);
+		}
+
+		const SubcellGlyphs &glyphs = SubcellGlyphs::instance();
+		bool color = target.getColors() != nullptr;
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		// every centre ray first, since edges are found from the neighbours' too; an edge cell
+		// keeps the colour of its centre
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			for (int j = rect.y0; j < rect.y1; j++)
+			{
+				for (int i = rect.x0; i < rect.x1; i++)
+				{
+					vec3 rgb;
+					centers[j * width + i] = sample<Math>(camera.position, camera.rayDirection(i, j), scene, color, rgb, workerStats[worker].stats);
+					if (color) target.setColor(i, j, cellColor(rgb));
+				}
+			}
+		});
+
+		pool.parallelFor(tileCount(width, height), [&](int tile, int worker)
+		{
+			TileRect rect = tileRect(tile, width, height);
+			for (int j = rect.y0; j < rect.y1; j++)
+			{
+				for (int i = rect.x0; i < rect.x1; i++)
+				{
+					if (!onEdge(i, j, width, height))
+					{
+						target.setPixel(i, j, glyphs.glyph(table, centers[j * width + i], 0));
+						continue;
+					}
+
+					float samples[subcellCount];
+					float mean = 0;
+					for (int k = 0; k < subcellCount; k++)
+					{
+						float x = i + (k % subcellColumns + .5f) / subcellColumns;
+						float y = j + (k / subcellColumns + .5f) / subcellRows;
+						vec3 rgb;
+						samples[k] = sample<Math>(camera.position, camera.rayDirectionAt(x, y), scene, color, rgb, workerStats[worker].stats);
+						mean += samples[k];
+					}
+					mean /= subcellCount;
+
+					target.setPixel(i, j, glyphs.glyph(table, mean, SubcellGlyphs::pattern(samples, mean)));
+					counters[worker].edgeCells++;
+				}
+			}
+		});
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+	}
+};
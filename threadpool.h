@@ -0,0 +1,162 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Persistent pool of worker threads that runs batches of indexed tasks.
+//
+// Each worker (the calling thread is worker 0) owns a queue that starts out holding a
+// contiguous block of the batch's tasks, so neighbouring tasks stay on the same thread.
+// Workers take tasks from the front of their own queue; a worker whose queue runs dry
+// steals from the back of another worker's queue, so batches with uneven task cost
+// still finish together.
+class ThreadPool
+{
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	std::vector<std::thread> threads;
+	std::vector<WorkQueue> queues;			// one per worker, including the calling thread
+
+	std::function<void(int, int)> job;		// job(task, worker) for the current batch
+
+	std::mutex mutex;
+	std::condition_variable startCondition;
+	std::condition_variable doneCondition;
+	unsigned batch = 0;						// incremented to wake the workers for a new batch
+	int workersBusy = 0;
+	bool stopping = false;
+
+	bool popOwn(int worker, int &task)
+	{
+		WorkQueue &queue = queues[worker];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) return false;
+		task = queue.tasks.front();
+		queue.tasks.pop_front();
+		return true;
+	}
+
+	bool steal(int worker, int &task)
+	{
+		int count = (int)queues.size();
+		for (int i = 1; i < count; i++)
+		{
+			WorkQueue &victim = queues[(worker + i) % count];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (victim.tasks.empty()) continue;
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			return true;
+		}
+		return false;
+	}
+
+	// Run tasks until every queue is empty; no tasks are added once a batch has started
+	void work(int worker)
+	{
+		int task;
+		while (popOwn(worker, task) || steal(worker, task))
+		{
+			job(task, worker);
+		}
+	}
+
+	void workerLoop(int worker)
+	{
+		unsigned seenBatch = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				startCondition.wait(lock, [&] { return stopping || batch != seenBatch; });
+				if (stopping) return;
+				seenBatch = batch;
+			}
+
+			work(worker);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				workersBusy--;
+			}
+			doneCondition.notify_one();
+		}
+	}
+
+	static unsigned resolveThreadCount(unsigned threadCount)
+	{
+		if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+		return threadCount > 0 ? threadCount : 1;
+	}
+
+public:
+	// threadCount includes the calling thread; 0 uses every hardware thread
+	explicit ThreadPool(unsigned threadCount = 0) : queues(resolveThreadCount(threadCount))
+	{
+		for (size_t i = 1; i < queues.size(); i++)
+		{
+			threads.push_back(std::thread(&ThreadPool::workerLoop, this, (int)i));
+		}
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		startCondition.notify_all();
+		for (size_t i = 0; i < threads.size(); i++) threads[i].join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Number of workers, including the calling thread
+	int size() const { return (int)queues.size(); }
+
+	// Run job(task, worker) for every task in [0, taskCount) and wait for all of them.
+	// worker is in [0, size()) and identifies the thread, for per-thread accumulation.
+	void parallelFor(int taskCount, const std::function<void(int, int)> &batchJob)
+	{
+		int workers = size();
+		if (workers == 1 || taskCount <= 1)
+		{
+			for (int task = 0; task < taskCount; task++) batchJob(task, 0);
+			return;
+		}
+
+		// deal out contiguous blocks
+		for (int worker = 0; worker < workers; worker++)
+		{
+			int first = (int)((long long)taskCount * worker / workers);
+			int last = (int)((long long)taskCount * (worker + 1) / workers);
+
+			std::lock_guard<std::mutex> lock(queues[worker].mutex);
+			for (int task = first; task < last; task++) queues[worker].tasks.push_back(task);
+		}
+
+		job = batchJob;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			workersBusy = workers - 1;
+			batch++;
+		}
+		startCondition.notify_all();
+
+		work(0);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		doneCondition.wait(lock, [&] { return workersBusy == 0; });
+		job = nullptr;
+	}
+};
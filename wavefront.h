@@ -0,0 +1,318 @@
+#pragma once
+#include "renderer.h"
+#include <vector>
+#include <algorithm>
+
+// Wavefront rendering with reflected and refracted rays.
+//
+// Rather than following each cell's rays to the end before starting on the next cell, all rays
+// of a bounce go through one stage at a time:
+//
+//   generate   one primary ray per cell
+//   extend     closest hit for every queued ray
+//   compact    drop the rays that hit nothing
+//   shade      shadow rays towards every light, plus the reflected and refracted rays of the
+//              next bounce (compacted, so only rays that carry light are extended)
+//   shadow     occlusion for all shadow rays
+//   accumulate direct light of every hit, weighted by how much of it reaches the cell
+//
+// Every stage is one loop over structure-of-arrays queues, split into chunks for the thread
+// pool.  The console only shows the first colour channel, so that is the only one carried.
+// With one bounce the output is the same as renderFrame's.
+
+// Rays handed to a parallel stage at once
+const int wavefrontChunk = 256;
+
+// Rays of one bounce, one array per component
+struct RayQueue
+{
+	std::vector<float> ox, oy, oz;
+	std::vector<float> dx, dy, dz;
+	std::vector<float> weight;		// share of the light found by the ray that reaches its cell
+	std::vector<int> cell;
+
+	size_t size() const { return cell.size(); }
+
+	void resize(size_t n)
+	{
+		ox.resize(n); oy.resize(n); oz.resize(n);
+		dx.resize(n); dy.resize(n); dz.resize(n);
+		weight.resize(n);
+		cell.resize(n);
+	}
+
+	void set(size_t i, const vec3 &orig, const vec3 &dir, float w, int c)
+	{
+		ox[i] = orig.x; oy[i] = orig.y; oz[i] = orig.z;
+		dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+		weight[i] = w;
+		cell[i] = c;
+	}
+
+	vec3 orig(size_t i) const { return vec3(ox[i], oy[i], oz[i]); }
+	vec3 dir(size_t i) const { return vec3(dx[i], dy[i], dz[i]); }
+
+	// Keep the rays that carry any light, in order
+	void compact()
+	{
+		size_t live = 0;
+		for (size_t i = 0; i < size(); i++)
+		{
+			if (weight[i] == 0) continue;
+			set(live++, orig(i), dir(i), weight[i], cell[i]);
+		}
+		resize(live);
+	}
+};
+
+// Closest hits of a queue's rays; material is -1 where the ray hit nothing
+struct HitQueue
+{
+	std::vector<float> px, py, pz;
+	std::vector<float> nx, ny, nz;
+	std::vector<int> material;
+
+	size_t size() const { return material.size(); }
+
+	void resize(size_t n)
+	{
+		px.resize(n); py.resize(n); pz.resize(n);
+		nx.resize(n); ny.resize(n); nz.resize(n);
+		material.resize(n);
+	}
+
+	void set(size_t i, const vec3 &point, const vec3 &N, int m)
+	{
+		px[i] = point.x; py[i] = point.y; pz[i] = point.z;
+		nx[i] = N.x; ny[i] = N.y; nz[i] = N.z;
+		material[i] = m;
+	}
+
+	vec3 point(size_t i) const { return vec3(px[i], py[i], pz[i]); }
+	vec3 normal(size_t i) const { return vec3(nx[i], ny[i], nz[i]); }
+
+	// Keep the hits, along with the rays that made them
+	void compact(RayQueue &rays)
+	{
+		size_t live = 0;
+		for (size_t i = 0; i < size(); i++)
+		{
+			if (material[i] < 0) continue;
+			rays.set(live, rays.orig(i), rays.dir(i), rays.weight[i], rays.cell[i]);
+			set(live++, point(i), normal(i), material[i]);
+		}
+		rays.resize(live);
+		resize(live);
+	}
+};
+
+class WavefrontRenderer
+{
+private:
+	RayQueue rays;
+	RayQueue nextRays;			// two slots per hit: reflected, refracted
+	HitQueue hits;
+	std::vector<ShadowRay> shadowRays;	// one per hit and light
+	std::vector<char> occluded;
+	std::vector<float> contribution;		// per hit
+	std::vector<float> radiance;			// per cell
+	std::vector<char> primaryHit;			// per cell
+
+	// run stage(begin, end, stats) over [0, count) in chunks on the pool
+	template <typename Stage>
+	static void forEachChunk(ThreadPool &pool, size_t count, std::vector<WorkerRayStats> &workerStats, Stage stage)
+	{
+		int chunks = (int)((count + wavefrontChunk - 1) / wavefrontChunk);
+		pool.parallelFor(chunks, [&](int chunk, int worker)
+		{
+			size_t begin = (size_t)chunk * wavefrontChunk;
+			size_t end = std::min(begin + wavefrontChunk, count);
+			stage(begin, end, workerStats[worker].stats);
+		});
+	}
+
+	void generate(int width, int height, const Camera &camera)
+	{
+		WT_PROFILE_SCOPE(RayGeneration);
+		rays.resize(width * height);
+		for (int j = 0; j < height; j++)
+		{
+			for (int i = 0; i < width; i++)
+			{
+				rays.set(j * width + i, camera.position, camera.rayDirection(i, j), 1, j * width + i);
+			}
+		}
+	}
+
+	template <typename Math>
+	void extend(const Scene &scene, bool primary, ThreadPool &pool, std::vector<WorkerRayStats> &workerStats)
+	{
+		hits.resize(rays.size());
+		forEachChunk(pool, rays.size(), workerStats, [&](size_t begin, size_t end, RayStats &stats)
+		{
+			for (size_t r = begin; r < end; r++)
+			{
+				vec3 point, N;
+				const Material *material;
+				if (scene_intersect<Math>(rays.orig(r), rays.dir(r), scene, point, N, material))
+					hits.set(r, point, N, (int)(material - scene.materials.data()));
+				else
+					hits.material[r] = -1;
+			}
+			if (primary) stats.primaryRays += end - begin;
+			else stats.secondaryRays += end - begin;
+		});
+	}
+
+	template <typename Math>
+	void shade(const Scene &scene, bool lastBounce, ThreadPool &pool, std::vector<WorkerRayStats> &workerStats)
+	{
+		const std::vector<Light> &lights = scene.lights;
+		size_t lightCount = lights.size();
+
+		shadowRays.resize(hits.size() * lightCount);
+		nextRays.resize(lastBounce ? 0 : hits.size() * 2);
+
+		forEachChunk(pool, hits.size(), workerStats, [&](size_t begin, size_t end, RayStats &)
+		{
+			for (size_t h = begin; h < end; h++)
+			{
+				vec3 point = hits.point(h);
+				vec3 N = hits.normal(h);
+
+				for (size_t l = 0; l < lightCount; l++)
+				{
+					float light_distance;
+					vec3 light_dir = Math::normalize(lights[l].position - point, light_distance);
+
+					ShadowRay &shadowRay = shadowRays[h * lightCount + l];
+					shadowRay.orig = light_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+					shadowRay.dir = light_dir;
+					shadowRay.maxDistance = std::min(light_distance, 1000.f);
+				}
+
+				if (lastBounce) continue;
+
+				const Material &material = scene.materials[hits.material[h]];
+				vec3 dir = rays.dir(h);
+
+				vec3 reflect_dir = Math::normalize(reflect(dir, N));
+				vec3 reflect_orig = reflect_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+				nextRays.set(2 * h, reflect_orig, reflect_dir, rays.weight[h] * material.albedo[2], rays.cell[h]);
+
+				// all of the light is reflected past the critical angle
+				vec3 refract_dir;
+				if (refract(dir, N, material.refractive_index, refract_dir)) refract_dir = Math::normalize(refract_dir);
+				else refract_dir = reflect_dir;
+				vec3 refract_orig = refract_dir * N < 0 ? point - N * 1e-3 : point + N * 1e-3;
+				nextRays.set(2 * h + 1, refract_orig, refract_dir, rays.weight[h] * material.albedo[3], rays.cell[h]);
+			}
+		});
+
+		nextRays.compact();
+	}
+
+	void shadow(const Scene &scene, ThreadPool &pool, std::vector<WorkerRayStats> &workerStats)
+	{
+		size_t lightCount = scene.lights.size();
+		occluded.resize(shadowRays.size());
+
+		forEachChunk(pool, hits.size(), workerStats, [&](size_t begin, size_t end, RayStats &stats)
+		{
+			for (size_t h = begin; h < end; h++)
+			{
+				for (size_t batchStart = 0; batchStart < lightCount; batchStart += maxShadowBatch)
+				{
+					int batchSize = (int)std::min(lightCount - batchStart, (size_t)maxShadowBatch);
+					bool inShadow[maxShadowBatch];
+					scene_occluded_batch(&shadowRays[h * lightCount + batchStart], batchSize, scene, inShadow);
+					for (int b = 0; b < batchSize; b++) occluded[h * lightCount + batchStart + b] = inShadow[b];
+				}
+			}
+			stats.shadowRays += (end - begin) * lightCount;
+		});
+	}
+
+	template <typename Math>
+	void accumulate(const Scene &scene, ThreadPool &pool, std::vector<WorkerRayStats> &workerStats)
+	{
+		const std::vector<Light> &lights = scene.lights;
+		size_t lightCount = lights.size();
+		contribution.resize(hits.size());
+
+		forEachChunk(pool, hits.size(), workerStats, [&](size_t begin, size_t end, RayStats &)
+		{
+			for (size_t h = begin; h < end; h++)
+			{
+				const Material &material = scene.materials[hits.material[h]];
+				vec3 N = hits.normal(h);
+				vec3 dir = rays.dir(h);
+
+				// the same sums, in the same order, as shade()
+				float diffuse_light_intensity = 0, specular_light_intensity = 0;
+				for (size_t l = 0; l < lightCount; l++)
+				{
+					if (occluded[h * lightCount + l])
+						continue;
+
+					float intensity = lights[l].intensity;
+					if (lights[l].range != FLT_MAX) intensity *= lightFalloff((lights[l].position - hits.point(h)).norm(), lights[l].range);
+
+					const vec3 &light_dir = shadowRays[h * lightCount + l].dir;
+					diffuse_light_intensity += intensity * std::max(0.f, (light_dir * N));
+					specular_light_intensity += Math::pow(std::max(0.f, -reflect(-light_dir, N)*dir), material.specular_exponent)*intensity;
+				}
+
+				float out = (material.diffuse_color * diffuse_light_intensity * material.albedo[0] + vec3(1., 1., 1.)*specular_light_intensity * material.albedo[1]).x;
+				contribution[h] = rays.weight[h] * out;
+			}
+		});
+
+		// several rays of a bounce can belong to one cell; adding them up in queue order keeps
+		// the result independent of the thread count
+		for (size_t h = 0; h < hits.size(); h++) radiance[rays.cell[h]] += contribution[h];
+	}
+
+public:
+	// Same interface as renderFrame; bounces is the number of rays followed along each path,
+	// so 1 traces only primary rays.  Math is the precision policy (see precision.h).
+	template <typename Math = ExactMath, typename Target>
+	void render(Target &target, int width, int height, const Scene &scene, Camera &camera, int bounces, RayStats &stats, ThreadPool &pool)
+	{
+		camera.prepare(width, height);
+		std::vector<WorkerRayStats> workerStats(pool.size());
+
+		radiance.assign(width * height, 0.f);
+		primaryHit.assign(width * height, 0);
+
+		generate(width, height, camera);
+		for (int bounce = 0; bounce < bounces && rays.size() > 0; bounce++)
+		{
+			extend<Math>(scene, bounce == 0, pool, workerStats);
+			hits.compact(rays);
+
+			if (bounce == 0)
+			{
+				for (size_t h = 0; h < rays.size(); h++) primaryHit[rays.cell[h]] = 1;
+			}
+
+			shade<Math>(scene, bounce + 1 == bounces, pool, workerStats);
+			shadow(scene, pool, workerStats);
+			accumulate<Math>(scene, pool, workerStats);
+
+			std::swap(rays, nextRays);
+		}
+
+		for (int j = 0; j < height; j++)
+		{
+			for (int i = 0; i < width; i++)
+			{
+				// cells whose primary ray hit something never go fully dark, as in cast_ray
+				float val = primaryHit[j * width + i] ? std::max(radiance[j * width + i], .01f) : 0;
+				target.setPixel(i, j, getShadingChar(val));
+			}
+		}
+
+		for (size_t i = 0; i < workerStats.size(); i++) stats += workerStats[i].stats;
+	}
+};